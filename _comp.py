@@ -9,6 +9,9 @@ Options:
   -h  --help        Prints this docstring.
   -l  --launch      Executes the bin if compiled, with what follows as args.
   -d  --debug       Standard debuging build, defines DEBUG, launches with -d.
+  -L  --lib         Also builds libhelv (static and shared), see src/helv.h.
+  -c  --check-level Followed by the default check level of the assertions of
+                    debug builds, from 0 to 3 (see src/utils.h).
 
 Example usage for debug:
   {this_script} -d -l
@@ -46,10 +49,17 @@ def cmdline_has_option(*option_names):
 	return False
 option_help = cmdline_has_option("-h", "--help")
 option_debug = cmdline_has_option("-d", "--debug")
+option_lib = cmdline_has_option("-L", "--lib")
+option_check_level = None
+for option_name in ("-c", "--check-level"):
+	if option_name in options[:-1]:
+		option_check_level = options[options.index(option_name) + 1]
 release_build = not option_debug
 src_dir_name = "src"
 bin_dir_name = "bin"
 bin_name = "helv"
+lib_name = "libhelv"
+main_file_name = "main.c"
 
 # Help message if -h
 if option_help:
@@ -137,16 +147,54 @@ build_command_args.append("-Wno-overlength-strings")
 if option_debug:
 	build_command_args.append("-DDEBUG")
 	build_command_args.append("-g")
+if option_check_level is not None:
+	build_command_args.append("-DCHECK_LEVEL=" + option_check_level)
 if release_build:
 	build_command_args.append("-O2")
 	build_command_args.append("-fno-stack-protector")
-	build_command_args.append("-flto")
+	build_command_args.append("-flto=auto")
 build_command_args.append("-lm")
+build_command_args.append("-pthread")
+build_command_args.append("-ldl")
 build_command = " ".join(build_command_args)
 print_blue(("RELEASE" if release_build else "DEBUG") + " BUILD")
 print_blue(build_command)
 build_exit_status = os.system(build_command)
 
+# Library build if -L
+if option_lib and build_exit_status == 0:
+	lib_src_file_names = [src_file_name for src_file_name in src_file_names
+		if os.path.basename(src_file_name) != main_file_name]
+	obj_dir_name = os.path.join(bin_dir_name, "obj")
+	if not os.path.exists(obj_dir_name):
+		os.makedirs(obj_dir_name)
+	lib_flags = [flag for flag in build_command_args[1:]
+		if flag.startswith("-I") or flag.startswith("-D") or
+		flag.startswith("-W") or flag.startswith("-O") or
+		flag in ("-std=c11", "-pedantic", "-g", "-fno-stack-protector")]
+	obj_file_names = []
+	for src_file_name in lib_src_file_names:
+		obj_file_name = os.path.join(obj_dir_name,
+			os.path.basename(src_file_name)[:-len(".c")] + ".o")
+		obj_file_names.append(obj_file_name)
+		compile_command = " ".join(["gcc", "-c", "-fPIC", src_file_name,
+			"-o", obj_file_name] + lib_flags)
+		print_blue(compile_command)
+		build_exit_status = os.system(compile_command)
+		if build_exit_status != 0:
+			break
+	if build_exit_status == 0:
+		static_lib_command = " ".join(["ar", "rcs",
+			os.path.join(bin_dir_name, lib_name + ".a")] + obj_file_names)
+		print_blue(static_lib_command)
+		build_exit_status = os.system(static_lib_command)
+	if build_exit_status == 0:
+		shared_lib_command = " ".join(["gcc", "-shared", "-o",
+			os.path.join(bin_dir_name, lib_name + ".so")] + obj_file_names +
+			["-lm", "-pthread", "-ldl"])
+		print_blue(shared_lib_command)
+		build_exit_status = os.system(shared_lib_command)
+
 # Launch if -l
 if option_launch and build_exit_status == 0:
 	launch_command_args = ["./" + bin_name]
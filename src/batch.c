@@ -0,0 +1,316 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "batch.h"
+#include "utils.h"
+#include "gs.h"
+#include "prog.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "emit_c.h"
+#include "optim.h"
+#include "preproc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* strlen, strrchr, strcmp, memcpy */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h> /* clock_gettime */
+
+/* Output captured from an executed job. */
+struct out_buf_t
+{
+	unsigned int len;
+	unsigned int cap;
+	uint8_t* array;
+};
+typedef struct out_buf_t out_buf_t;
+
+struct job_t
+{
+	const char* file_path;
+	char* c_file_path; /* When compiling. */
+	int has_failed;
+	const char* error; /* Why it failed, static string. */
+	char* st_dump; /* The stack when the execution failed, with dump_stack. */
+	double time_ms;
+	out_buf_t out;
+};
+typedef struct job_t job_t;
+
+struct batch_t
+{
+	job_t* job_array;
+	unsigned int job_count;
+	atomic_uint next_job_index; /* The only state shared by the workers. */
+	const batch_opt_t* opt;
+};
+typedef struct batch_t batch_t;
+
+static void out_buf_write(void* data, const uint8_t* bytes, unsigned int len)
+{
+	out_buf_t* out = data;
+	out->len += len;
+	DARRAY_RESIZE_IF_NEEDED(out->len, out->cap, out->array, uint8_t);
+	memcpy(&out->array[out->len - len], bytes, len);
+}
+
+static double time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Returns the allocated path of the C file that corresponds to the given
+ * Helv source file. */
+static char* c_file_path(const char* file_path, const char* dst_dir)
+{
+	const char* name = file_path;
+	unsigned int dir_len = 0;
+	const char* last_slash = strrchr(file_path, '/');
+	if (last_slash != NULL)
+	{
+		name = last_slash + 1;
+		dir_len = name - file_path;
+	}
+	if (dst_dir != NULL)
+	{
+		file_path = dst_dir;
+		dir_len = strlen(dst_dir);
+	}
+	unsigned int name_len = strlen(name);
+	const char* dot = strrchr(name, '.');
+	if (dot != NULL)
+	{
+		name_len = dot - name;
+	}
+	char* path = xmalloc(dir_len + 1 + name_len + 3);
+	memcpy(path, file_path, dir_len);
+	if (dst_dir != NULL && dir_len > 0 && dst_dir[dir_len-1] != '/')
+	{
+		path[dir_len++] = '/';
+	}
+	memcpy(&path[dir_len], name, name_len);
+	memcpy(&path[dir_len + name_len], ".c", 3);
+	return path;
+}
+
+static void batch_do_job(const batch_t* batch, job_t* job)
+{
+	if (job->has_failed)
+	{
+		/* Rejected before the jobs started. */
+		return;
+	}
+	const batch_opt_t* opt = batch->opt;
+	double start = time_ms();
+	char* src = read_file(job->file_path);
+	if (src == NULL)
+	{
+		job->has_failed = 1;
+		job->error = "cannot read the file";
+		return;
+	}
+	char* expanded_src = preproc_src(src, job->file_path);
+	free(src);
+	if (expanded_src == NULL)
+	{
+		job->has_failed = 1;
+		job->error = "preprocessor error";
+		return;
+	}
+	full_prog_t full_prog = {0};
+	parse_full_prog(expanded_src, &full_prog);
+	free(expanded_src);
+	if (opt->execute)
+	{
+		if (opt->optimize)
+		{
+			optim_full_prog(&full_prog, NULL);
+		}
+		vm_t vm = {
+			.out_write = out_buf_write,
+			.out_data = &job->out,
+			.max_steps = opt->max_steps,
+			.timeout_ms = opt->timeout_ms,
+			.max_depth = opt->max_depth,
+		};
+		exec_status_t status = execute_full_prog(&full_prog, &vm);
+		if (exec_status_is_error(status))
+		{
+			job->has_failed = 1;
+			job->error = exec_status_name(status);
+			if (opt->dump_stack)
+			{
+				gs_t dump;
+				gs_init(&dump);
+				gs_append_f(&dump, "Stack (height %u, bottom first):",
+					vm.st.len);
+				for (unsigned int i = 0; i < vm.st.len; i++)
+				{
+					gs_append_f(&dump, " %u", (unsigned int)vm.st.array[i]);
+				}
+				job->st_dump = dump.str;
+			}
+		}
+		vm_cleanup(&vm);
+	}
+	else
+	{
+		gs_t gs;
+		gs_init(&gs);
+		emit_c_opt_t emit_opt = {
+			.instrument = opt->instrument,
+			.single_function = opt->single_function,
+			.dump_stack = opt->dump_stack,
+			.max_steps = opt->max_steps,
+			.timeout_ms = opt->timeout_ms,
+			.max_depth = opt->max_depth,
+		};
+		st_t initial_st = {0};
+		if (opt->debug_info)
+		{
+			emit_opt.src_file_path = job->file_path;
+		}
+		if (opt->optimize)
+		{
+			emit_opt.entry_offset = optim_full_prog(&full_prog, &initial_st);
+			emit_opt.initial_st = initial_st.array;
+			emit_opt.initial_st_len = initial_st.len;
+		}
+		emit_c_full_prog(&gs, &full_prog, &emit_opt);
+		st_cleanup(&initial_st);
+		FILE* dst_file = fopen(job->c_file_path, "w");
+		if (dst_file == NULL)
+		{
+			job->has_failed = 1;
+			job->error = "cannot write the C file";
+		}
+		else
+		{
+			fputs(gs.str, dst_file);
+			fclose(dst_file);
+		}
+		gs_cleanup(&gs);
+	}
+	full_prog_cleanup(&full_prog);
+	job->time_ms = time_ms() - start;
+}
+
+static void* batch_worker(void* data)
+{
+	batch_t* batch = data;
+	unsigned int job_index;
+	while ((job_index = atomic_fetch_add(&batch->next_job_index, 1)) <
+		batch->job_count)
+	{
+		batch_do_job(batch, &batch->job_array[job_index]);
+	}
+	return NULL;
+}
+
+unsigned int batch_run(const char** file_paths, unsigned int file_count,
+	unsigned int thread_count, const batch_opt_t* opt)
+{
+	ASSERT(file_paths != NULL || file_count == 0, "The pointer is NULL\n");
+	ASSERT(opt != NULL, "The pointer is NULL\n");
+	batch_t batch = {
+		.job_array = xcalloc(file_count, sizeof(job_t)),
+		.job_count = file_count,
+		.opt = opt,
+	};
+	atomic_init(&batch.next_job_index, 0);
+	for (unsigned int i = 0; i < file_count; i++)
+	{
+		job_t* job = &batch.job_array[i];
+		job->file_path = file_paths[i];
+		if (opt->execute)
+		{
+			continue;
+		}
+		job->c_file_path = c_file_path(file_paths[i], opt->dst_dir);
+		for (unsigned int j = 0; j < i; j++)
+		{
+			/* Such as "a/x.hv" and "b/x.hv" with -o, or the same file twice. */
+			if (strcmp(batch.job_array[j].c_file_path, job->c_file_path) == 0)
+			{
+				job->has_failed = 1;
+				job->error = "same C file as an earlier file";
+				break;
+			}
+		}
+	}
+	if (thread_count > file_count)
+	{
+		thread_count = file_count;
+	}
+	if (thread_count < 1)
+	{
+		thread_count = 1;
+	}
+
+	double start = time_ms();
+	/* The calling thread is one of the workers. */
+	pthread_t* thread_array = xmalloc(thread_count * sizeof(pthread_t));
+	unsigned int started_count = 0;
+	for (unsigned int i = 1; i < thread_count; i++)
+	{
+		if (pthread_create(&thread_array[i], NULL,
+			batch_worker, &batch) == 0)
+		{
+			started_count = i;
+		}
+		else
+		{
+			break;
+		}
+	}
+	batch_worker(&batch);
+	for (unsigned int i = 1; i <= started_count; i++)
+	{
+		pthread_join(thread_array[i], NULL);
+	}
+	free(thread_array);
+	double total_ms = time_ms() - start;
+
+	unsigned int failed_count = 0;
+	for (unsigned int i = 0; i < file_count; i++)
+	{
+		job_t* job = &batch.job_array[i];
+		if (job->out.len > 0)
+		{
+			fwrite(job->out.array, 1, job->out.len, stdout);
+		}
+		free(job->out.array);
+		free(job->c_file_path);
+	}
+	fflush(stdout);
+	fprintf(stderr, "Batch summary:\n");
+	for (unsigned int i = 0; i < file_count; i++)
+	{
+		job_t* job = &batch.job_array[i];
+		if (job->has_failed)
+		{
+			failed_count++;
+			fprintf(stderr, "  FAIL %9.3f ms  %s (%s)\n",
+				job->time_ms, job->file_path, job->error);
+			if (job->st_dump != NULL)
+			{
+				fprintf(stderr, "    %s\n", job->st_dump);
+				free(job->st_dump);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "  ok   %9.3f ms  %s\n",
+				job->time_ms, job->file_path);
+		}
+	}
+	fprintf(stderr, "%u/%u ok, %u thread%s, %.3f ms\n",
+		file_count - failed_count, file_count,
+		started_count + 1, started_count == 0 ? "" : "s", total_ms);
+	free(batch.job_array);
+	return failed_count;
+}
@@ -0,0 +1,36 @@
+
+#ifndef HELV_BATCH_HEADER
+#define HELV_BATCH_HEADER
+
+/* Options of batch mode, that are those of single files (see emit_c_opt_t
+ * and vm_t), except for the ones that cannot apply to many files. */
+struct batch_opt_t
+{
+	int execute; /* Executes the files instead of compiling them. */
+	int optimize;
+	int debug_info; /* The C code has #line directives to the sources. */
+	int instrument;
+	int single_function;
+	/* The stack of a failed execution is in the summary. */
+	int dump_stack;
+	const char* dst_dir; /* If not NULL, where the C files go. */
+	/* Limits of each job, zero meaning no limit (see vm_t). */
+	unsigned int max_steps;
+	unsigned int timeout_ms;
+	unsigned int max_depth;
+};
+typedef struct batch_opt_t batch_opt_t;
+
+/* Batch mode, processes many source files with a pool of worker threads.
+ * Each file is a job with its own full program and execution context,
+ * the output of each job is captured and printed after all the jobs are done
+ * (in the given order), followed by a summary on stderr.
+ * When compiling, the C code of "dir/name.hv" goes to "dir/name.c", or to
+ * "dst_dir/name.c" if dst_dir is not NULL. A job whose C file would be the
+ * one of an earlier job fails instead of overwriting it.
+ * Executed programs have nothing to read.
+ * Returns the number of jobs that failed. */
+unsigned int batch_run(const char** file_paths, unsigned int file_count,
+	unsigned int thread_count, const batch_opt_t* opt);
+
+#endif /* HELV_BATCH_HEADER */
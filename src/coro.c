@@ -0,0 +1,179 @@
+
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS, MAP_NORESERVE */
+
+#include "coro.h"
+#include "utils.h"
+#include "prog.h"
+#include "interpreter.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h> /* memcpy */
+#include <ucontext.h>
+#include <unistd.h> /* sysconf */
+#include <sys/mman.h> /* mmap, mprotect, munmap */
+
+/* Size of the C stack of a coroutine, as big as a default main thread stack
+ * so that it holds as many nested executions (see VM_DEFAULT_MAX_DEPTH). It
+ * is only reserved, its pages are only backed once the coroutine reaches
+ * them. A page that cannot be accessed lies below it (as stacks grow down),
+ * so that overflowing it faults instead of overwriting other memory. */
+#define CORO_C_STACK_SIZE (8u << 20)
+
+enum coro_state_t
+{
+	CORO_STATE_SUSPENDED = 0, /* Created or yielded. */
+	CORO_STATE_RUNNING,
+	CORO_STATE_ENDED,
+};
+typedef enum coro_state_t coro_state_t;
+
+struct coro_t
+{
+	const full_prog_t* full_prog;
+	unsigned int prog_index;
+	vm_t* vm;
+	coro_state_t state;
+	st_t st; /* Own stack while suspended, resumer's stack while running. */
+	unsigned int depth; /* Same, for the nesting depth of the executions. */
+	ucontext_t context;
+	ucontext_t resumer_context;
+	coro_t* resumer_coro; /* Coroutine of the resumer, NULL if none. */
+	unsigned int yield_count; /* Cells given back by the last switch. */
+	exec_status_t status; /* Once ended. */
+	void* c_stack;
+};
+
+/* Returns the lowest address of a new C stack (above its guard page),
+ * or NULL if it cannot be mapped. */
+static void* coro_c_stack_map(void)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uint8_t* mapping = mmap(NULL, page_size + CORO_C_STACK_SIZE,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0);
+	if (mapping == MAP_FAILED)
+	{
+		return NULL;
+	}
+	if (mprotect(mapping, page_size, PROT_NONE) != 0)
+	{
+		munmap(mapping, page_size + CORO_C_STACK_SIZE);
+		return NULL;
+	}
+	return mapping + page_size;
+}
+
+static void coro_c_stack_unmap(void* c_stack)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	munmap((uint8_t*)c_stack - page_size, page_size + CORO_C_STACK_SIZE);
+}
+
+/* Moves the given number of cells from the top of a stack to another. */
+static void st_move_cells(st_t* dst, st_t* src, unsigned int cell_count)
+{
+	ASSERT(cell_count <= src->len, "There are not enough cells\n");
+	if (cell_count == 0)
+	{
+		return;
+	}
+	dst->len += cell_count;
+	DARRAY_RESIZE_IF_NEEDED(dst->len, dst->cap, dst->array, uint8_t);
+	ST_UPDATE_PEAK(dst);
+	memcpy(&dst->array[dst->len - cell_count],
+		&src->array[src->len - cell_count], cell_count);
+	src->len -= cell_count;
+}
+
+/* The pointer to the coroutine is split in two as makecontext only passes
+ * int arguments. */
+static void coro_entry(unsigned int high, unsigned int low)
+{
+	coro_t* coro = (coro_t*)(((uintptr_t)high << 16 << 16) | (uintptr_t)low);
+	coro->status = execute_prog(coro->full_prog, coro->prog_index, coro->vm);
+	coro->state = CORO_STATE_ENDED;
+	coro->yield_count = coro->vm->st.len;
+	setcontext(&coro->resumer_context);
+}
+
+coro_t* coro_create(const full_prog_t* full_prog, unsigned int prog_index,
+	vm_t* vm)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	void* c_stack = coro_c_stack_map();
+	if (c_stack == NULL)
+	{
+		return NULL;
+	}
+	coro_t* coro = xcalloc(1, sizeof(coro_t));
+	coro->full_prog = full_prog;
+	coro->prog_index = prog_index;
+	coro->vm = vm;
+	coro->c_stack = c_stack;
+	getcontext(&coro->context);
+	coro->context.uc_stack.ss_sp = coro->c_stack;
+	coro->context.uc_stack.ss_size = CORO_C_STACK_SIZE;
+	coro->context.uc_link = NULL;
+	uintptr_t pointer = (uintptr_t)coro;
+	makecontext(&coro->context, (void (*)(void))coro_entry, 2,
+		(unsigned int)(pointer >> 16 >> 16), (unsigned int)pointer);
+	return coro;
+}
+
+void coro_destroy(coro_t* coro)
+{
+	ASSERT(coro != NULL, "The pointer is NULL\n");
+	ASSERT(coro->state != CORO_STATE_RUNNING,
+		"A running coroutine cannot be destroyed\n");
+	st_cleanup(&coro->st);
+	coro_c_stack_unmap(coro->c_stack);
+	free(coro);
+}
+
+int coro_is_running(const coro_t* coro)
+{
+	ASSERT(coro != NULL, "The pointer is NULL\n");
+	return coro->state == CORO_STATE_RUNNING;
+}
+
+exec_status_t coro_resume(coro_t* coro, unsigned int cell_count,
+	int* has_ended)
+{
+	ASSERT(coro != NULL, "The pointer is NULL\n");
+	ASSERT(coro->state == CORO_STATE_SUSPENDED,
+		"Only a suspended coroutine can be resumed\n");
+	vm_t* vm = coro->vm;
+	st_move_cells(&coro->st, &vm->st, cell_count);
+	st_t resumer_st = vm->st;
+	vm->st = coro->st;
+	coro->st = resumer_st;
+	unsigned int resumer_depth = vm->depth;
+	vm->depth = coro->depth;
+	coro->depth = resumer_depth;
+	coro->resumer_coro = vm->coro;
+	vm->coro = coro;
+	coro->state = CORO_STATE_RUNNING;
+	swapcontext(&coro->resumer_context, &coro->context);
+	vm->coro = coro->resumer_coro;
+	st_t coro_st = vm->st;
+	vm->st = coro->st;
+	coro->st = coro_st;
+	unsigned int coro_depth = vm->depth;
+	vm->depth = coro->depth;
+	coro->depth = coro_depth;
+	st_move_cells(&vm->st, &coro->st, coro->yield_count);
+	*has_ended = coro->state == CORO_STATE_ENDED;
+	return *has_ended ? coro->status : EXEC_STATUS_OK;
+}
+
+void coro_yield(vm_t* vm, unsigned int cell_count)
+{
+	ASSERT_CHECK_VM_PTR(vm);
+	coro_t* coro = vm->coro;
+	ASSERT(coro != NULL, "No coroutine is being executed\n");
+	ASSERT(cell_count <= vm->st.len, "There are not enough cells\n");
+	coro->yield_count = cell_count;
+	coro->state = CORO_STATE_SUSPENDED;
+	swapcontext(&coro->context, &coro->resumer_context);
+}
@@ -0,0 +1,40 @@
+
+#ifndef HELV_CORO_HEADER
+#define HELV_CORO_HEADER
+
+#include "prog.h"
+#include "interpreter.h"
+#include <stdint.h>
+
+/* Coroutine created by the create instruction, it executes a program with its
+ * own stack of cells and its own call frames (on its own C stack, switched to
+ * with ucontext), in the execution context that created it.
+ * While a coroutine runs, its stack is the stack of the execution context,
+ * and the stack of whoever resumed it is kept in the coroutine. */
+typedef struct coro_t coro_t;
+
+/* The coroutine starts executing the given program when first resumed.
+ * Returns NULL if its C stack cannot be allocated. */
+coro_t* coro_create(const full_prog_t* full_prog, unsigned int prog_index,
+	vm_t* vm);
+
+void coro_destroy(coro_t* coro);
+
+/* Returns non-zero if the coroutine is being executed (possibly in the middle
+ * of resuming another coroutine), it cannot be resumed then. */
+int coro_is_running(const coro_t* coro);
+
+/* Moves the given number of cells from the top of the stack of the execution
+ * context to the stack of the coroutine, and executes it until it yields or
+ * ends. The cells it yields are pushed, or its whole stack if it ended.
+ * The ended flag is set to non-zero if the coroutine ended, with the status
+ * of its execution being returned. */
+exec_status_t coro_resume(coro_t* coro, unsigned int cell_count,
+	int* has_ended);
+
+/* Gives back the execution to whoever resumed the coroutine being executed
+ * by the given context, along with the given number of cells from the top of
+ * its stack. Returns when the coroutine is resumed again. */
+void coro_yield(vm_t* vm, unsigned int cell_count);
+
+#endif /* HELV_CORO_HEADER */
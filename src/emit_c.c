@@ -2,17 +2,327 @@
 #include "utils.h"
 #include "gs.h"
 #include "prog.h"
+#include "interpreter.h"
+#include "emit_c.h"
 
-/* Appends C code to the given growable string,
- * the generated C code corresponds to the given program. */
-static void emit_c_prog(gs_t* gs, const prog_t* prog)
+/* Stack effect of a program that gets a register variant, which is a C
+ * function that takes the cells it pops as arguments (the top first) and
+ * returns the cells it pushes (the bottom first), see emit_c_reg_variant. */
+struct reg_sig_t
 {
+	int is_known; /* Zero if the program has no register variant. */
+	unsigned int pop_count;
+	unsigned int push_count;
+};
+typedef struct reg_sig_t reg_sig_t;
+
+/* Limits of the programs that get register variants, that are meant for
+ * small helpers. */
+#define REG_MAX_CELLS 8
+#define REG_MAX_STACK 32
+#define REG_MAX_LEN 128
+
+/* Value of a cell in a register variant. */
+struct reg_value_t
+{
+	char kind; /* 'c' for a constant, 'a' for an argument, 'v' for a local. */
+	unsigned int n;
+};
+typedef struct reg_value_t reg_value_t;
+
+static char* reg_value_name(char* buffer, reg_value_t value)
+{
+	if (value.kind == 'c')
+	{
+		sprintf(buffer, "%u", value.n);
+	}
+	else
+	{
+		sprintf(buffer, "%c%u", value.kind, value.n);
+	}
+	return buffer;
+}
+
+/* Analyzes the given program and fills the given signature. If the given
+ * growable string is not NULL (and the signature is known), the register
+ * variant of the program (of the given index) is appended to it.
+ * Only the programs that do not depend on the stack height nor on anything
+ * below the cells they pop, and that only pop, push and print, get one. */
+static void emit_c_reg_variant(gs_t* gs, const prog_t* prog,
+	unsigned int prog_index, reg_sig_t* sig)
+{
+	ASSERT_CHECK_PROG_PTR(prog);
+	ASSERT(gs == NULL || sig->is_known,
+		"Only a known signature can be emitted\n");
+	#define EMIT(...) ((void)(gs != NULL && (gs_append_f(gs, __VA_ARGS__), 1)))
+	if (gs != NULL)
+	{
+		if (sig->push_count == 0)
+		{
+			EMIT("static void ");
+		}
+		else if (sig->push_count == 1)
+		{
+			EMIT("static uint8_t ");
+		}
+		else
+		{
+			EMIT("static struct cells_%u ", sig->push_count);
+		}
+		EMIT("prog_%u_r(", prog_index);
+		for (unsigned int j = 0; j < sig->pop_count; j++)
+		{
+			EMIT("%suint8_t a%u", j == 0 ? "" : ", ", j);
+		}
+		EMIT("%s)\n{\n", sig->pop_count == 0 ? "void" : "");
+	}
+	reg_value_t stack[REG_MAX_STACK];
+	unsigned int len = 0;
+	unsigned int arg_count = 0;
+	unsigned int local_count = 0;
+	char name_x[16];
+	char name_y[16];
+	int is_known = prog->len <= REG_MAX_LEN;
+	#define POP(value_) \
+		do \
+		{ \
+			if (len > 0) \
+			{ \
+				value_ = stack[--len]; \
+			} \
+			else if (arg_count < REG_MAX_CELLS) \
+			{ \
+				value_ = (reg_value_t){'a', arg_count++}; \
+			} \
+			else \
+			{ \
+				is_known = 0; \
+			} \
+		} while (0)
+	#define PUSH(value_) \
+		do \
+		{ \
+			if (len < REG_MAX_STACK) \
+			{ \
+				stack[len++] = value_; \
+			} \
+			else \
+			{ \
+				is_known = 0; \
+			} \
+		} while (0)
+	unsigned int i = 0;
+	while (i < prog->len && is_known)
+	{
+		reg_value_t x = {'c', 0};
+		reg_value_t y = {'c', 0};
+		uint8_t instr_id = prog->array[i];
+		switch (instr_id)
+		{
+			case INSTR_ID_NOP:
+			break;
+			case INSTR_ID_PUSH_IMM:
+				PUSH(((reg_value_t){'c', prog->array[i+1]}));
+			break;
+			case INSTR_ID_PUSH_BYTES:
+				for (unsigned int j = 0; j < prog->array[i+1]; j++)
+				{
+					PUSH(((reg_value_t){'c', prog->array[i+2+j]}));
+				}
+			break;
+			case INSTR_ID_KILL:
+				POP(x);
+			break;
+			case INSTR_ID_DUPLICATE:
+				POP(x);
+				PUSH(x);
+				PUSH(x);
+			break;
+			case INSTR_ID_SWAP:
+				POP(x);
+				POP(y);
+				PUSH(x);
+				PUSH(y);
+			break;
+			case INSTR_ID_ADD:
+			case INSTR_ID_SUBTRACT:
+			case INSTR_ID_MULTIPLY:
+			case INSTR_ID_DIVIDE:
+			case INSTR_ID_MODULUS:
+				POP(x);
+				POP(y);
+				EMIT("\tuint8_t v%u = %s %s %s;\n", local_count,
+					reg_value_name(name_x, x),
+					instr_id == INSTR_ID_ADD ? "+" :
+					instr_id == INSTR_ID_SUBTRACT ? "-" :
+					instr_id == INSTR_ID_MULTIPLY ? "*" :
+					instr_id == INSTR_ID_DIVIDE ? "/" : "%",
+					reg_value_name(name_y, y));
+				PUSH(((reg_value_t){'v', local_count++}));
+			break;
+			case INSTR_ID_LOOKUP:
+				POP(x);
+				if (prog->array[i+1] == 2)
+				{
+					POP(y);
+					EMIT("\tuint8_t v%u = memo_%u[%s << 8 | %s];\n", local_count,
+						(unsigned int)prog->array[i+2],
+						reg_value_name(name_y, y), reg_value_name(name_x, x));
+				}
+				else
+				{
+					EMIT("\tuint8_t v%u = memo_%u[%s];\n", local_count,
+						(unsigned int)prog->array[i+2],
+						reg_value_name(name_x, x));
+				}
+				PUSH(((reg_value_t){'v', local_count++}));
+			break;
+			case INSTR_ID_PRINT_CHAR:
+				POP(x);
+				EMIT("\tputchar(%s); fflush(stdout);\n",
+					reg_value_name(name_x, x));
+			break;
+			default:
+				is_known = 0;
+			break;
+		}
+		i += instr_size(&prog->array[i]);
+	}
+	if (len > REG_MAX_CELLS)
+	{
+		is_known = 0;
+	}
+	if (gs == NULL)
+	{
+		*sig = (reg_sig_t){
+			.is_known = is_known,
+			.pop_count = arg_count,
+			.push_count = len,
+		};
+	}
+	else if (sig->push_count == 1)
+	{
+		EMIT("\treturn %s;\n}\n", reg_value_name(name_x, stack[0]));
+	}
+	else if (sig->push_count > 1)
+	{
+		EMIT("\treturn (struct cells_%u){{", sig->push_count);
+		for (unsigned int j = 0; j < len; j++)
+		{
+			EMIT("%s%s", j == 0 ? "" : ", ",
+				reg_value_name(name_x, stack[j]));
+		}
+		EMIT("}};\n}\n");
+	}
+	else
+	{
+		EMIT("}\n");
+	}
+	#undef PUSH
+	#undef POP
+	#undef EMIT
+}
+
+/* State of the emission of a full program, shared by its programs. */
+struct emit_c_ctx_t
+{
+	gs_t* gs;
+	const full_prog_t* full_prog;
+	/* Escaped for a C string literal, NULL if no #line directives. */
+	const char* line_file_name;
+	int instrument;
+	/* Initializers of the loop sites that have counters, when instrumenting,
+	 * the index of a loop site is its counter's. */
+	gs_t loop_site_table;
+	unsigned int loop_site_count;
+	/* Loop site index plus one of each offset of the main program (zero if
+	 * none yet), as the rest of the main program is emitted in main too. */
+	unsigned int* main_site_array;
+	/* Signatures of the programs, NULL if no register variants are used. */
+	const reg_sig_t* reg_sig_array;
+	/* All the programs are labels in main instead of functions, see
+	 * emit_c_opt_t. */
+	int single_function;
+	unsigned int label_count;
+	int has_limits; /* Program entries are counted, see emit_c_opt_t. */
+};
+typedef struct emit_c_ctx_t emit_c_ctx_t;
+
+/* When instrumenting, gives a counter to the loop at the given offset of the
+ * given program, and returns the C code that counts one iteration. */
+static const char* emit_c_count_loop(emit_c_ctx_t* ctx, char* buffer,
+	unsigned int prog_index, unsigned int offset, const char* kind)
+{
+	if (!ctx->instrument)
+	{
+		return "";
+	}
+	unsigned int site = ctx->loop_site_count;
+	if (prog_index == 0 && ctx->main_site_array[offset] != 0)
+	{
+		site = ctx->main_site_array[offset] - 1;
+	}
+	else
+	{
+		const src_pos_t* pos = full_prog_find_src_pos(ctx->full_prog,
+			prog_index, offset);
+		gs_append_f(&ctx->loop_site_table, "\t{%u, %u, %u, \"%s\"},\n",
+			prog_index, offset, pos == NULL ? 0 : pos->line, kind);
+		ctx->loop_site_count++;
+		if (prog_index == 0)
+		{
+			ctx->main_site_array[offset] = site + 1;
+		}
+	}
+	sprintf(buffer, "INSTR_ADD(instr_loop_iterations[%u], 1); ", site);
+	return buffer;
+}
+
+/* Appends C code to the growable string of the given context,
+ * the generated C code corresponds to the given program, that starts at the
+ * given offset of the program of the given index (which is used for the
+ * source positions and the instrumentation). */
+static void emit_c_prog(emit_c_ctx_t* ctx, const prog_t* prog,
+	unsigned int prog_index, unsigned int base_offset)
+{
+	gs_t* gs = ctx->gs;
 	ASSERT_CHECK_GS_PTR(gs);
 	ASSERT_CHECK_PROG_PTR(prog);
 	#define EMIT(...) gs_append_f(gs, __VA_ARGS__)
+	char count_buffer[64];
+	#define COUNT_LOOP(kind_) \
+		emit_c_count_loop(ctx, count_buffer, prog_index, \
+			base_offset + i-1, (kind_))
+	/* Call to the given label in single function mode, the last instruction
+	 * is a tail call that returns to where the caller returns. */
+	#define SINGLE_CALL(target_) \
+		do \
+		{ \
+			if (i == prog->len) \
+			{ \
+				EMIT("\tgoto %s;\n", (target_)); \
+			} \
+			else \
+			{ \
+				EMIT("\tCALL(ret_%u, %s);\nret_%u:\n", \
+					ctx->label_count, (target_), ctx->label_count); \
+				ctx->label_count++; \
+			} \
+		} while (0)
+	unsigned int line = 0;
 	unsigned int i = 0;
 	while (i < prog->len)
 	{
+		if (ctx->line_file_name != NULL)
+		{
+			const src_pos_t* pos = full_prog_find_src_pos(ctx->full_prog,
+				prog_index, base_offset + i);
+			if (pos != NULL && pos->line != line)
+			{
+				line = pos->line;
+				EMIT("#line %u \"%s\"\n", line, ctx->line_file_name);
+			}
+		}
 		switch (prog->array[i++])
 		{
 			case INSTR_ID_NOP:
@@ -22,8 +332,83 @@ static void emit_c_prog(gs_t* gs, const prog_t* prog)
 				ASSERT(i < prog->len,
 					"A \"push immediate\" instruction cannot start "
 					"at the last byte\n");
+				if (ctx->reg_sig_array != NULL && i+1 < prog->len &&
+					prog->array[i+1] == INSTR_ID_EXECUTE &&
+					prog->array[i] < ctx->full_prog->len)
+				{
+					/* Execution of a known program,
+					 * by its register variant if it has one. */
+					unsigned int target = prog->array[i];
+					if (ctx->full_prog->alias_array != NULL)
+					{
+						target = ctx->full_prog->alias_array[target];
+					}
+					const reg_sig_t* sig = &ctx->reg_sig_array[target];
+					if (sig->is_known)
+					{
+						/* The variant is a program entry too. */
+						EMIT("\t{%s", ctx->has_limits ? "LIMIT_CHECK(); " : "");
+						if (sig->push_count == 0)
+						{
+							EMIT("prog_%u_r(", target);
+						}
+						else if (sig->push_count == 1)
+						{
+							EMIT("uint8_t r = prog_%u_r(", target);
+						}
+						else
+						{
+							EMIT("struct cells_%u r = prog_%u_r(",
+								sig->push_count, target);
+						}
+						for (unsigned int j = 0; j < sig->pop_count; j++)
+						{
+							EMIT("%sst[i-%u]", j == 0 ? "" : ", ", j+1);
+						}
+						EMIT(");");
+						if (sig->pop_count > 0)
+						{
+							EMIT(" i -= %u;", sig->pop_count);
+						}
+						if (sig->push_count == 1)
+						{
+							EMIT(" st[i++] = r;");
+						}
+						else if (sig->push_count > 1)
+						{
+							EMIT(" memcpy(&st[i], r.c, %u); i += %u;",
+								sig->push_count, sig->push_count);
+						}
+						EMIT("}\n");
+						i += 2;
+						break;
+					}
+					else if (ctx->single_function)
+					{
+						/* Static target, a direct jump. */
+						char target_label[32];
+						sprintf(target_label, "block_%u", target);
+						i += 2;
+						SINGLE_CALL(target_label);
+						break;
+					}
+				}
 				EMIT("\tst[i++] = %u;\n", (unsigned int)prog->array[i++]);
 			break;
+			case INSTR_ID_PUSH_BYTES:
+				ASSERT(i < prog->len && i+1 + prog->array[i] <= prog->len,
+					"A \"push bytes\" instruction is cut\n");
+				{
+					unsigned int n = prog->array[i++];
+					EMIT("\t{static const uint8_t s[%u] = {", n);
+					for (unsigned int j = 0; j < n; j++)
+					{
+						EMIT("%s%u", j == 0 ? "" : ",",
+							(unsigned int)prog->array[i++]);
+					}
+					EMIT("}; memcpy(&st[i], s, %u); i += %u;}\n", n, n);
+				}
+			break;
 			case INSTR_ID_KILL:
 				EMIT("\ti--;\n");
 			break;
@@ -63,81 +448,1101 @@ static void emit_c_prog(gs_t* gs, const prog_t* prog)
 				EMIT("\tst[i-2] = st[i-1] %% st[i-2]; i--;\n");
 			break;
 			case INSTR_ID_EXECUTE:
-				EMIT("\tprog_table[st[--i]]();\n");
+				if (ctx->single_function)
+				{
+					SINGLE_CALL("*block_table[st[--i]]");
+				}
+				else
+				{
+					EMIT("\tprog_table[st[--i]]();\n");
+				}
 			break;
 			case INSTR_ID_IFELSE:
-				EMIT(
-					"\tprog_table["
-						"st[--i] ? "
-						"(i--, st[i--]) : (i--, st[--i])" /* Oh my~ */
-					"]();\n");
+				if (ctx->single_function)
+				{
+					SINGLE_CALL("*block_table["
+						"st[--i] ? (i--, st[i--]) : (i--, st[--i])]");
+				}
+				else
+				{
+					EMIT(
+						"\tprog_table["
+							"st[--i] ? "
+							"(i--, st[i--]) : (i--, st[--i])" /* Oh my~ */
+						"]();\n");
+				}
 			break;
 			case INSTR_ID_DOWHILE:
+			case INSTR_ID_IDIOM_LOOP:
+				if (ctx->single_function)
+				{
+					/* The loop keeps the program index on the loop stack.
+					 * Idioms have no native versions in this mode. */
+					if (prog->array[i-1] == INSTR_ID_DOWHILE)
+					{
+						EMIT("\tLOOP_RESERVE(1); loop_st[loop_i++] = st[--i];\n");
+					}
+					else
+					{
+						EMIT("\tLOOP_RESERVE(1); loop_st[loop_i++] = %u;\n",
+							(unsigned int)prog->array[i+1]);
+						i += 2;
+					}
+					unsigned int k = ctx->label_count++;
+					EMIT(
+						"loop_%u:\n"
+						"\tCALL(ret_%u, *block_table[loop_st[loop_i-1]]);\n"
+						"ret_%u:\n"
+						"\tif (st[--i]) goto loop_%u;\n"
+						"\tloop_i--;\n", k, k, k, k);
+					break;
+				}
+				else if (prog->array[i-1] == INSTR_ID_IDIOM_LOOP)
+				{
+					ASSERT(i+1 < prog->len,
+						"An \"idiom loop\" instruction is cut\n");
+					EMIT("\t%sidiom_%u(%u);\n", COUNT_LOOP("idiom"),
+						(unsigned int)prog->array[i],
+						(unsigned int)prog->array[i+1]);
+					i += 2;
+					break;
+				}
 				EMIT(
 					"\t{"
 						"uint8_t f = st[--i]; "
 						"do {"
-							"prog_table[f]();"
+							"%sprog_table[f]();"
 						"} while (st[--i]);"
-					"}\n");
+					"}\n", COUNT_LOOP("dowhile"));
 			break;
 			case INSTR_ID_REPEAT:
+				if (ctx->single_function)
+				{
+					/* The loop keeps the program index and the number of
+					 * iterations left on the loop stack. */
+					unsigned int k = ctx->label_count++;
+					EMIT(
+						"\tLOOP_RESERVE(2); loop_i += 2;\n"
+						"\tloop_st[loop_i-1] = st[--i]; "
+							"loop_st[loop_i-2] = st[--i];\n"
+						"loop_%u:\n"
+						"\tif (loop_st[loop_i-1] == 0) goto loop_end_%u;\n"
+						"\tloop_st[loop_i-1]--;\n"
+						"\tCALL(ret_%u, *block_table[loop_st[loop_i-2]]);\n"
+						"ret_%u:\n"
+						"\tgoto loop_%u;\n"
+						"loop_end_%u:\n"
+						"\tloop_i -= 2;\n", k, k, k, k, k, k);
+					break;
+				}
 				EMIT(
 					"\t{"
 						"uint8_t n = st[--i]; "
 						"uint8_t f = st[--i]; "
 						"for (unsigned int j = 0; j < n; j++) {"
-							"prog_table[f]();"
+							"%sprog_table[f]();"
 						"}"
-					"}\n");
+					"}\n", COUNT_LOOP("repeat"));
 				/* TODO:
 				 * Make it shorter so that it doesn't hit column 80. */
 			break;
 			case INSTR_ID_PRINT_CHAR:
 				EMIT("\tputchar(st[--i]); fflush(stdout);\n");
 			break;
+			case INSTR_ID_PRINT_STRING:
+				EMIT("\tprint_string();\n");
+			break;
+			case INSTR_ID_PRINT_REVERSE:
+				EMIT("\tprint_reverse();\n");
+			break;
+			case INSTR_ID_SPAWN:
+				EMIT("\ttask_spawn();\n");
+			break;
+			case INSTR_ID_JOIN:
+				EMIT("\ttask_join();\n");
+			break;
+			case INSTR_ID_CREATE:
+				EMIT("\tcoro_create();\n");
+			break;
+			case INSTR_ID_RESUME:
+				EMIT("\tcoro_resume();\n");
+			break;
+			case INSTR_ID_YIELD:
+				EMIT("\tcoro_yield();\n");
+			break;
+			case INSTR_ID_READ_BYTE:
+				EMIT("\tst[i++] = IN_HAS_BYTE() ? in_data[in_i++] : 0;\n");
+			break;
+			case INSTR_ID_END_OF_INPUT:
+				EMIT("\tst[i++] = !IN_HAS_BYTE();\n");
+			break;
 			case INSTR_ID_HALT:
 				EMIT("\texit(0);\n");
 			break;
+			case INSTR_ID_SNAPSHOT:
+				/* Snapshots are only taken by the interpreter. */
+				EMIT("\t;\n");
+			break;
+			case INSTR_ID_LOOKUP:
+				ASSERT(i+1 < prog->len,
+					"A \"lookup\" instruction is cut\n");
+				if (prog->array[i] == 2)
+				{
+					EMIT("\tst[i-2] = memo_%u[st[i-2] << 8 | st[i-1]]; i--;\n",
+						(unsigned int)prog->array[i+1]);
+				}
+				else
+				{
+					EMIT("\tst[i-1] = memo_%u[st[i-1]];\n",
+						(unsigned int)prog->array[i+1]);
+				}
+				i += 2;
+			break;
 		}
 	}
+	#undef SINGLE_CALL
+	#undef COUNT_LOOP
 	#undef EMIT
 }
 
-void emit_c_full_prog(gs_t* gs, const full_prog_t* full_prog)
+void emit_c_full_prog(gs_t* gs, const full_prog_t* full_prog,
+	const emit_c_opt_t* opt)
 {
 	ASSERT_CHECK_GS_PTR(gs);
 	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
 	ASSERT(full_prog->len >= 1,
 		"The full program does not contain even one program\n");
+	emit_c_opt_t default_opt = {0};
+	if (opt == NULL)
+	{
+		opt = &default_opt;
+	}
+	ASSERT(opt->entry_offset <= full_prog->array[0].len,
+		"The entry offset is out of the main program\n");
 	#define EMIT(...) gs_append_f(gs, __VA_ARGS__)
+	gs_t line_file_name;
+	gs_init(&line_file_name);
+	int emits_lines = opt->src_file_path != NULL &&
+		full_prog->src_map.len > 0;
+	if (emits_lines)
+	{
+		for (const char* c = opt->src_file_path; *c != '\0'; c++)
+		{
+			gs_append_f(&line_file_name, *c == '"' || *c == '\\' ?
+				"\\%c" : "%c", *c);
+		}
+	}
+	emit_c_ctx_t ctx = {
+		.gs = gs,
+		.full_prog = full_prog,
+		.line_file_name = emits_lines ? line_file_name.str : NULL,
+		.instrument = opt->instrument,
+		.has_limits = opt->max_steps != 0 || opt->timeout_ms != 0 ||
+			opt->max_depth != 0,
+	};
+	gs_init(&ctx.loop_site_table);
+	if (opt->instrument)
+	{
+		ctx.main_site_array =
+			xcalloc(full_prog->array[0].len, sizeof(unsigned int));
+	}
+	int uses_input =
+		full_prog_uses_instr(full_prog, INSTR_ID_READ_BYTE) ||
+		full_prog_uses_instr(full_prog, INSTR_ID_END_OF_INPUT);
+	/* With coroutines and tasks, st points to the stack being used. */
+	int uses_coros =
+		full_prog_uses_instr(full_prog, INSTR_ID_CREATE) ||
+		full_prog_uses_instr(full_prog, INSTR_ID_RESUME) ||
+		full_prog_uses_instr(full_prog, INSTR_ID_YIELD);
+	if (uses_input || opt->instrument || ctx.has_limits)
+	{
+		EMIT("#define _POSIX_C_SOURCE 200809L\n");
+	}
+	if (uses_coros)
+	{
+		/* For MAP_ANONYMOUS and MAP_NORESERVE. */
+		EMIT("#define _DEFAULT_SOURCE\n");
+	}
 	EMIT(
 		"#include <stdlib.h>\n"
 		"#include <stdio.h>\n"
 		"#include <stdint.h>\n"
-		"uint8_t st[99999];\n"
-		"unsigned int i = 0;\n");
-	for (unsigned int i = 0; i < full_prog->len; i++)
+		"#include <string.h>\n");
+	/* Each thread running tasks has its own stack. */
+	int uses_tasks =
+		full_prog_uses_instr(full_prog, INSTR_ID_SPAWN) ||
+		full_prog_uses_instr(full_prog, INSTR_ID_JOIN);
+	const char* st_storage = uses_tasks ? "_Thread_local " : "";
+	int uses_st_ptr = uses_coros || uses_tasks;
+	const char* st_name = uses_st_ptr ? "st_main" : "st";
+	/* Tasks, coroutines and instrumentation need program functions. */
+	int single_function = opt->single_function &&
+		!uses_tasks && !uses_coros && !opt->instrument;
+	ctx.single_function = single_function;
+	if (uses_st_ptr)
 	{
-		EMIT("void prog_%u(void);\n", i);
+		EMIT("%suint8_t* st;\n", st_storage);
 	}
-	EMIT("void (*prog_table[])(void) = {\n");
-	for (unsigned int i = 0; i < full_prog->len; i++)
+	if (opt->initial_st_len == 0)
 	{
-		EMIT("\tprog_%u%s\n", i, i < full_prog->len-1 ? "," : "");
+		EMIT("%suint8_t %s[%u];\n", st_storage, st_name, EMIT_C_ST_SIZE);
 	}
-	EMIT("};\n");
-	for (unsigned int i = 0; i < full_prog->len; i++)
+	else
 	{
+		EMIT("%suint8_t %s[%u] = {", st_storage, st_name, EMIT_C_ST_SIZE);
+		for (unsigned int i = 0; i < opt->initial_st_len; i++)
+		{
+			EMIT("%s%u", i % 20 == 0 ? "\n\t" : " ",
+				(unsigned int)opt->initial_st[i]);
+			if (i < opt->initial_st_len-1)
+			{
+				EMIT(",");
+			}
+		}
+		EMIT("\n};\n");
+	}
+	EMIT("%sunsigned int i = %u;\n", st_storage, opt->initial_st_len);
+	if (uses_input)
+	{
+		/* Same input strategy as the interpreter (see input.h),
+		 * the standard input is mapped if it is a regular file. */
+		EMIT(
+			"#include <unistd.h>\n"
+			"#include <errno.h>\n"
+			"#include <sys/stat.h>\n"
+			"#include <sys/mman.h>\n"
+			"const uint8_t* in_data;\n"
+			"size_t in_len = 0, in_i = 0;\n"
+			"int in_is_init = 0, in_is_at_end = 0;\n"
+			"uint8_t in_buffer[1 << 20];\n"
+			"int in_refill(void)\n"
+			"{\n"
+			"\tif (!in_is_init) {\n"
+			"\t\tstruct stat s; in_is_init = 1; in_data = in_buffer;\n"
+			"\t\toff_t o = lseek(0, 0, SEEK_CUR);\n"
+			"\t\tif (fstat(0, &s) == 0 && S_ISREG(s.st_mode) && "
+				"o >= 0 && o < s.st_size) {\n"
+			"\t\t\tvoid* m = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, 0, 0);\n"
+			"\t\t\tif (m != MAP_FAILED) {\n"
+			"\t\t\t\tposix_madvise(m, s.st_size, POSIX_MADV_SEQUENTIAL);\n"
+			"\t\t\t\tin_data = m; in_len = s.st_size; in_i = o; "
+				"in_is_at_end = 1;\n"
+			"\t\t\t\treturn 1;\n"
+			"\t\t\t}\n"
+			"\t\t}\n"
+			"\t}\n"
+			"\tif (in_is_at_end) return 0;\n"
+			"\tssize_t n;\n"
+			"\tdo n = read(0, in_buffer, sizeof in_buffer); "
+				"while (n < 0 && errno == EINTR);\n"
+			"\tif (n < 0) {\n"
+			"\t\tfflush(stdout); "
+				"fprintf(stderr, \"Execution error: input not read\\n\");\n"
+			"\t\texit(1);\n"
+			"\t}\n"
+			"\tif (n == 0) { in_is_at_end = 1; in_len = in_i = 0; return 0; }\n"
+			"\tin_len = n; in_i = 0;\n"
+			"\treturn 1;\n"
+			"}\n"
+			"#define IN_HAS_BYTE() (in_i < in_len || in_refill())\n");
+	}
+	if (ctx.has_limits)
+	{
+		/* The executions left include the first one that is not allowed,
+		 * they are taken by chunks that the countdown goes through (each
+		 * thread running tasks takes its own chunks from the executions
+		 * left to all of them). The depth counts the program functions
+		 * being executed (by the thread, or by the coroutine that swaps it
+		 * in). */
+		EMIT(
+			"#include <time.h>\n"
+			"unsigned long long limit_left = %lluull;\n"
+			"%sunsigned int limit_countdown = 1;\n"
+			"unsigned long long limit_deadline = 0;\n"
+			"unsigned long long limit_now(void)\n"
+			"{\n"
+			"\tstruct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+			"\treturn ts.tv_sec * 1000000000ull + ts.tv_nsec;\n"
+			"}\n"
+			"void limit_stop(const char* what)\n"
+			"{\n"
+			"\tfflush(stdout); fprintf(stderr, \"Execution error: %%s\\n\", what);\n"
+			"%s"
+			"\texit(1);\n"
+			"}\n"
+			"void limit_check(void)\n"
+			"{\n"
+			"\tunsigned long long left = %s, n;\n"
+			"\tdo {\n"
+			"\t\tif (left <= 1) limit_stop(\"out of fuel\");\n"
+			"\t\tn = left - 1 < 4096 ? left - 1 : 4096;\n"
+			"\t} while (!%s);\n"
+			"\tif (limit_deadline != 0 && limit_now() >= limit_deadline) "
+				"limit_stop(\"timeout\");\n"
+			"\tlimit_countdown = n;\n"
+			"}\n"
+			"#define LIMIT_CHECK() "
+				"do { if (--limit_countdown == 0) limit_check(); } while (0)\n"
+			"%sunsigned int limit_depth = 0;\n"
+			"#define LIMIT_ENTER() \\\n"
+			"\tdo { LIMIT_CHECK(); if (++limit_depth > %uu) "
+				"limit_stop(\"too deep recursion\"); } while (0)\n"
+			"#define LIMIT_LEAVE() limit_depth--\n"
+			"%s",
+			opt->max_steps == 0 ? ~0ull :
+				(unsigned long long)opt->max_steps + 1, st_storage,
+			!opt->dump_stack ? "" :
+				"\tfprintf(stderr, \"Stack (height %u, bottom first):\", i);\n"
+				"\tfor (unsigned int j = 0; j < i; j++) "
+					"fprintf(stderr, \" %u\", st[j]);\n"
+				"\tfprintf(stderr, \"\\n\");\n",
+			uses_tasks ?
+				"__atomic_load_n(&limit_left, __ATOMIC_RELAXED)" : "limit_left",
+			uses_tasks ?
+				"__atomic_compare_exchange_n(&limit_left, &left, left - n, 1, "
+					"__ATOMIC_RELAXED, __ATOMIC_RELAXED)" :
+				"(limit_left = left - n, 1)",
+			st_storage, opt->max_depth != 0 ? opt->max_depth :
+				VM_DEFAULT_MAX_DEPTH,
+			!uses_tasks ? "" :
+				"#define LIMIT_GIVE_BACK() __atomic_fetch_add(&limit_left, "
+					"limit_countdown - 1, __ATOMIC_RELAXED), "
+					"limit_countdown = 1\n");
+	}
+	if (full_prog_uses_instr(full_prog, INSTR_ID_PRINT_STRING))
+	{
+		EMIT(
+			"void print_string(void)\n"
+			"{\n"
+			"\tunsigned int a = st[--i], b = a;\n"
+			"\twhile (b < i && st[b] != 0) b++;\n"
+			"\tfwrite(&st[a], 1, b - a, stdout); fflush(stdout);\n"
+			"}\n");
+	}
+	int uses_idioms = full_prog_uses_instr(full_prog, INSTR_ID_IDIOM_LOOP);
+	if (full_prog_uses_instr(full_prog, INSTR_ID_PRINT_REVERSE) ||
+		uses_idioms)
+	{
+		EMIT(
+			"void print_reverse(void)\n"
+			"{\n"
+			"\tunsigned int top = i;\n"
+			"\twhile (st[--i] != 0);\n"
+			"\tfor (unsigned int a = i+1, b = top; a+1 < b; a++, b--) {\n"
+			"\t\tuint8_t x = st[a]; st[a] = st[b-1]; st[b-1] = x;\n"
+			"\t}\n"
+			"\tfwrite(&st[i+1], 1, top - (i+1), stdout); fflush(stdout);\n"
+			"}\n");
+	}
+	/* Results of the memoized programs, see optim_memoize_pure_progs. */
+	for (unsigned int k = 0;
+		full_prog->memo_array != NULL && k < full_prog->len; k++)
+	{
+		const memo_t* memo = &full_prog->memo_array[k];
+		if (memo->table == NULL)
+		{
+			continue;
+		}
+		unsigned int table_len = 1u << (8 * memo->pop_count);
+		EMIT("static const uint8_t memo_%u[%u] = {", k, table_len);
+		for (unsigned int j = 0; j < table_len; j++)
+		{
+			EMIT("%s%u%s", j % 16 == 0 ? "\n\t" : "",
+				(unsigned int)memo->table[j],
+				j < table_len-1 ? "," : "");
+		}
+		EMIT("\n};\n");
+	}
+	/* Aliases get no functions of their own,
+	 * only entries in the program table. */
+	#define ALIAS(i_) \
+		(full_prog->alias_array == NULL ? (i_) : full_prog->alias_array[i_])
+	if (single_function)
+	{
+		/* Calls push their return labels on a growable stack, and loops
+		 * keep their state on another one. */
+		EMIT(
+			"void* grow(void* array, unsigned int* cap, size_t size)\n"
+			"{\n"
+			"\t*cap = *cap == 0 ? 256 : *cap * 2;\n"
+			"\tarray = realloc(array, *cap * size);\n"
+			"\tif (array == NULL) abort();\n"
+			"\treturn array;\n"
+			"}\n"
+			"#define CALL(ret_, target_) \\\n"
+			"\tdo { \\\n"
+			"\t\tif (ret_i == ret_cap) "
+				"ret_st = grow(ret_st, &ret_cap, sizeof *ret_st); \\\n"
+			"\t\tret_st[ret_i++] = &&ret_; goto target_; \\\n"
+			"\t} while (0)\n"
+			"#define RETURN() goto *ret_st[--ret_i]\n"
+			"#define LOOP_RESERVE(n_) \\\n"
+			"\tif (loop_i + (n_) > loop_cap) "
+				"loop_st = grow(loop_st, &loop_cap, sizeof *loop_st)\n");
+	}
+	else
+	{
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			if (ALIAS(i) == i)
+			{
+				EMIT("void prog_%u(void);\n", i);
+			}
+		}
+		EMIT("void (*prog_table[])(void) = {\n");
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			EMIT("\tprog_%u%s\n", ALIAS(i), i < full_prog->len-1 ? "," : "");
+		}
+		EMIT("};\n");
+	}
+	if (opt->instrument)
+	{
+		/* Counters of the calls and of the cycles spent in each program,
+		 * and of the iterations of each loop site (whose number is only
+		 * known once the programs are emitted). Tasks update them from
+		 * many threads. The report is written at exit, or on SIGUSR1 when
+		 * the next program is called. */
+		EMIT(
+			"#include <signal.h>\n"
+			"#if defined(HELV_INSTRUMENT_CYCLES) && "
+				"(defined(__x86_64__) || defined(__i386__))\n"
+			"#include <x86intrin.h>\n"
+			"#define INSTR_CYCLES() __rdtsc()\n"
+			"#else\n"
+			"#define INSTR_CYCLES() 0\n"
+			"#endif\n"
+			"#define INSTR_ADD(x_, n_) %s\n"
+			"unsigned long long instr_calls[%u], instr_cycles[%u];\n"
+			"extern unsigned long long instr_loop_iterations[];\n"
+			"volatile sig_atomic_t instr_report_requested = 0;\n"
+			"void instr_report(void);\n"
+			"void instr_on_signal(int s) "
+				"{ (void)s; instr_report_requested = 1; }\n"
+			"#define INSTR_ENTER(f_) \\\n"
+			"\tunsigned long long instr_t0 = INSTR_CYCLES(); "
+				"INSTR_ADD(instr_calls[f_], 1); \\\n"
+			"\tif (instr_report_requested) instr_report()\n"
+			"#define INSTR_LEAVE(f_) \\\n"
+			"\tINSTR_ADD(instr_cycles[f_], INSTR_CYCLES() - instr_t0)\n",
+			uses_tasks ?
+				"__atomic_fetch_add(&(x_), (n_), __ATOMIC_RELAXED)" :
+				"((x_) += (n_))",
+			full_prog->len, full_prog->len);
+	}
+	if (uses_tasks)
+	{
+		/* Same strategy as the interpreter (see task.h), a task taken by no
+		 * worker is executed by the thread that joins it, on its stack right
+		 * above its cells (where the cells of the task go anyway). Each task
+		 * has its own handles, the ones it does not join are joined when it
+		 * ends, as vm_cleanup does. */
+		EMIT(
+			"#include <pthread.h>\n"
+			"#include <unistd.h>\n"
+			"struct task {\n"
+			"\tuint8_t f; int state; unsigned int len; uint8_t* cells;\n"
+			"\tstruct task* prev; struct task* next;\n"
+			"};\n"
+			"_Thread_local struct task** task_table;\n"
+			"pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;\n"
+			"pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;\n"
+			"struct task* task_first; struct task* task_last;\n"
+			"int task_has_workers = 0;\n"
+			"void task_unqueue(struct task* t)\n"
+			"{\n"
+			"\tif (t->prev) t->prev->next = t->next; else task_first = t->next;\n"
+			"\tif (t->next) t->next->prev = t->prev; else task_last = t->prev;\n"
+			"}\n"
+			"void task_join(void);\n"
+			"void task_run(struct task* t, uint8_t* base)\n"
+			"{\n"
+			"\tuint8_t* saved_st = st; unsigned int saved_i = i;\n"
+			"\tstruct task** saved_table = task_table;\n"
+			"\tst = base; i = t->len; memcpy(st, t->cells, i); free(t->cells);\n"
+			"\ttask_table = NULL;\n"
+			"\tprog_table[t->f]();\n"
+			"\tt->len = i;\n"
+			"\tif (task_table != NULL) {\n"
+			"\t\tfor (unsigned int h = 0; h < 256; h++) if (task_table[h]) "
+				"{ st[i++] = h; task_join(); i = t->len; }\n"
+			"\t\tfree(task_table);\n"
+			"\t}\n"
+			"\tst = saved_st; i = saved_i; task_table = saved_table;\n"
+			"}\n"
+			"void* task_worker(void* arg)\n"
+			"{\n"
+			"\t(void)arg; st = st_main;\n"
+			"\tpthread_mutex_lock(&task_mutex);\n"
+			"\twhile (1) {\n"
+			"\t\twhile (task_first == NULL) "
+				"pthread_cond_wait(&task_cond, &task_mutex);\n"
+			"\t\tstruct task* t = task_first; task_unqueue(t); t->state = 1;\n"
+			"\t\tpthread_mutex_unlock(&task_mutex);\n"
+			"\t\ttask_run(t, st_main);%s\n"
+			"\t\tt->cells = malloc(t->len + 1); "
+				"memcpy(t->cells, st_main, t->len);\n"
+			"\t\tpthread_mutex_lock(&task_mutex);\n"
+			"\t\tt->state = 2; pthread_cond_broadcast(&task_cond);\n"
+			"\t}\n"
+			"}\n"
+			"void task_spawn(void)\n"
+			"{\n"
+			"\tuint8_t f = st[--i], n = st[--i]; unsigned int h = 0;\n"
+			"\tif (task_table == NULL) "
+				"task_table = calloc(256, sizeof *task_table);\n"
+			"\twhile (h < 256 && task_table[h] != NULL) h++;\n"
+			"\tif (h == 256) abort();\n"
+			"\tstruct task* t = calloc(1, sizeof *t);\n"
+			"\tt->f = f; t->len = n; t->cells = malloc(n + 1);\n"
+			"\ti -= n; memcpy(t->cells, &st[i], n);\n"
+			"\ttask_table[h] = t; st[i++] = h;\n"
+			"\tpthread_mutex_lock(&task_mutex);\n"
+			"\tif (!task_has_workers) {\n"
+			"\t\tlong c = sysconf(_SC_NPROCESSORS_ONLN); pthread_t w;\n"
+			"\t\tfor (long j = 1; j < c; j++) "
+				"if (pthread_create(&w, NULL, task_worker, NULL) == 0) "
+				"pthread_detach(w);\n"
+			"\t\ttask_has_workers = 1;\n"
+			"\t}\n"
+			"\tt->prev = task_last; if (task_last) task_last->next = t; "
+				"else task_first = t;\n"
+			"\ttask_last = t; pthread_cond_broadcast(&task_cond);\n"
+			"\tpthread_mutex_unlock(&task_mutex);\n"
+			"}\n"
+			"void task_join(void)\n"
+			"{\n"
+			"\tuint8_t h = st[--i];\n"
+			"\tstruct task* t = task_table != NULL ? task_table[h] : NULL;\n"
+			"\tif (t == NULL) abort();\n"
+			"\ttask_table[h] = NULL;\n"
+			"\tpthread_mutex_lock(&task_mutex);\n"
+			"\tif (t->state == 0) {\n"
+			"\t\ttask_unqueue(t);\n"
+			"\t\tpthread_mutex_unlock(&task_mutex);\n"
+			"\t\ttask_run(t, &st[i]); i += t->len; free(t);\n"
+			"\t\treturn;\n"
+			"\t}\n"
+			"%s"
+			"\twhile (t->state != 2) pthread_cond_wait(&task_cond, &task_mutex);\n"
+			"\tpthread_mutex_unlock(&task_mutex);\n"
+			"\tmemcpy(&st[i], t->cells, t->len); i += t->len;\n"
+			"\tfree(t->cells); free(t);\n"
+			"}\n",
+			/* Idle or waiting threads give back the rest of their chunk. */
+			ctx.has_limits ? " LIMIT_GIVE_BACK();" : "",
+			ctx.has_limits ? "\tLIMIT_GIVE_BACK();\n" : "");
+	}
+	if (uses_coros)
+	{
+		/* Same as the interpreter (see coro.h), with ucontext, and C stacks
+		 * mapped as in coro.c with a guard page below them. */
+		EMIT(
+			"#include <ucontext.h>\n"
+			"#include <unistd.h>\n"
+			"#include <sys/mman.h>\n"
+			"#define CORO_C_STACK_SIZE (8u << 20)\n"
+			"char* coro_c_stack_map(void)\n"
+			"{\n"
+			"\tsize_t p = sysconf(_SC_PAGESIZE);\n"
+			"\tchar* m = mmap(NULL, p + CORO_C_STACK_SIZE, PROT_READ | PROT_WRITE,\n"
+			"\t\tMAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);\n"
+			"\tif (m == MAP_FAILED || mprotect(m, p, PROT_NONE) != 0) abort();\n"
+			"\treturn m + p;\n"
+			"}\n"
+			"void coro_c_stack_unmap(char* s)\n"
+			"{\n"
+			"\tsize_t p = sysconf(_SC_PAGESIZE);\n"
+			"\tmunmap(s - p, p + CORO_C_STACK_SIZE);\n"
+			"}\n"
+			"struct coro {\n"
+			"\tucontext_t ctx; ucontext_t back; uint8_t f; int state;\n"
+			"\tuint8_t* cells; unsigned int len, count, depth; char* c_stack;\n"
+			"};\n"
+			"%sstruct coro* coro_table[256];\n"
+			"%sstruct coro* coro_current;\n"
+			"void coro_entry(void)\n"
+			"{\n"
+			"\tstruct coro* c = coro_current;\n"
+			"\tprog_table[c->f]();\n"
+			"\tc->state = 2; c->count = i;\n"
+			"\tsetcontext(&c->back);\n"
+			"}\n"
+			"void coro_create(void)\n"
+			"{\n"
+			"\tuint8_t f = st[--i]; unsigned int h = 0;\n"
+			"\twhile (h < 256 && coro_table[h] != NULL) h++;\n"
+			"\tif (h == 256) abort();\n"
+			"\tstruct coro* c = calloc(1, sizeof *c);\n"
+			"\tc->f = f; c->cells = malloc(99999); c->c_stack = coro_c_stack_map();\n"
+			"\tgetcontext(&c->ctx);\n"
+			"\tc->ctx.uc_stack.ss_sp = c->c_stack;\n"
+			"\tc->ctx.uc_stack.ss_size = CORO_C_STACK_SIZE;\n"
+			"\tmakecontext(&c->ctx, coro_entry, 0);\n"
+			"\tcoro_table[h] = c; st[i++] = h;\n"
+			"}\n"
+			"void coro_resume(void)\n"
+			"{\n"
+			"\tuint8_t h = st[--i], n = st[--i]; struct coro* c = coro_table[h];\n"
+			"\tif (c == NULL || c->state == 1) abort();\n"
+			"\ti -= n; memcpy(&c->cells[c->len], &st[i], n); c->len += n;\n"
+			"\tuint8_t* saved_st = st; unsigned int saved_i = i;\n"
+			"\tstruct coro* saved_current = coro_current;\n"
+			"\tst = c->cells; i = c->len; coro_current = c; c->state = 1;\n"
+			"%s"
+			"\tswapcontext(&c->back, &c->ctx);\n"
+			"%s"
+			"\tc->len = i - c->count;\n"
+			"\tmemcpy(&saved_st[saved_i], &c->cells[c->len], c->count);\n"
+			"\tst = saved_st; i = saved_i + c->count; coro_current = saved_current;\n"
+			"\tst[i++] = c->state != 2;\n"
+			"\tif (c->state == 2) {\n"
+			"\t\tcoro_c_stack_unmap(c->c_stack); free(c->cells); free(c); "
+				"coro_table[h] = NULL;\n"
+			"\t}\n"
+			"}\n"
+			"void coro_yield(void)\n"
+			"{\n"
+			"\tstruct coro* c = coro_current; c->count = st[--i]; c->state = 0;\n"
+			"\tswapcontext(&c->ctx, &c->back);\n"
+			"}\n", st_storage, st_storage,
+			!ctx.has_limits ? "" :
+				"\tunsigned int saved_depth = limit_depth; "
+					"limit_depth = c->depth;\n",
+			!ctx.has_limits ? "" :
+				"\tc->depth = limit_depth; limit_depth = saved_depth;\n");
+	}
+	if (uses_idioms && !single_function)
+	{
+		/* Native versions of the loops recognized by optim_recognize_idioms,
+		 * with the same preconditions as in the interpreter. */
+		static_assert(NUMBER_OF_IDIOM_IDS == 5,
+			"The idioms emitted in C are not up to date");
+		EMIT(
+			"void idiom_%u(uint8_t f)\n"
+			"{\n"
+			"\t(void)f; i &= ~255u;\n"
+			"}\n", IDIOM_ID_EMPTY_STACK);
+		EMIT(
+			"void idiom_%u(uint8_t f)\n"
+			"{\n"
+			"\t(void)f; print_reverse();\n"
+			"}\n", IDIOM_ID_PRINT_REVERSE);
+		EMIT(
+			"void idiom_%u(uint8_t f)\n"
+			"{\n"
+			"\t(void)f; print_reverse(); i++;\n"
+			"}\n", IDIOM_ID_PRINT_REVERSE_KEEP_ZERO);
+		EMIT(
+			"void idiom_%u(uint8_t f)\n"
+			"{\n"
+			"\tunsigned int x = st[i-1];\n"
+			"\tif (i+1 > 255 || x+1 >= i) {\n"
+			"\t\tdo prog_table[f](); while (st[--i]);\n"
+			"\t\treturn;\n"
+			"\t}\n"
+			"\tfwrite(&st[x], 1, i-1 - x, stdout); fflush(stdout);\n"
+			"\tst[i-1] = i-1;\n"
+			"}\n", IDIOM_ID_PRINT_FORWARD);
+		EMIT(
+			"void idiom_%u(uint8_t f)\n"
+			"{\n"
+			"\tuint8_t x = st[i-1];\n"
+			"\tif (x+1u >= i) {\n"
+			"\t\tdo prog_table[f](); while (st[--i]);\n"
+			"\t\treturn;\n"
+			"\t}\n"
+			"\tuint8_t n = st[x];\n"
+			"\tdo { st[i] = x; st[i-1] = n %% 10 + '0'; i++; n /= 10; } "
+				"while (n);\n"
+			"\tst[x] = 0;\n"
+			"}\n", IDIOM_ID_DIGITS);
+	}
+	/* Programs of known stack effect get register variants, used where they
+	 * are executed right after being pushed (the void(void) functions stay
+	 * for the program table). Not when instrumenting, as calls are counted
+	 * by the void(void) functions. */
+	reg_sig_t* reg_sig_array = NULL;
+	if (!opt->instrument)
+	{
+		reg_sig_array = xcalloc(full_prog->len, sizeof(reg_sig_t));
+		/* Only the programs executed that way get analyzed, the other
+		 * ones (whose signature stays unknown) would get unused variants. */
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			const prog_t* prog = &full_prog->array[i];
+			for (unsigned int j = 0; ALIAS(i) == i && j < prog->len;
+				j += instr_size(&prog->array[j]))
+			{
+				if (prog->array[j] == INSTR_ID_PUSH_IMM && j+2 < prog->len &&
+					prog->array[j+2] == INSTR_ID_EXECUTE &&
+					prog->array[j+1] < full_prog->len)
+				{
+					reg_sig_array[ALIAS(prog->array[j+1])].is_known = 1;
+				}
+			}
+		}
+		unsigned int cells_struct_mask = 0;
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			if (reg_sig_array[i].is_known)
+			{
+				emit_c_reg_variant(NULL, &full_prog->array[i], i,
+					&reg_sig_array[i]);
+			}
+			reg_sig_t* sig = &reg_sig_array[i];
+			if (sig->is_known && sig->push_count > 1 &&
+				(cells_struct_mask & (1u << sig->push_count)) == 0)
+			{
+				cells_struct_mask |= 1u << sig->push_count;
+				EMIT("struct cells_%u { uint8_t c[%u]; };\n",
+					sig->push_count, sig->push_count);
+			}
+		}
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			if (reg_sig_array[i].is_known)
+			{
+				emit_c_reg_variant(gs, &full_prog->array[i], i,
+					&reg_sig_array[i]);
+			}
+		}
+		ctx.reg_sig_array = reg_sig_array;
+	}
+	for (unsigned int i = 0; i < full_prog->len && !single_function; i++)
+	{
+		if (ALIAS(i) != i)
+		{
+			continue;
+		}
 		EMIT("void prog_%u(void)\n", i);
 		EMIT("{\n");
-		emit_c_prog(gs, &full_prog->array[i]);
+		if (opt->instrument)
+		{
+			EMIT("\tINSTR_ENTER(%u);\n", i);
+		}
+		if (ctx.has_limits)
+		{
+			EMIT("\tLIMIT_ENTER();\n");
+		}
+		emit_c_prog(&ctx, &full_prog->array[i], i, 0);
+		if (ctx.has_limits)
+		{
+			EMIT("\tLIMIT_LEAVE();\n");
+		}
+		if (opt->instrument)
+		{
+			EMIT("\tINSTR_LEAVE(%u);\n", i);
+		}
 		EMIT("}\n");
 	}
+	const prog_t* main_prog = &full_prog->array[0];
+	prog_t main_rest = {
+		.len = main_prog->len - opt->entry_offset,
+		.cap = main_prog->len - opt->entry_offset,
+	};
+	if (main_rest.len > 0)
+	{
+		/* Nothing is left when all of it was done at compile time. */
+		main_rest.array = main_prog->array + opt->entry_offset;
+	}
+	gs_t main_rest_gs;
+	gs_init(&main_rest_gs);
+	if (opt->entry_offset != 0)
+	{
+		/* The rest of the main program, after what was done at compile time,
+		 * the main program itself must stay whole. It is emitted before the
+		 * report for its loop sites to be known. */
+		ctx.gs = &main_rest_gs;
+		emit_c_prog(&ctx, &main_rest, 0, opt->entry_offset);
+		ctx.gs = gs;
+	}
+	if (opt->instrument)
+	{
+		EMIT("unsigned long long instr_loop_iterations[%u];\n",
+			ctx.loop_site_count + (ctx.loop_site_count == 0));
+		EMIT("const unsigned int instr_progs[][2] = {\n");
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			if (ALIAS(i) == i)
+			{
+				const src_pos_t* pos = full_prog_find_src_pos(full_prog, i, 0);
+				EMIT("\t{%u, %u},\n", i, pos == NULL ? 0 : pos->line);
+			}
+		}
+		EMIT("};\n");
+		EMIT(
+			"const struct { unsigned int prog, offset, line; "
+				"const char* kind; } instr_loops[] = {\n"
+			"%s"
+			"\t{0, 0, 0, NULL}\n"
+			"};\n", ctx.loop_site_table.str);
+		/* JSON report, to the file named by HELV_INSTRUMENT_OUT if any. */
+		EMIT(
+			"void instr_report(void)\n"
+			"{\n"
+			"\tinstr_report_requested = 0;\n"
+			"\tconst char* path = getenv(\"HELV_INSTRUMENT_OUT\");\n"
+			"\tFILE* f = path == NULL ? NULL : fopen(path, \"w\");\n"
+			"\tFILE* out = f == NULL ? stderr : f;\n"
+			"\tfprintf(out, \"{\\\"progs\\\": [\");\n"
+			"\tfor (unsigned int j = 0; "
+				"j < sizeof instr_progs / sizeof instr_progs[0]; j++) {\n"
+			"\t\tunsigned int p = instr_progs[j][0];\n"
+			"\t\tfprintf(out, \"%%s\\n  {\\\"prog\\\": %%u, "
+				"\\\"line\\\": %%u, \\\"calls\\\": %%llu, "
+				"\\\"cycles\\\": %%llu}\", j == 0 ? \"\" : \",\", p, "
+				"instr_progs[j][1], instr_calls[p], instr_cycles[p]);\n"
+			"\t}\n"
+			"\tfprintf(out, \"\\n], \\\"loops\\\": [\");\n"
+			"\tfor (unsigned int j = 0; instr_loops[j].kind != NULL; j++) {\n"
+			"\t\tfprintf(out, \"%%s\\n  {\\\"prog\\\": %%u, "
+				"\\\"offset\\\": %%u, \\\"line\\\": %%u, "
+				"\\\"kind\\\": \\\"%%s\\\", "
+				"\\\"iterations\\\": %%llu}\", j == 0 ? \"\" : \",\", "
+				"instr_loops[j].prog, instr_loops[j].offset, "
+				"instr_loops[j].line, instr_loops[j].kind, "
+				"instr_loop_iterations[j]);\n"
+			"\t}\n"
+			"\tfprintf(out, \"\\n]}\\n\");\n"
+			"\tif (f != NULL) fclose(f); else fflush(stderr);\n"
+			"}\n");
+	}
+	gs_t main_init;
+	gs_init(&main_init);
+	if (opt->instrument)
+	{
+		gs_append_f(&main_init,
+			"\tsignal(SIGUSR1, instr_on_signal); atexit(instr_report);\n");
+	}
+	if (opt->timeout_ms != 0)
+	{
+		gs_append_f(&main_init,
+			"\tlimit_deadline = limit_now() + %lluull;\n",
+			opt->timeout_ms * 1000000ull);
+	}
+	if (single_function)
+	{
+		EMIT(
+			"int main(void)\n"
+			"{\n"
+			"\tstatic void* const block_table[] = {");
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			EMIT("%s&&block_%u", i % 8 == 0 ? "\n\t\t" : " ", ALIAS(i));
+			if (i < full_prog->len-1)
+			{
+				EMIT(",");
+			}
+		}
+		int uses_loops =
+			full_prog_uses_instr(full_prog, INSTR_ID_DOWHILE) ||
+			full_prog_uses_instr(full_prog, INSTR_ID_IDIOM_LOOP) ||
+			full_prog_uses_instr(full_prog, INSTR_ID_REPEAT);
+		EMIT(
+			"\n\t};\n"
+			"\tvoid** ret_st = NULL;\n"
+			"\tunsigned int ret_i = 0, ret_cap = 0;\n"
+			"%s%s"
+			"\tCALL(ret_main, %s);\n",
+			main_init.str,
+			uses_loops ?
+				"\tunsigned int* loop_st = NULL;\n"
+				"\tunsigned int loop_i = 0, loop_cap = 0;\n" : "",
+			opt->entry_offset == 0 ? "block_0" : "main_rest");
+		if (opt->entry_offset != 0)
+		{
+			EMIT("main_rest:\n%s\tRETURN();\n", main_rest_gs.str);
+		}
+		EMIT(
+			"ret_main:\n"
+			"\tfree(ret_st);%s\n"
+			"\treturn 0;\n", uses_loops ? " free(loop_st);" : "");
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			if (ALIAS(i) == i)
+			{
+				EMIT("block_%u:\n%s", i,
+					ctx.has_limits ? "\tLIMIT_CHECK();\n" : "");
+				emit_c_prog(&ctx, &full_prog->array[i], i, 0);
+				EMIT("\tRETURN();\n");
+			}
+		}
+		EMIT("}\n");
+	}
+	else if (opt->entry_offset == 0)
+	{
+		const src_pos_t* pos = emits_lines ?
+			full_prog_find_src_pos(full_prog, 0, 0) : NULL;
+		if (pos != NULL)
+		{
+			EMIT("#line %u \"%s\"\n", pos->line, line_file_name.str);
+		}
+		EMIT(
+			"int main(void)\n"
+			"{\n"
+			"%s%s"
+			"\tprog_table[0]();\n"
+			"}\n", uses_st_ptr ? "\tst = st_main;\n" : "", main_init.str);
+	}
+	else
+	{
+		/* The main program is entered, what is left of it at least. */
+		EMIT(
+			"int main(void)\n"
+			"{\n"
+			"%s%s%s%s%s"
+			"}\n", uses_st_ptr ? "\tst = st_main;\n" : "", main_init.str,
+			opt->instrument ? "\tINSTR_ENTER(0);\n" : "", main_rest_gs.str,
+			opt->instrument ? "\tINSTR_LEAVE(0);\n" : "");
+	}
+	gs_cleanup(&main_init);
+	gs_cleanup(&main_rest_gs);
+	gs_cleanup(&ctx.loop_site_table);
+	free(ctx.main_site_array);
+	free(reg_sig_array);
+	gs_cleanup(&line_file_name);
+	#undef ALIAS
+	#undef EMIT
+}
+
+int emit_c_jit_prog(gs_t* gs, const full_prog_t* full_prog,
+	unsigned int prog_index)
+{
+	ASSERT_CHECK_GS_PTR(gs);
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	const prog_t* prog = full_prog_get_prog(full_prog, prog_index);
+	for (unsigned int i = 0; i < prog->len; i += instr_size(&prog->array[i]))
+	{
+		switch (prog->array[i])
+		{
+			case INSTR_ID_PRINT_STRING:
+			case INSTR_ID_PRINT_REVERSE:
+			case INSTR_ID_SPAWN:
+			case INSTR_ID_JOIN:
+			case INSTR_ID_CREATE:
+			case INSTR_ID_RESUME:
+			case INSTR_ID_YIELD:
+			case INSTR_ID_READ_BYTE:
+			case INSTR_ID_END_OF_INPUT:
+			case INSTR_ID_SNAPSHOT:
+				return -1;
+			break;
+		}
+	}
+	#define EMIT(...) gs_append_f(gs, __VA_ARGS__)
 	EMIT(
-		"int main(void)\n"
+		"int jit_prog_%u(struct jit_ctx_t* c)\n"
 		"{\n"
-		"\tprog_table[0]();\n"
-		"}\n");
+		"\tuint8_t* st = c->st;\n"
+		"\tunsigned int i = c->len, cap = c->cap;\n", prog_index);
+	unsigned int i = 0;
+	while (i < prog->len)
+	{
+		const uint8_t* instr = &prog->array[i];
+		switch (instr[0])
+		{
+			case INSTR_ID_NOP:
+			break;
+			case INSTR_ID_PUSH_IMM:
+				EMIT("\tRESERVE(1); st[i++] = %u;\n", (unsigned int)instr[1]);
+			break;
+			case INSTR_ID_PUSH_BYTES:
+				EMIT("\tRESERVE(%u);", (unsigned int)instr[1]);
+				for (unsigned int j = 0; j < instr[1]; j++)
+				{
+					EMIT(" st[i++] = %u;", (unsigned int)instr[2+j]);
+				}
+				EMIT("\n");
+			break;
+			case INSTR_ID_KILL:
+				EMIT("\tNEED(1); i--;\n");
+			break;
+			case INSTR_ID_DUPLICATE:
+				EMIT("\tNEED(1); RESERVE(1); st[i] = st[i-1]; i++;\n");
+			break;
+			case INSTR_ID_SWAP:
+				EMIT("\tNEED(2); "
+					"{uint8_t x = st[i-1]; st[i-1] = st[i-2]; st[i-2] = x;}\n");
+			break;
+			case INSTR_ID_GET:
+				EMIT("\tNEED(1); {uint8_t x = st[--i]; "
+					"if (x >= i) FAIL(STATUS_OUT_OF_BOUNDS); "
+					"st[i] = st[x]; i++;}\n");
+			break;
+			case INSTR_ID_SET:
+				EMIT("\tNEED(2); {uint8_t x = st[--i]; uint8_t y = st[--i]; "
+					"if (x >= i) FAIL(STATUS_OUT_OF_BOUNDS); "
+					"st[x] = y;}\n");
+			break;
+			case INSTR_ID_HEIGHT:
+				EMIT("\tRESERVE(1); st[i] = i; i++;\n");
+			break;
+			case INSTR_ID_ADD:
+				EMIT("\tNEED(2); st[i-2] = st[i-1] + st[i-2]; i--;\n");
+			break;
+			case INSTR_ID_SUBTRACT:
+				EMIT("\tNEED(2); st[i-2] = st[i-1] - st[i-2]; i--;\n");
+			break;
+			case INSTR_ID_MULTIPLY:
+				EMIT("\tNEED(2); st[i-2] = st[i-1] * st[i-2]; i--;\n");
+			break;
+			case INSTR_ID_DIVIDE:
+			case INSTR_ID_MODULUS:
+				/* Both are popped before failing, as in the interpreter. */
+				EMIT("\tNEED(2); {uint8_t a = st[--i]; uint8_t b = st[--i]; "
+					"if (b == 0) FAIL(STATUS_DIVISION_BY_ZERO); "
+					"st[i++] = a %s b;}\n",
+					instr[0] == INSTR_ID_DIVIDE ? "/" : "%");
+			break;
+			case INSTR_ID_EXECUTE:
+				EMIT("\tNEED(1); EXEC(st[--i]);\n");
+			break;
+			case INSTR_ID_IFELSE:
+				EMIT("\tNEED(3); {uint8_t x = st[--i]; uint8_t y = st[--i]; "
+					"uint8_t z = st[--i]; EXEC(x ? y : z);}\n");
+			break;
+			case INSTR_ID_DOWHILE:
+				EMIT("\tNEED(1); {uint8_t f = st[--i]; "
+					"do {EXEC(f); NEED(1);} while (st[--i]);}\n");
+			break;
+			case INSTR_ID_IDIOM_LOOP:
+				/* As the loop it is, the idiom is only a shortcut. */
+				EMIT("\t{uint8_t f = %u; "
+					"do {EXEC(f); NEED(1);} while (st[--i]);}\n",
+					(unsigned int)instr[2]);
+			break;
+			case INSTR_ID_REPEAT:
+				EMIT("\tNEED(2); {uint8_t n = st[--i]; uint8_t f = st[--i]; "
+					"for (unsigned int j = 0; j < n; j++) EXEC(f);}\n");
+			break;
+			case INSTR_ID_PRINT_CHAR:
+				EMIT("\tNEED(1); c->out(c, st[--i]);\n");
+			break;
+			case INSTR_ID_HALT:
+				EMIT("\tFAIL(STATUS_HALT);\n");
+			break;
+			case INSTR_ID_LOOKUP:
+				ASSERT(full_prog->memo_array != NULL &&
+					full_prog->memo_array[instr[2]].table != NULL,
+					"The looked up program has no table\n");
+				/* The code is loaded in this process, the table is there. */
+				EMIT("\tNEED(%u); ", (unsigned int)instr[1]);
+				EMIT(instr[1] == 2 ?
+					"st[i-2] = ((const uint8_t*)0x%jx)[st[i-2] << 8 | st[i-1]]; "
+						"i--;\n" :
+					"st[i-1] = ((const uint8_t*)0x%jx)[st[i-1]];\n",
+					(uintmax_t)(uintptr_t)
+						full_prog->memo_array[instr[2]].table);
+			break;
+			default:
+				ASSERT(0, "Unexpected instruction %u\n",
+					(unsigned int)instr[0]);
+			break;
+		}
+		i += instr_size(instr);
+	}
+	EMIT("\tSYNC(); return 0;\n}\n");
 	#undef EMIT
+	return 0;
 }
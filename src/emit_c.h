@@ -4,7 +4,65 @@
 
 #include "gs.h"
 #include "prog.h"
+#include <stdint.h>
 
-void emit_c_full_prog(gs_t* gs, const full_prog_t* full_prog);
+/* Number of cells of the stacks of the emitted C, which has no bound checks,
+ * the initial stack must fit in it. */
+#define EMIT_C_ST_SIZE 99999
+
+/* Options of the C emission, all zeros means default. */
+struct emit_c_opt_t
+{
+	/* Initial content of the stack (bottom first), for when the beginning of
+	 * the execution is already done at compile time. */
+	const uint8_t* initial_st;
+	unsigned int initial_st_len;
+	/* Offset in the main program where the execution starts. */
+	unsigned int entry_offset;
+	/* If not NULL, #line directives refer the code of the programs to their
+	 * positions in this Helv source file (when the positions are known), for
+	 * debuggers and profilers. */
+	const char* src_file_path;
+	/* Adds counters of the calls of each program and of the iterations of
+	 * each loop, and of the cycles spent in each program if the C code is
+	 * compiled with HELV_INSTRUMENT_CYCLES defined (on x86). They are
+	 * reported in JSON at exit and on SIGUSR1, on stderr or in the file
+	 * named by the HELV_INSTRUMENT_OUT environment variable. */
+	int instrument;
+	/* Puts all the programs in main, as labels instead of functions, with
+	 * an explicit stack of return labels (so deep recursion does not use the
+	 * C stack) and computed gotos for dynamic targets (a GNU C extension).
+	 * Ignored if the program uses tasks or coroutines, or if instrumenting.
+	 * Idioms are executed as the loops they are in this mode. */
+	int single_function;
+	/* Limits of the execution, zero meaning no limit, as in the interpreter
+	 * (see vm_t): a number of program executions (for each thread if the
+	 * program uses tasks) and a timeout in milliseconds. A counter is
+	 * decremented at each program entry, and the clock is only read every
+	 * few thousands of them. Going beyond a limit exits with status 1,
+	 * after printing the stack on stderr if dump_stack is non-zero.
+	 * With any limit, the nesting depth of the program functions is also
+	 * limited, to max_depth or VM_DEFAULT_MAX_DEPTH if zero (this does not
+	 * apply to the single function, that does not use the C stack). */
+	unsigned int max_steps;
+	unsigned int timeout_ms;
+	unsigned int max_depth;
+	int dump_stack;
+};
+typedef struct emit_c_opt_t emit_c_opt_t;
+
+/* The options can be NULL for the default options. */
+void emit_c_full_prog(gs_t* gs, const full_prog_t* full_prog,
+	const emit_c_opt_t* opt);
+
+/* Emits the function jit_prog_N (N being the given index) that executes the
+ * given program on the stack of a jit_ctx_t, for the tiered execution (see
+ * jit.h). Unlike the programs of emit_c_full_prog, it checks everything that
+ * the interpreter checks and returns the same statuses, which are named by
+ * macros defined by jit.c (the code needs its prelude). Only the programs of
+ * instructions that jit.h allows are handled.
+ * Returns 0 on success, and -1 (emitting nothing) if it is not handled. */
+int emit_c_jit_prog(gs_t* gs, const full_prog_t* full_prog,
+	unsigned int prog_index);
 
 #endif /* HELV_EMIT_C_HEADER */
@@ -22,12 +22,10 @@ typedef struct gs_t gs_t;
 		ASSERT(gs_ptr_->len <= gs_ptr_->cap, \
 			"The length (%u) is greater than the capacity (%u)\n", \
 			gs_ptr_->len, gs_ptr_->cap); \
-		CODE_FOR_ASSERT(unsigned int strlen_result_inc = \
-			strlen(gs_ptr_->str) + 1); \
-		ASSERT(strlen_result_inc == gs_ptr_->len, \
+		ASSERT_AT(CHECK_LEVEL_CALL, strlen(gs_ptr_->str) + 1 == gs_ptr_->len, \
 			"The length \"len\" stored in the growable string (%u) " \
 			"doesn't equal the result of strlen(str)+1 (%u) as it should\n", \
-			gs_ptr_->len, strlen_result_inc); \
+			gs_ptr_->len, (unsigned int)strlen(gs_ptr_->str) + 1); \
 	} while (0)
 
 void gs_init(gs_t* gs);
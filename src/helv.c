@@ -0,0 +1,108 @@
+
+#include "helv.h"
+#include "utils.h"
+#include "prog.h"
+#include "parser.h"
+#include "preproc.h"
+#include "interpreter.h"
+#include <stdint.h>
+
+struct helv_prog_t
+{
+	full_prog_t full_prog;
+};
+
+struct helv_vm_t
+{
+	const helv_prog_t* prog;
+	vm_t vm;
+};
+
+helv_prog_t* helv_prog_compile(const char* src)
+{
+	ASSERT(src != NULL, "The pointer is NULL\n");
+	char* expanded_src = preproc_src(src, NULL);
+	if (expanded_src == NULL)
+	{
+		return NULL;
+	}
+	helv_prog_t* prog = xmalloc(sizeof(helv_prog_t));
+	prog->full_prog = (full_prog_t){0};
+	parse_full_prog(expanded_src, &prog->full_prog);
+	xfree(expanded_src);
+	return prog;
+}
+
+void helv_prog_destroy(helv_prog_t* prog)
+{
+	if (prog == NULL)
+	{
+		return;
+	}
+	full_prog_cleanup(&prog->full_prog);
+	xfree(prog);
+}
+
+helv_vm_t* helv_vm_create(const helv_prog_t* prog,
+	helv_write_t write, void* data)
+{
+	ASSERT(prog != NULL, "The pointer is NULL\n");
+	helv_vm_t* vm = xmalloc(sizeof(helv_vm_t));
+	vm->prog = prog;
+	vm->vm = (vm_t){.out_write = write, .out_data = data};
+	return vm;
+}
+
+void helv_vm_destroy(helv_vm_t* vm)
+{
+	if (vm == NULL)
+	{
+		return;
+	}
+	vm_cleanup(&vm->vm);
+	xfree(vm);
+}
+
+int helv_vm_run(helv_vm_t* vm)
+{
+	ASSERT(vm != NULL, "The pointer is NULL\n");
+	exec_status_t status = execute_full_prog(&vm->prog->full_prog, &vm->vm);
+	return exec_status_is_error(status) ? (int)status : 0;
+}
+
+void helv_vm_set_limits(helv_vm_t* vm, unsigned int max_steps,
+	unsigned int timeout_ms)
+{
+	ASSERT(vm != NULL, "The pointer is NULL\n");
+	vm->vm.max_steps = max_steps;
+	vm->vm.timeout_ms = timeout_ms;
+}
+
+void helv_vm_reset(helv_vm_t* vm)
+{
+	ASSERT(vm != NULL, "The pointer is NULL\n");
+	vm->vm.st.len = 0;
+}
+
+void helv_vm_push(helv_vm_t* vm, uint8_t byte)
+{
+	ASSERT(vm != NULL, "The pointer is NULL\n");
+	st_push(&vm->vm.st, byte);
+}
+
+const uint8_t* helv_vm_stack(const helv_vm_t* vm, unsigned int* len)
+{
+	ASSERT(vm != NULL, "The pointer is NULL\n");
+	ASSERT(len != NULL, "The pointer is NULL\n");
+	*len = vm->vm.st.len;
+	return vm->vm.st.array;
+}
+
+const char* helv_error_name(int error)
+{
+	if (error < 0 || error >= NUMBER_OF_EXEC_STATUSES)
+	{
+		return "unknown error";
+	}
+	return exec_status_name(error);
+}
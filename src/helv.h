@@ -0,0 +1,71 @@
+
+#ifndef HELV_HEADER
+#define HELV_HEADER
+
+/* Public interface of libhelv, for embedding Helv in C programs.
+ *
+ * A compiled program is built once and is never modified afterwards, so it
+ * can be shared by any number of virtual machines, even across threads.
+ * A virtual machine owns a stack and an output sink, and executes a compiled
+ * program. Different virtual machines share no state, so they can run
+ * concurrently as long as each one is used by only one thread at a time.
+ *
+ * Example:
+ *   helv_prog_t* prog = helv_prog_compile("'olleh' ;ppppp");
+ *   helv_vm_t* vm = helv_vm_create(prog, NULL, NULL);
+ *   helv_vm_run(vm);
+ *   helv_vm_destroy(vm);
+ *   helv_prog_destroy(prog); */
+
+#include <stdint.h>
+
+/* Opaque compiled program. */
+typedef struct helv_prog_t helv_prog_t;
+
+/* Opaque virtual machine. */
+typedef struct helv_vm_t helv_vm_t;
+
+/* Receives the bytes printed by a running program. */
+typedef void (*helv_write_t)(void* data, const uint8_t* bytes,
+	unsigned int len);
+
+/* Compiles the given Helv source code (after expanding its preprocessor
+ * directives, see src/preproc.h), returns NULL if the expansion fails. */
+helv_prog_t* helv_prog_compile(const char* src);
+
+void helv_prog_destroy(helv_prog_t* prog);
+
+/* Creates a virtual machine with an empty stack that executes the given
+ * compiled program, which must outlive the virtual machine.
+ * If write is NULL then the output goes to stdout. */
+helv_vm_t* helv_vm_create(const helv_prog_t* prog,
+	helv_write_t write, void* data);
+
+void helv_vm_destroy(helv_vm_t* vm);
+
+/* Executes the program from its beginning on the current stack.
+ * Returns 0 if the program ended normally or halted, and a non-zero error
+ * code otherwise (see helv_error_name). */
+int helv_vm_run(helv_vm_t* vm);
+
+/* Limits the next runs to the given number of program executions (each
+ * loop iteration being one) and of milliseconds, zero meaning no limit.
+ * A run that goes beyond a limit stops with an error. */
+void helv_vm_set_limits(helv_vm_t* vm, unsigned int max_steps,
+	unsigned int timeout_ms);
+
+/* Empties the stack, for the virtual machine to be used for another run
+ * (the allocated memory is kept). */
+void helv_vm_reset(helv_vm_t* vm);
+
+/* Pushes a byte on the stack, allows to pass arguments to the program. */
+void helv_vm_push(helv_vm_t* vm, uint8_t byte);
+
+/* Gives access to the stack, bottom first, the stack height is written
+ * in *len. The pointer is valid until the next run, push or reset. */
+const uint8_t* helv_vm_stack(const helv_vm_t* vm, unsigned int* len);
+
+/* Returns a short description of an error code returned by helv_vm_run. */
+const char* helv_error_name(int error);
+
+#endif /* HELV_HEADER */
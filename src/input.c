@@ -0,0 +1,109 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "input.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h> /* open */
+#include <unistd.h> /* read, close, lseek */
+#include <sys/stat.h> /* fstat */
+#include <sys/mman.h> /* mmap, posix_madvise */
+#include <errno.h>
+
+void in_init_fd(in_t* in, int fd)
+{
+	*in = (in_t){.fd = fd};
+	/* Reading starts at the current position of the fd, which may have been
+	 * moved by whoever handed it to us. */
+	struct stat file_stat;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+		offset >= 0 && offset < file_stat.st_size)
+	{
+		void* mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE,
+			fd, 0);
+		if (mapped != MAP_FAILED)
+		{
+			posix_madvise(mapped, file_stat.st_size, POSIX_MADV_SEQUENTIAL);
+			in->data = mapped;
+			in->len = file_stat.st_size;
+			in->i = offset;
+			in->mapped_len = file_stat.st_size;
+			in->is_at_end = 1;
+			return;
+		}
+	}
+	/* Not mappable, it will be read in big chunks into a buffer that is
+	 * only allocated by the first refill (most programs never read). */
+}
+
+int in_init_file(in_t* in, const char* file_path)
+{
+	int fd = open(file_path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "File error: failed to open \"%s\"\n", file_path);
+		return -1;
+	}
+	in_init_fd(in, fd);
+	if (in->mapped_len != 0)
+	{
+		/* The mapping stays valid after the close. */
+		close(fd);
+		in->fd = -1;
+	}
+	else
+	{
+		in->owns_fd = 1;
+	}
+	return 0;
+}
+
+void in_cleanup(in_t* in)
+{
+	ASSERT_CHECK_IN_PTR(in);
+	if (in->mapped_len != 0)
+	{
+		munmap((void*)in->data, in->mapped_len);
+	}
+	xfree(in->buffer);
+	if (in->owns_fd)
+	{
+		close(in->fd);
+	}
+}
+
+int in_refill(in_t* in)
+{
+	ASSERT_CHECK_IN_PTR(in);
+	if (in->i < in->len)
+	{
+		return 1;
+	}
+	if (in->is_at_end)
+	{
+		return 0;
+	}
+	if (in->buffer == NULL)
+	{
+		in->buffer = xmalloc(IN_BUFFER_SIZE);
+		in->data = in->buffer;
+	}
+	ssize_t read_len;
+	do
+	{
+		read_len = read(in->fd, in->buffer, IN_BUFFER_SIZE);
+	} while (read_len < 0 && errno == EINTR);
+	if (read_len <= 0)
+	{
+		in->has_failed = read_len < 0;
+		in->is_at_end = 1;
+		in->len = 0;
+		in->i = 0;
+		return 0;
+	}
+	in->len = read_len;
+	in->i = 0;
+	return 1;
+}
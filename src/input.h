@@ -0,0 +1,58 @@
+
+#ifndef HELV_INPUT_HEADER
+#define HELV_INPUT_HEADER
+
+#include "utils.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/* Input source, reading byte by byte from it costs about as much as an array
+ * access. Regular files are mmap-ed whole, anything else (pipes, terminals)
+ * is read in big chunks into a buffer. */
+struct in_t
+{
+	int fd;
+	const uint8_t* data; /* The mapped file or the buffer. */
+	size_t len; /* Number of readable bytes in data. */
+	size_t i; /* Index of the next byte to read in data. */
+	uint8_t* buffer; /* NULL if the file is mapped or nothing was read yet. */
+	size_t mapped_len; /* 0 if the file is not mapped. */
+	int is_at_end; /* The fd was read until the end, or until an error. */
+	int has_failed; /* Reading the fd failed, which ended the input. */
+	int owns_fd; /* The fd is closed by the cleanup. */
+};
+typedef struct in_t in_t;
+
+#define IN_BUFFER_SIZE (1u << 20)
+
+#define ASSERT_CHECK_IN_PTR(in_ptr_) \
+	do \
+	{ \
+		ASSERT(in_ptr_ != NULL, "The pointer is NULL\n"); \
+		ASSERT(in_ptr_->i <= in_ptr_->len, \
+			"The read index is past the readable bytes\n"); \
+	} while (0)
+
+/* Initializes an input source reading from the given file descriptor,
+ * starting at its current position. The fd is not closed by in_cleanup. */
+void in_init_fd(in_t* in, int fd);
+
+/* Initializes an input source reading from the given file.
+ * The file is closed by in_cleanup. Returns non-zero on failure (the file cannot be opened). */
+int in_init_file(in_t* in, const char* file_path);
+
+void in_cleanup(in_t* in);
+
+/* Makes more bytes readable if the data is exhausted.
+ * Returns zero if there is nothing left to read, which is also the case
+ * once reading failed (see has_failed). */
+int in_refill(in_t* in);
+
+/* Returns non-zero if there is at least one byte left to read. */
+#define IN_HAS_BYTE(in_ptr_) \
+	((in_ptr_)->i < (in_ptr_)->len || in_refill(in_ptr_))
+
+/* Reads the next byte, there must be one (see IN_HAS_BYTE). */
+#define IN_READ_BYTE(in_ptr_) ((in_ptr_)->data[(in_ptr_)->i++])
+
+#endif /* HELV_INPUT_HEADER */
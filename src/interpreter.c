@@ -1,7 +1,22 @@
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "utils.h"
 #include "interpreter.h"
+#include "task.h"
+#include "coro.h"
+#include "snapshot.h"
+#include "parser.h"
+#include "jit.h"
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h> /* memcpy, memchr */
+#include <limits.h> /* UINT_MAX */
+#include <time.h> /* clock_gettime */
+
+/* Steps taken at once from shared steps, contexts with tasks stop when there
+ * are no shared steps left, even if others still hold some of their slice. */
+#define VM_STEP_SLICE 1024
 
 void st_cleanup(st_t* st)
 {
@@ -14,6 +29,7 @@ void st_push(st_t* st, uint8_t byte)
 	ASSERT_CHECK_ST_PTR(st);
 	st->len++;
 	DARRAY_RESIZE_IF_NEEDED(st->len, st->cap, st->array, uint8_t);
+	ST_UPDATE_PEAK(st);
 	st->array[st->len-1] = byte;
 }
 
@@ -24,32 +40,541 @@ uint8_t st_pop(st_t* st)
 	return st->array[--st->len];
 }
 
-static void execute_prog(const full_prog_t* full_prog, unsigned int prog_index,
-	st_t* st)
+void vm_cleanup(vm_t* vm)
 {
-	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
-	ASSERT_CHECK_ST_PTR(st);
+	ASSERT_CHECK_VM_PTR(vm);
+	if (vm->task_array != NULL)
+	{
+		/* Tasks that were never joined still have to end. */
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			if (vm->task_array[i] != NULL)
+			{
+				pool_join(vm->pool, vm->task_array[i], &vm->st);
+			}
+		}
+		free(vm->task_array);
+	}
+	if (vm->owns_shared_steps)
+	{
+		steps_destroy(vm->shared_steps);
+	}
+	if (vm->coro_array != NULL)
+	{
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			if (vm->coro_array[i] != NULL)
+			{
+				coro_destroy(vm->coro_array[i]);
+			}
+		}
+		free(vm->coro_array);
+	}
+	st_cleanup(&vm->st);
+	free(vm->frame_array);
+}
+
+double vm_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int exec_status_is_error(exec_status_t status)
+{
+	return status != EXEC_STATUS_OK && status != EXEC_STATUS_HALT;
+}
+
+const char* exec_status_name(exec_status_t status)
+{
+	switch (status)
+	{
+		case EXEC_STATUS_OK:               return "ok";
+		case EXEC_STATUS_HALT:             return "halted";
+		case EXEC_STATUS_STACK_UNDERFLOW:  return "stack underflow";
+		case EXEC_STATUS_OUT_OF_BOUNDS:    return "access out of the stack";
+		case EXEC_STATUS_DIVISION_BY_ZERO: return "division by zero";
+		case EXEC_STATUS_BAD_PROG_INDEX:
+			return "execution out of the program table";
+		case EXEC_STATUS_IMPURE:           return "impure instruction";
+		case EXEC_STATUS_OUT_OF_FUEL:      return "out of fuel";
+		case EXEC_STATUS_TIMEOUT:          return "timeout";
+		case EXEC_STATUS_BAD_TASK_HANDLE:  return "join of no task";
+		case EXEC_STATUS_TOO_MANY_TASKS:   return "too many tasks";
+		case EXEC_STATUS_BAD_CORO_HANDLE:  return "resume of no coroutine";
+		case EXEC_STATUS_TOO_MANY_COROS:   return "too many coroutines";
+		case EXEC_STATUS_BAD_YIELD:        return "yield out of a coroutine";
+		case EXEC_STATUS_BAD_SNAPSHOT:
+			return "snapshot after a spawn or a create";
+		case EXEC_STATUS_SNAPSHOT_FAILED:  return "snapshot not written";
+		case EXEC_STATUS_TOO_DEEP:         return "too deep recursion";
+		case EXEC_STATUS_READ_FAILED:      return "input not read";
+		case EXEC_STATUS_SNAPSHOT:         return "snapshot";
+		default:
+			ASSERT(0, "Unknown execution status %d\n", (int)status);
+			return "unknown";
+	}
+}
+
+/* Sends the given bytes to the output sink of the given context. */
+static void vm_out(vm_t* vm, const uint8_t* bytes, unsigned int len)
+{
+	if (vm->pool != NULL)
+	{
+		pool_lock_output(vm->pool);
+	}
+	if (vm->out_write == NULL)
+	{
+		fwrite(bytes, 1, len, stdout);
+		fflush(stdout);
+	}
+	else
+	{
+		vm->out_write(vm->out_data, bytes, len);
+	}
+	if (vm->pool != NULL)
+	{
+		pool_unlock_output(vm->pool);
+	}
+}
+
+/* Starts the execution of the given program in a new context whose stack is
+ * the given number of cells popped from the top of the stack of the given
+ * context, and pushes the handle of the new task. */
+static exec_status_t vm_spawn(const full_prog_t* full_prog,
+	unsigned int prog_index, unsigned int cell_count, vm_t* vm)
+{
+	st_t* st = &vm->st;
+	ASSERT(cell_count <= st->len, "There are not enough cells\n");
+	if (vm->task_array == NULL)
+	{
+		vm->task_array = xcalloc(256, sizeof(struct task_t*));
+	}
+	unsigned int handle = 0;
+	while (handle < 256 && vm->task_array[handle] != NULL)
+	{
+		handle++;
+	}
+	if (handle == 256)
+	{
+		return EXEC_STATUS_TOO_MANY_TASKS;
+	}
+	if (vm->pool == NULL)
+	{
+		vm->pool = pool_get();
+	}
+	if (vm->fuel != 0 && vm->shared_steps == NULL)
+	{
+		/* The fuel runs out at the execution after the last allowed one. */
+		vm->shared_steps = steps_create(vm->fuel - 1);
+		vm->owns_shared_steps = 1;
+		vm->fuel = 1;
+	}
+	vm_t task_vm = {
+		.out_write = vm->out_write,
+		.out_data = vm->out_data,
+		.fuel = vm->shared_steps != NULL, /* Takes a slice at once. */
+		.shared_steps = vm->shared_steps,
+		.deadline_ms = vm->deadline_ms,
+		.clock_countdown = vm->clock_countdown,
+		.depth = vm->depth, /* The joiner may execute the task itself. */
+		.max_depth = vm->max_depth,
+		.pool = vm->pool,
+	};
+	if (cell_count > 0)
+	{
+		task_vm.st.array = xmalloc(cell_count);
+		task_vm.st.len = task_vm.st.cap = cell_count;
+		task_vm.st.peak_len = cell_count;
+		memcpy(task_vm.st.array, &st->array[st->len - cell_count], cell_count);
+		st->len -= cell_count;
+	}
+	vm->task_array[handle] = pool_spawn(vm->pool, full_prog, prog_index,
+		&task_vm);
+	st_push(st, handle);
+	return EXEC_STATUS_OK;
+}
+
+/* Waits for the task of the given handle, and pushes its whole stack. */
+static exec_status_t vm_join(vm_t* vm, uint8_t handle)
+{
+	if (vm->task_array == NULL || vm->task_array[handle] == NULL)
+	{
+		return EXEC_STATUS_BAD_TASK_HANDLE;
+	}
+	struct task_t* task = vm->task_array[handle];
+	vm->task_array[handle] = NULL;
+	if (vm->shared_steps != NULL && vm->fuel > 1)
+	{
+		/* The task may need the rest of the slice while this one waits. */
+		steps_give_back(vm->shared_steps, vm->fuel - 1);
+		vm->fuel = 1;
+	}
+	return pool_join(vm->pool, task, &vm->st);
+}
+
+/* Returns the height the stack would have after popping everything above
+ * its highest 0 (so 0 if there is no 0). */
+static unsigned int st_find_zero_end(const st_t* st)
+{
+	unsigned int end = st->len;
+	while (end > 0 && st->array[end-1] != 0)
+	{
+		end--;
+	}
+	return end;
+}
+
+/* Pops and prints the cells down to the given height, top first.
+ * The popped cells are reversed in place (they are not part of the stack
+ * anymore) to be printed at once. */
+static void vm_print_reverse(vm_t* vm, unsigned int end)
+{
+	st_t* st = &vm->st;
+	ASSERT(end <= st->len, "The end is above the stack\n");
+	for (unsigned int a = end, b = st->len; a + 1 < b; a++, b--)
+	{
+		uint8_t x = st->array[a];
+		st->array[a] = st->array[b-1];
+		st->array[b-1] = x;
+	}
+	if (st->len > end)
+	{
+		vm_out(vm, &st->array[end], st->len - end);
+	}
+	st->len = end;
+}
+
+/* Does what the loop of the given idiom would do, if it can be done natively
+ * with the exact same result (else returns zero and does nothing, and the
+ * loop has to be executed as usual, which takes care of errors).
+ * This counts as only one program execution when it comes to fuel. */
+static int execute_idiom(vm_t* vm, idiom_id_t idiom_id)
+{
+	st_t* st = &vm->st;
+	switch (idiom_id)
+	{
+		case IDIOM_ID_EMPTY_STACK:
+			st->len &= ~255u;
+			return 1;
+		case IDIOM_ID_PRINT_REVERSE:
+		case IDIOM_ID_PRINT_REVERSE_KEEP_ZERO:
+			{
+				unsigned int end = st_find_zero_end(st);
+				if (vm->is_pure || end == 0)
+				{
+					return 0;
+				}
+				vm_print_reverse(vm, end);
+				if (idiom_id == IDIOM_ID_PRINT_REVERSE)
+				{
+					st->len--;
+				}
+			}
+			return 1;
+		case IDIOM_ID_PRINT_FORWARD:
+			{
+				/* The height must fit in a byte (it is pushed in the loop)
+				 * and the index must be under itself. */
+				unsigned int n = st->len;
+				if (vm->is_pure || n == 0 || n+1 > 255 ||
+					st->array[n-1] + 1u >= n)
+				{
+					return 0;
+				}
+				unsigned int index = st->array[n-1];
+				vm_out(vm, &st->array[index], n-1 - index);
+				st->array[n-1] = n-1;
+			}
+			return 1;
+		case IDIOM_ID_DIGITS:
+			{
+				if (st->len == 0 || st->array[st->len-1] + 1u >= st->len)
+				{
+					return 0;
+				}
+				uint8_t index = st->array[st->len-1];
+				uint8_t number = st->array[index];
+				do
+				{
+					st_push(st, index);
+					st->array[st->len-2] = number % 10 + '0';
+					number /= 10;
+				} while (number != 0);
+				st->array[index] = 0;
+			}
+			return 1;
+		default:
+			ASSERT(0, "Unknown idiom %d\n", (int)idiom_id);
+			return 0;
+	}
+}
+
+/* Creates a coroutine that will execute the given program,
+ * and pushes its handle. */
+static exec_status_t vm_create(const full_prog_t* full_prog,
+	unsigned int prog_index, vm_t* vm)
+{
+	if (vm->coro_array == NULL)
+	{
+		vm->coro_array = xcalloc(256, sizeof(struct coro_t*));
+	}
+	unsigned int handle = 0;
+	while (handle < 256 && vm->coro_array[handle] != NULL)
+	{
+		handle++;
+	}
+	if (handle == 256)
+	{
+		return EXEC_STATUS_TOO_MANY_COROS;
+	}
+	vm->coro_array[handle] = coro_create(full_prog, prog_index, vm);
+	if (vm->coro_array[handle] == NULL)
+	{
+		return EXEC_STATUS_TOO_MANY_COROS;
+	}
+	st_push(&vm->st, handle);
+	return EXEC_STATUS_OK;
+}
+
+/* Resumes the coroutine of the given handle, and pushes 1 if it yielded
+ * or 0 if it ended (it is destroyed then). */
+static exec_status_t vm_resume(vm_t* vm, uint8_t handle,
+	unsigned int cell_count)
+{
+	if (vm->coro_array == NULL || vm->coro_array[handle] == NULL ||
+		coro_is_running(vm->coro_array[handle]))
+	{
+		return EXEC_STATUS_BAD_CORO_HANDLE;
+	}
+	int has_ended;
+	exec_status_t status = coro_resume(vm->coro_array[handle], cell_count,
+		&has_ended);
+	if (has_ended)
+	{
+		coro_destroy(vm->coro_array[handle]);
+		vm->coro_array[handle] = NULL;
+	}
+	st_push(&vm->st, !has_ended);
+	return status;
+}
+
+static void vm_add_frame(vm_t* vm, exec_frame_t frame)
+{
+	vm->frame_count++;
+	DARRAY_RESIZE_IF_NEEDED(vm->frame_count, vm->frame_cap, vm->frame_array,
+		exec_frame_t);
+	vm->frame_array[vm->frame_count-1] = frame;
+}
+
+/* Adds the frame of an execution of the given code that is returning because
+ * of a snapshot, the rest of the code starts at the given offset.
+ * The code is a program or the rest of one, found by its address. */
+static void vm_add_code_frame(vm_t* vm, const full_prog_t* full_prog,
+	const uint8_t* code, unsigned int offset,
+	uint8_t loop_instr, uint8_t loop_prog_index, uint8_t loop_left)
+{
+	unsigned int prog_index = 0;
+	while (prog_index < full_prog->len)
+	{
+		const prog_t* prog = &full_prog->array[prog_index];
+		if (prog->len != 0 &&
+			code >= prog->array && code < prog->array + prog->len)
+		{
+			break;
+		}
+		prog_index++;
+	}
 	ASSERT(prog_index < full_prog->len,
-		"Attempting to execute out of the program table bounds\n");
-	const prog_t* prog = &full_prog->array[prog_index];
+		"The executed code is not part of a program\n");
+	vm_add_frame(vm, (exec_frame_t){
+		.prog_index = prog_index,
+		.offset = (code - full_prog->array[prog_index].array) + offset,
+		.loop_instr = loop_instr,
+		.loop_prog_index = loop_prog_index,
+		.loop_left = loop_left,
+	});
+}
+
+/* Callbacks of the programs compiled by the jit, the stack is lent to them
+ * for the time of their execution. */
+static int jit_ctx_execute(jit_ctx_t* ctx, unsigned int prog_index)
+{
+	vm_t* vm = ctx->vm;
+	vm->st.array = ctx->st;
+	vm->st.len = ctx->len;
+	vm->st.cap = ctx->cap;
+	exec_status_t status = execute_prog(ctx->full_prog, prog_index, vm);
+	ctx->st = vm->st.array;
+	ctx->len = vm->st.len;
+	ctx->cap = vm->st.cap;
+	return status;
+}
+
+static void jit_ctx_reserve(jit_ctx_t* ctx, unsigned int cell_count)
+{
+	unsigned int len = ctx->len + cell_count;
+	DARRAY_RESIZE_IF_NEEDED(len, ctx->cap, ctx->st, uint8_t);
+}
+
+static void jit_ctx_out(jit_ctx_t* ctx, uint8_t byte)
+{
+	vm_out(ctx->vm, &byte, 1);
+}
+
+static exec_status_t execute_jit_fn(const full_prog_t* full_prog,
+	jit_fn_t fn, vm_t* vm)
+{
+	jit_ctx_t ctx = {
+		.st = vm->st.array,
+		.len = vm->st.len,
+		.cap = vm->st.cap,
+		.vm = vm,
+		.full_prog = full_prog,
+		.execute = jit_ctx_execute,
+		.reserve = jit_ctx_reserve,
+		.out = jit_ctx_out,
+	};
+	exec_status_t status = fn(&ctx);
+	vm->st.array = ctx.st;
+	vm->st.len = ctx.len;
+	vm->st.cap = ctx.cap;
+	ST_UPDATE_PEAK(&vm->st);
+	return status;
+}
+
+exec_status_t execute_prog(const full_prog_t* full_prog,
+	unsigned int prog_index, vm_t* vm)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	if (prog_index >= full_prog->len)
+	{
+		return EXEC_STATUS_BAD_PROG_INDEX;
+	}
+	if (vm->fuel != 0 && --vm->fuel == 0)
+	{
+		/* The slice is for this execution and the following ones. */
+		vm->fuel = vm->shared_steps == NULL ? 0 :
+			steps_take(vm->shared_steps, VM_STEP_SLICE);
+		if (vm->fuel == 0)
+		{
+			return EXEC_STATUS_OUT_OF_FUEL;
+		}
+	}
+	if (vm->clock_countdown != 0 && --vm->clock_countdown == 0)
+	{
+		if (vm_time_ms() >= vm->deadline_ms)
+		{
+			/* Any further program execution also times out. */
+			vm->clock_countdown = 1;
+			return EXEC_STATUS_TIMEOUT;
+		}
+		vm->clock_countdown = VM_CLOCK_PERIOD;
+	}
+	unsigned int max_depth =
+		vm->max_depth != 0 ? vm->max_depth : VM_DEFAULT_MAX_DEPTH;
+	if (vm->depth >= max_depth)
+	{
+		return EXEC_STATUS_TOO_DEEP;
+	}
+	if (full_prog->lazy_array != NULL)
+	{
+		parse_lazy_prog(full_prog, prog_index);
+	}
+	exec_status_t status;
+	vm->depth++;
+	jit_fn_t fn = vm->jit != NULL ? jit_enter(vm->jit, prog_index) : NULL;
+	if (fn != NULL)
+	{
+		status = execute_jit_fn(full_prog, fn, vm);
+	}
+	else
+	{
+		const prog_t* prog = full_prog_get_prog(full_prog, prog_index);
+		status = execute_code(full_prog, prog->array, prog->len, vm);
+	}
+	vm->depth--;
+	return status;
+}
+
+exec_status_t execute_code(const full_prog_t* full_prog,
+	const uint8_t* code, unsigned int len, vm_t* vm)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	ASSERT(code != NULL || len == 0, "The pointer is NULL\n");
+	st_t* st = &vm->st;
+	exec_status_t status;
+	/* Every instruction first makes sure that the cells it pops are there. */
+	#define NEED(how_many_) \
+		do \
+		{ \
+			if (st->len < (how_many_)) \
+			{ \
+				return EXEC_STATUS_STACK_UNDERFLOW; \
+			} \
+		} while (0)
+	/* Input and output must not happen in a pure context. */
+	#define IMPURE() \
+		do \
+		{ \
+			if (vm->is_pure) \
+			{ \
+				return EXEC_STATUS_IMPURE; \
+			} \
+		} while (0)
+	/* The loop arguments are what is left to do of the loop instruction
+	 * executing the program, for a snapshot. */
+	#define EXECUTE_SUB_PROG(sub_prog_index_, \
+		loop_instr_, loop_prog_index_, loop_left_) \
+		do \
+		{ \
+			status = execute_prog(full_prog, (sub_prog_index_), vm); \
+			if (status != EXEC_STATUS_OK) \
+			{ \
+				if (status == EXEC_STATUS_SNAPSHOT) \
+				{ \
+					vm_add_code_frame(vm, full_prog, code, i, \
+						(loop_instr_), (loop_prog_index_), (loop_left_)); \
+				} \
+				return status; \
+			} \
+		} while (0)
 	unsigned int i = 0;
-	while (i < prog->len)
+	while (i < len)
 	{
-		switch (prog->array[i++])
+		switch (code[i++])
 		{
 			case INSTR_ID_NOP:
 				;
 			break;
 			case INSTR_ID_PUSH_IMM:
-				ASSERT(i < prog->len,
+				ASSERT(i < len,
 					"A \"push immediate\" instruction cannot start "
 					"at the last byte\n");
-				st_push(st, prog->array[i++]);
+				st_push(st, code[i++]);
+			break;
+			case INSTR_ID_PUSH_BYTES:
+				ASSERT(i < len && i+1 + code[i] <= len,
+					"A \"push bytes\" instruction is cut\n");
+				{
+					unsigned int n = code[i++];
+					st->len += n;
+					DARRAY_RESIZE_IF_NEEDED(st->len, st->cap, st->array,
+						uint8_t);
+					ST_UPDATE_PEAK(st);
+					memcpy(&st->array[st->len - n], &code[i], n);
+					i += n;
+				}
 			break;
 			case INSTR_ID_KILL:
+				NEED(1);
 				st_pop(st);
 			break;
 			case INSTR_ID_DUPLICATE:
+				NEED(1);
 				{
 					uint8_t a = st_pop(st);
 					st_push(st, a);
@@ -57,6 +582,7 @@ static void execute_prog(const full_prog_t* full_prog, unsigned int prog_index,
 				}
 			break;
 			case INSTR_ID_SWAP:
+				NEED(2);
 				{
 					uint8_t a = st_pop(st);
 					uint8_t b = st_pop(st);
@@ -65,19 +591,25 @@ static void execute_prog(const full_prog_t* full_prog, unsigned int prog_index,
 				}
 			break;
 			case INSTR_ID_GET:
+				NEED(1);
 				{
 					uint8_t index = st_pop(st);
-					ASSERT(index < st->len,
-						"Attempting to get out of bounds\n");
+					if (index >= st->len)
+					{
+						return EXEC_STATUS_OUT_OF_BOUNDS;
+					}
 					st_push(st, st->array[index]);
 				}
 			break;
 			case INSTR_ID_SET:
+				NEED(2);
 				{
 					uint8_t index = st_pop(st);
 					uint8_t value = st_pop(st);
-					ASSERT(index < st->len,
-						"Attempting to set out of bounds\n");
+					if (index >= st->len)
+					{
+						return EXEC_STATUS_OUT_OF_BOUNDS;
+					}
 					st->array[index] = value;
 				}
 			break;
@@ -85,9 +617,11 @@ static void execute_prog(const full_prog_t* full_prog, unsigned int prog_index,
 				st_push(st, st->len);
 			break;
 			case INSTR_ID_ADD:
+				NEED(2);
 				st_push(st, st_pop(st) + st_pop(st));
 			break;
 			case INSTR_ID_SUBTRACT:
+				NEED(2);
 				{
 					uint8_t a = st_pop(st);
 					uint8_t b = st_pop(st);
@@ -95,96 +629,363 @@ static void execute_prog(const full_prog_t* full_prog, unsigned int prog_index,
 				}
 			break;
 			case INSTR_ID_MULTIPLY:
+				NEED(2);
 				st_push(st, st_pop(st) * st_pop(st));
 			break;
 			case INSTR_ID_DIVIDE:
+				NEED(2);
 				{
 					uint8_t a = st_pop(st);
 					uint8_t b = st_pop(st);
-					ASSERT(b != 0, "Attempting to devide by zero\n");
+					if (b == 0)
+					{
+						return EXEC_STATUS_DIVISION_BY_ZERO;
+					}
 					st_push(st, a / b);
 				}
 			break;
 			case INSTR_ID_MODULUS:
+				NEED(2);
 				{
 					uint8_t a = st_pop(st);
 					uint8_t b = st_pop(st);
-					ASSERT(b != 0,
-						"Attempting to get the reminder "
-						"of a division by zero\n");
+					if (b == 0)
+					{
+						return EXEC_STATUS_DIVISION_BY_ZERO;
+					}
 					st_push(st, a % b);
 				}
 			break;
 			case INSTR_ID_EXECUTE:
-				{
-					uint8_t sub_prog_index = st_pop(st);
-					ASSERT(sub_prog_index < full_prog->len,
-						"Attempting to execute "
-						"out of the program table bounds\n");
-					execute_prog(full_prog, sub_prog_index, st);
-				}
+				NEED(1);
+				EXECUTE_SUB_PROG(st_pop(st), INSTR_ID_NOP, 0, 0);
 			break;
 			case INSTR_ID_IFELSE:
+				NEED(3);
 				{
 					uint8_t condition = st_pop(st);
 					uint8_t if_prog_index = st_pop(st);
 					uint8_t else_prog_index = st_pop(st);
-					uint8_t chosen_prog_index =
-						condition ? if_prog_index : else_prog_index;
-					ASSERT(chosen_prog_index < full_prog->len,
-						"Attempting to ifelse-execute "
-						"out of the program table bounds\n");
-					execute_prog(full_prog, chosen_prog_index, st);
+					EXECUTE_SUB_PROG(
+						condition ? if_prog_index : else_prog_index,
+						INSTR_ID_NOP, 0, 0);
 				}
 			break;
+			case INSTR_ID_IDIOM_LOOP:
+				ASSERT(i+1 < len,
+					"An \"idiom loop\" instruction is cut\n");
+				i += 2;
+				if (execute_idiom(vm, code[i-2]))
+				{
+					break;
+				}
+				/* Generic fallback, the program is executed as usual. */
+				st_push(st, code[i-1]);
+				/* Fallthrough. */
 			case INSTR_ID_DOWHILE:
+				NEED(1);
 				{
 					uint8_t dowhile_prog_index = st_pop(st);
-					ASSERT(dowhile_prog_index < full_prog->len,
-						"Attempting to dowhile-execute "
-						"out of the program table bounds\n");
-					/* Hope that if one day the program table can be shrinked
-					 * dynamically, then this ASSERT gets moved in the do while
-					 * loop. */
+					uint8_t condition;
 					do
 					{
-						execute_prog(full_prog, dowhile_prog_index, st);
-					} while (st_pop(st) != 0);
+						EXECUTE_SUB_PROG(dowhile_prog_index,
+							INSTR_ID_DOWHILE, dowhile_prog_index, 0);
+						NEED(1);
+						condition = st_pop(st);
+					} while (condition != 0);
+				}
+			break;
+			case INSTR_ID_LOOKUP:
+				ASSERT(i+1 < len,
+					"A \"lookup\" instruction is cut\n");
+				ASSERT(full_prog->memo_array != NULL &&
+					full_prog->memo_array[code[i+1]].table != NULL,
+					"The looked up program has no table\n");
+				NEED(code[i]);
+				{
+					const uint8_t* table = full_prog->memo_array[code[i+1]].table;
+					unsigned int index = st_pop(st);
+					if (code[i] == 2)
+					{
+						index |= st_pop(st) << 8;
+					}
+					st_push(st, table[index]);
 				}
+				i += 2;
 			break;
 			case INSTR_ID_REPEAT:
+				NEED(2);
 				{
 					uint8_t how_may_times = st_pop(st);
 					uint8_t repeat_prog_index = st_pop(st);
-					ASSERT(how_may_times > 0 &&
-						repeat_prog_index < full_prog->len,
-						"Attempting to repeat-execute "
-						"out of the program table bounds\n");
-					/* Hope that if one day the program table can be shrinked
-					 * dynamically, then this ASSERT gets moved in the for
-					 * loop. */
 					for (unsigned int j = 0; j < how_may_times; j++)
 					{
-						execute_prog(full_prog, repeat_prog_index, st);
+						EXECUTE_SUB_PROG(repeat_prog_index,
+							INSTR_ID_REPEAT, repeat_prog_index,
+							how_may_times - j - 1);
 					}
 				}
 			break;
 			case INSTR_ID_PRINT_CHAR:
-				putchar(st_pop(st));
-				fflush(stdout);
+				IMPURE();
+				NEED(1);
+				{
+					uint8_t c = st_pop(st);
+					vm_out(vm, &c, 1);
+				}
+			break;
+			case INSTR_ID_PRINT_STRING:
+				IMPURE();
+				NEED(1);
+				{
+					uint8_t index = st_pop(st);
+					if (index > st->len)
+					{
+						return EXEC_STATUS_OUT_OF_BOUNDS;
+					}
+					const uint8_t* zero = memchr(&st->array[index], 0,
+						st->len - index);
+					unsigned int end = zero == NULL ?
+						st->len : (unsigned int)(zero - st->array);
+					vm_out(vm, &st->array[index], end - index);
+				}
+			break;
+			case INSTR_ID_PRINT_REVERSE:
+				IMPURE();
+				vm_print_reverse(vm, st_find_zero_end(st));
+				NEED(1);
+				st->len--;
+			break;
+			case INSTR_ID_SPAWN:
+				IMPURE();
+				NEED(2);
+				{
+					uint8_t spawn_prog_index = st_pop(st);
+					uint8_t cell_count = st_pop(st);
+					NEED(cell_count);
+					if (spawn_prog_index >= full_prog->len)
+					{
+						return EXEC_STATUS_BAD_PROG_INDEX;
+					}
+					status = vm_spawn(full_prog, spawn_prog_index,
+						cell_count, vm);
+					if (status != EXEC_STATUS_OK)
+					{
+						return status;
+					}
+				}
+			break;
+			case INSTR_ID_JOIN:
+				IMPURE();
+				NEED(1);
+				status = vm_join(vm, st_pop(st));
+				if (status != EXEC_STATUS_OK)
+				{
+					return status;
+				}
+			break;
+			case INSTR_ID_CREATE:
+				IMPURE();
+				NEED(1);
+				{
+					uint8_t coro_prog_index = st_pop(st);
+					if (coro_prog_index >= full_prog->len)
+					{
+						return EXEC_STATUS_BAD_PROG_INDEX;
+					}
+					status = vm_create(full_prog, coro_prog_index, vm);
+					if (status != EXEC_STATUS_OK)
+					{
+						return status;
+					}
+				}
+			break;
+			case INSTR_ID_RESUME:
+				IMPURE();
+				NEED(2);
+				{
+					uint8_t handle = st_pop(st);
+					uint8_t cell_count = st_pop(st);
+					NEED(cell_count);
+					status = vm_resume(vm, handle, cell_count);
+					if (status != EXEC_STATUS_OK)
+					{
+						return status;
+					}
+				}
+			break;
+			case INSTR_ID_YIELD:
+				IMPURE();
+				NEED(1);
+				{
+					uint8_t cell_count = st_pop(st);
+					NEED(cell_count);
+					if (vm->coro == NULL)
+					{
+						return EXEC_STATUS_BAD_YIELD;
+					}
+					coro_yield(vm, cell_count);
+				}
+			break;
+			case INSTR_ID_READ_BYTE:
+				IMPURE();
+				st_push(st, vm->in != NULL && IN_HAS_BYTE(vm->in) ?
+					IN_READ_BYTE(vm->in) : 0);
+				if (vm->in != NULL && vm->in->has_failed)
+				{
+					return EXEC_STATUS_READ_FAILED;
+				}
+			break;
+			case INSTR_ID_END_OF_INPUT:
+				IMPURE();
+				st_push(st, !(vm->in != NULL && IN_HAS_BYTE(vm->in)));
+				if (vm->in != NULL && vm->in->has_failed)
+				{
+					return EXEC_STATUS_READ_FAILED;
+				}
 			break;
 			case INSTR_ID_HALT:
-				return;
+				IMPURE();
+				return EXEC_STATUS_HALT;
+			break;
+			case INSTR_ID_SNAPSHOT:
+				IMPURE();
+				if (vm->snapshot_path == NULL)
+				{
+					break;
+				}
+				/* Tasks and coroutines have states out of the frames. */
+				if (vm->pool != NULL || vm->coro_array != NULL)
+				{
+					return EXEC_STATUS_BAD_SNAPSHOT;
+				}
+				vm_add_code_frame(vm, full_prog, code, i, INSTR_ID_NOP, 0, 0);
+				return EXEC_STATUS_SNAPSHOT;
 			break;
 		}
 	}
+	#undef EXECUTE_SUB_PROG
+	#undef IMPURE
+	#undef NEED
+	return EXEC_STATUS_OK;
+}
+
+/* Executes the suspended execution of the frames of the given context,
+ * from the innermost frame. */
+static exec_status_t execute_frames(const full_prog_t* full_prog, vm_t* vm)
+{
+	st_t* st = &vm->st;
+	while (vm->frame_count > 0)
+	{
+		exec_frame_t frame = vm->frame_array[--vm->frame_count];
+		vm->ordered_frame_count = vm->frame_count;
+		exec_status_t status = EXEC_STATUS_OK;
+		if (frame.loop_instr == INSTR_ID_DOWHILE)
+		{
+			while (1)
+			{
+				if (st->len < 1)
+				{
+					return EXEC_STATUS_STACK_UNDERFLOW;
+				}
+				if (st_pop(st) == 0)
+				{
+					break;
+				}
+				status = execute_prog(full_prog, frame.loop_prog_index, vm);
+				if (status != EXEC_STATUS_OK)
+				{
+					break;
+				}
+			}
+		}
+		else if (frame.loop_instr == INSTR_ID_REPEAT)
+		{
+			while (frame.loop_left > 0 && status == EXEC_STATUS_OK)
+			{
+				frame.loop_left--;
+				status = execute_prog(full_prog, frame.loop_prog_index, vm);
+			}
+		}
+		if (status == EXEC_STATUS_SNAPSHOT)
+		{
+			/* Suspended again in the same loop. */
+			vm_add_frame(vm, frame);
+			return status;
+		}
+		const prog_t* prog = &full_prog->array[frame.prog_index];
+		if (status == EXEC_STATUS_OK && frame.offset < prog->len)
+		{
+			status = execute_code(full_prog, &prog->array[frame.offset],
+				prog->len - frame.offset, vm);
+		}
+		if (status != EXEC_STATUS_OK)
+		{
+			return status;
+		}
+	}
+	return EXEC_STATUS_OK;
+}
+
+/* Takes the snapshots that the given status may ask for, each one followed
+ * by the execution of what was suspended to take it. */
+static exec_status_t execute_snapshots(const full_prog_t* full_prog,
+	vm_t* vm, exec_status_t status)
+{
+	while (status == EXEC_STATUS_SNAPSHOT)
+	{
+		/* The frames just added are in the reverse order. */
+		for (unsigned int a = vm->ordered_frame_count, b = vm->frame_count;
+			a+1 < b; a++, b--)
+		{
+			exec_frame_t frame = vm->frame_array[a];
+			vm->frame_array[a] = vm->frame_array[b-1];
+			vm->frame_array[b-1] = frame;
+		}
+		vm->ordered_frame_count = vm->frame_count;
+		if (snapshot_write(vm->snapshot_path, full_prog, vm) != 0)
+		{
+			return EXEC_STATUS_SNAPSHOT_FAILED;
+		}
+		status = execute_frames(full_prog, vm);
+	}
+	return status;
+}
+
+/* Sets the fuel and the deadline from the limits of the given context. */
+static void vm_start_limits(vm_t* vm)
+{
+	/* The fuel runs out at the execution after the last allowed one. */
+	vm->fuel = vm->max_steps == 0 ? 0 :
+		vm->max_steps == UINT_MAX ? UINT_MAX : vm->max_steps + 1;
+	vm->clock_countdown = 0;
+	if (vm->timeout_ms != 0)
+	{
+		vm->deadline_ms = vm_time_ms() + vm->timeout_ms;
+		vm->clock_countdown = VM_CLOCK_PERIOD;
+	}
 }
 
-void execute_full_prog(const full_prog_t* full_prog, st_t* st)
+exec_status_t execute_full_prog(const full_prog_t* full_prog, vm_t* vm)
 {
 	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
-	ASSERT_CHECK_ST_PTR(st);
+	ASSERT_CHECK_VM_PTR(vm);
 	ASSERT(full_prog->len >= 1,
 		"The full program does not contain even one program\n");
-	execute_prog(full_prog, 0, st);
+	vm_start_limits(vm);
+	vm->frame_count = 0;
+	vm->ordered_frame_count = 0;
+	exec_status_t status = execute_prog(full_prog, 0, vm);
+	return execute_snapshots(full_prog, vm, status);
+}
+
+exec_status_t execute_restored(const full_prog_t* full_prog, vm_t* vm)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	vm_start_limits(vm);
+	vm->ordered_frame_count = vm->frame_count;
+	exec_status_t status = execute_frames(full_prog, vm);
+	return execute_snapshots(full_prog, vm, status);
 }
@@ -4,6 +4,7 @@
 
 #include "utils.h"
 #include "prog.h"
+#include "input.h"
 #include <stdint.h>
 
 /* Stack of unsigned bytes. */
@@ -12,9 +13,20 @@ struct st_t
 	unsigned int len;
 	unsigned int cap;
 	uint8_t* array;
+	unsigned int peak_len; /* Greatest length reached, for statistics. */
 };
 typedef struct st_t st_t;
 
+/* To be used after the length of the stack grows. */
+#define ST_UPDATE_PEAK(st_ptr_) \
+	do \
+	{ \
+		if ((st_ptr_)->len > (st_ptr_)->peak_len) \
+		{ \
+			(st_ptr_)->peak_len = (st_ptr_)->len; \
+		} \
+	} while (0)
+
 #define ASSERT_CHECK_ST_PTR(st_ptr_) \
 	do \
 	{ \
@@ -26,6 +38,154 @@ void st_cleanup(st_t* st);
 void st_push(st_t* st, uint8_t byte);
 uint8_t st_pop(st_t* st);
 
-void execute_full_prog(const full_prog_t* full_prog, st_t* st);
+/* Output sink, receives the bytes printed by a running program. */
+typedef void (*out_write_t)(void* data, const uint8_t* bytes,
+	unsigned int len);
+
+struct pool_t;
+struct steps_t;
+struct task_t;
+struct coro_t;
+
+/* Where a suspended execution is in a program: what is left of the loop that
+ * was executing another program (if any), and the offset of the rest of the
+ * program. The layout is fixed, as frames are written as is in snapshots. */
+struct exec_frame_t
+{
+	uint32_t prog_index;
+	uint32_t offset;
+	uint8_t loop_instr; /* INSTR_ID_DOWHILE, INSTR_ID_REPEAT, or nop. */
+	uint8_t loop_prog_index;
+	uint8_t loop_left; /* Iterations left of a repeat loop. */
+	uint8_t padding;
+};
+typedef struct exec_frame_t exec_frame_t;
+
+/* Execution context, it owns everything a running program can modify.
+ * Any number of execution contexts can execute the same full program
+ * concurrently (from different threads), as the full program is only read. */
+struct vm_t
+{
+	st_t st;
+	out_write_t out_write; /* If NULL, the output goes to stdout. */
+	void* out_data; /* Passed to out_write. */
+	in_t* in; /* Input source, if NULL then there is nothing to read. */
+	int is_pure; /* If non-zero, stop before any input, output or halt. */
+	unsigned int fuel; /* If non-zero, program executions left before
+		* stopping, instructions of the full program are not counted. */
+	/* Limits of execute_full_prog, zero meaning no limit. The steps are
+	 * program executions (so every loop iteration is one), and the timeout
+	 * is in milliseconds. They set the fuel and the deadline when the
+	 * execution starts. */
+	unsigned int max_steps;
+	unsigned int timeout_ms;
+	double deadline_ms; /* In the time of vm_time_ms. */
+	unsigned int clock_countdown; /* If non-zero, program executions left
+		* before the next reading of the clock against the deadline. */
+	/* Program executions nested in one another, each one taking some of
+	 * the native stack, beyond max_depth (or VM_DEFAULT_MAX_DEPTH if zero)
+	 * the execution stops instead of overflowing the native stack. */
+	unsigned int depth;
+	unsigned int max_depth;
+	/* Spawned tasks run in contexts of the pool of the process (see task.h),
+	 * that the first spawn sets. Tasks have nothing to read, and the output
+	 * of all the contexts of the pool is serialized. */
+	struct pool_t* pool;
+	/* At the first spawn with fuel, the fuel left becomes steps shared with
+	 * all the tasks, that take them by slices (VM_STEP_SLICE) into their
+	 * own fuel. The deadline is a point in time, tasks simply copy it. */
+	struct steps_t* shared_steps;
+	int owns_shared_steps;
+	struct task_t** task_array; /* Indexed by handles, NULL if no spawn. */
+	/* Coroutines (see coro.h) belong to the context that created them. */
+	struct coro_t** coro_array; /* Indexed by handles, NULL if no create. */
+	struct coro_t* coro; /* The one being executed, NULL if none. */
+	/* File written by the snapshot instruction, that does nothing if NULL. */
+	const char* snapshot_path;
+	/* Suspended execution (see snapshot.h), the innermost frame last.
+	 * While a snapshot is taken, the frames after the ordered ones are added
+	 * innermost first, by the executions that return. */
+	unsigned int frame_count;
+	unsigned int frame_cap;
+	exec_frame_t* frame_array;
+	unsigned int ordered_frame_count;
+	/* If not NULL, the hot programs are executed as native code (see jit.h),
+	 * which cannot be suspended, so there must be no snapshot path. */
+	struct jit_t* jit;
+};
+typedef struct vm_t vm_t;
+
+/* A nested execution takes a few hundred bytes of native stack, so this
+ * fits with a wide margin in the 8 MiB of a default main thread stack. */
+#define VM_DEFAULT_MAX_DEPTH 10000
+
+/* Program executions between two readings of the clock when there is a
+ * deadline, a reading costs far more than a program execution. */
+#define VM_CLOCK_PERIOD 4096
+
+#define ASSERT_CHECK_VM_PTR(vm_ptr_) \
+	do \
+	{ \
+		ASSERT(vm_ptr_ != NULL, "The pointer is NULL\n"); \
+		ASSERT_CHECK_ST_PTR((&vm_ptr_->st)); \
+	} while (0)
+
+void vm_cleanup(vm_t* vm);
+
+/* Returns the time of a monotonic clock, in milliseconds. */
+double vm_time_ms(void);
+
+/* How an execution ended. Errors are caused by the executed program
+ * (and not by the implementation), so they are not assertions. */
+enum exec_status_t
+{
+	EXEC_STATUS_OK = 0, /* The program reached its end. */
+	EXEC_STATUS_HALT, /* The program executed a halt instruction. */
+	EXEC_STATUS_STACK_UNDERFLOW,
+	EXEC_STATUS_OUT_OF_BOUNDS, /* Get or set out of the stack. */
+	EXEC_STATUS_DIVISION_BY_ZERO,
+	EXEC_STATUS_BAD_PROG_INDEX, /* Out of the program table. */
+	EXEC_STATUS_IMPURE, /* Input or output attempted in a pure context. */
+	EXEC_STATUS_OUT_OF_FUEL,
+	EXEC_STATUS_TIMEOUT, /* The deadline was found passed. */
+	EXEC_STATUS_BAD_TASK_HANDLE, /* Join of a handle of no running task. */
+	EXEC_STATUS_TOO_MANY_TASKS, /* Spawn while all the handles are taken. */
+	EXEC_STATUS_BAD_CORO_HANDLE, /* Resume of no suspended coroutine. */
+	EXEC_STATUS_TOO_MANY_COROS, /* Create while all the handles are taken,
+		* or with no memory left for another C stack. */
+	EXEC_STATUS_BAD_YIELD, /* Yield while executing no coroutine. */
+	EXEC_STATUS_BAD_SNAPSHOT, /* Snapshot once tasks or coroutines exist. */
+	EXEC_STATUS_SNAPSHOT_FAILED, /* The snapshot file cannot be written. */
+	EXEC_STATUS_TOO_DEEP, /* Too many nested program executions. */
+	EXEC_STATUS_READ_FAILED, /* The input source gave an error. */
+	/* A snapshot is being taken, the executions return up to
+	 * execute_full_prog which never returns this status. */
+	EXEC_STATUS_SNAPSHOT,
+	NUMBER_OF_EXEC_STATUSES
+};
+typedef enum exec_status_t exec_status_t;
+
+/* Returns non-zero if the status is an error status. */
+int exec_status_is_error(exec_status_t status);
+
+/* Returns a short human-readable description of the given status. */
+const char* exec_status_name(exec_status_t status);
+
+/* Executes the main program, within the limits of the given context. */
+exec_status_t execute_full_prog(const full_prog_t* full_prog, vm_t* vm);
+
+/* Continues the suspended execution described by the frames of the given
+ * context, as restored from a snapshot, within the limits of the context. */
+exec_status_t execute_restored(const full_prog_t* full_prog, vm_t* vm);
+
+/* Executes the program of the given index,
+ * a bad index is an error of the executed program. */
+exec_status_t execute_prog(const full_prog_t* full_prog,
+	unsigned int prog_index, vm_t* vm);
+
+/* Executes the given bytecode as if it was part of the full program,
+ * it must be made of whole instructions. */
+exec_status_t execute_code(const full_prog_t* full_prog,
+	const uint8_t* code, unsigned int len, vm_t* vm);
 
 #endif /* HELV_INTERPRETER_HEADER */
@@ -0,0 +1,292 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "jit.h"
+#include "utils.h"
+#include "gs.h"
+#include "prog.h"
+#include "emit_c.h"
+#include "interpreter.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* strlen */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <unistd.h> /* rmdir */
+
+/* Variadic as the fields contain commas. */
+#define JIT_STRINGIFY_(...) #__VA_ARGS__
+#define JIT_STRINGIFY(...) JIT_STRINGIFY_(__VA_ARGS__)
+
+enum jit_state_t
+{
+	JIT_STATE_COLD = 0,
+	JIT_STATE_QUEUED, /* Hot, waiting for the compiler thread. */
+	JIT_STATE_DONE, /* Compiled, or could not be. */
+};
+typedef enum jit_state_t jit_state_t;
+
+struct jit_t
+{
+	const full_prog_t* full_prog;
+	/* Only touched by the thread of the tiered execution. */
+	unsigned int* count_array;
+	/* Written by the compiler thread, read by the tiered execution. */
+	_Atomic(jit_fn_t)* fn_array;
+	pthread_mutex_t mutex; /* Protects what follows. */
+	pthread_cond_t cond; /* Signaled when a program is queued or stopping. */
+	jit_state_t* state_array;
+	unsigned int* queue_array; /* Program indices, there is room for all. */
+	unsigned int queue_len;
+	int is_stopping;
+	int is_broken; /* The C compiler failed, nothing is queued anymore. */
+	pthread_t thread;
+	char* dir_path; /* Temporary directory of the C files and the objects. */
+	unsigned int unit_count;
+	void** handle_array; /* Of the loaded objects, one per unit. */
+	unsigned int handle_len;
+	unsigned int handle_cap;
+};
+
+/* Compiles the given programs in one shared object and publishes the
+ * functions of those that could be compiled. Returns -1 (after saying why on
+ * stderr) if the C compiler failed, the mutex must not be held. */
+static int jit_compile(jit_t* jit, const unsigned int* prog_index_array,
+	unsigned int prog_count)
+{
+	gs_t gs;
+	gs_init(&gs);
+	/* Prelude of the code of emit_c_jit_prog. */
+	gs_append_f(&gs,
+		"#include <stdint.h>\n"
+		"struct jit_ctx_t {%s};\n"
+		"#define STATUS_HALT %d\n"
+		"#define STATUS_STACK_UNDERFLOW %d\n"
+		"#define STATUS_OUT_OF_BOUNDS %d\n"
+		"#define STATUS_DIVISION_BY_ZERO %d\n"
+		"#define SYNC() (c->len = i)\n"
+		"#define RELOAD() (st = c->st, i = c->len, cap = c->cap)\n"
+		"#define FAIL(s_) do { SYNC(); return (s_); } while (0)\n"
+		"#define NEED(n_) "
+			"do { if (i < (n_)) FAIL(STATUS_STACK_UNDERFLOW); } while (0)\n"
+		"#define RESERVE(n_) do { if (i + (n_) > cap) "
+			"{ SYNC(); c->reserve(c, (n_)); RELOAD(); } } while (0)\n"
+		"#define EXEC(p_) do { unsigned int p = (p_); SYNC(); "
+			"int s = c->execute(c, p); RELOAD(); if (s != 0) return s; "
+			"} while (0)\n",
+		JIT_STRINGIFY(JIT_CTX_FIELDS),
+		(int)EXEC_STATUS_HALT, (int)EXEC_STATUS_STACK_UNDERFLOW,
+		(int)EXEC_STATUS_OUT_OF_BOUNDS, (int)EXEC_STATUS_DIVISION_BY_ZERO);
+	unsigned int compiled_count = 0;
+	for (unsigned int i = 0; i < prog_count; i++)
+	{
+		if (emit_c_jit_prog(&gs, jit->full_prog, prog_index_array[i]) == 0)
+		{
+			compiled_count++;
+		}
+	}
+	if (compiled_count == 0)
+	{
+		gs_cleanup(&gs);
+		return 0;
+	}
+
+	unsigned int unit_index = jit->unit_count++;
+	unsigned int path_len = strlen(jit->dir_path) + 32;
+	char* c_path = xmalloc(path_len);
+	char* so_path = xmalloc(path_len);
+	snprintf(c_path, path_len, "%s/unit_%u.c", jit->dir_path, unit_index);
+	snprintf(so_path, path_len, "%s/unit_%u.so", jit->dir_path, unit_index);
+	const char* cc = getenv("CC");
+	if (cc == NULL || cc[0] == '\0')
+	{
+		cc = "cc";
+	}
+	const char* failure = NULL;
+	FILE* c_file = fopen(c_path, "w");
+	if (c_file == NULL)
+	{
+		failure = "cannot write the C code of";
+	}
+	else
+	{
+		fputs(gs.str, c_file);
+		fclose(c_file);
+		gs_t command;
+		gs_init(&command);
+		gs_append_f(&command,
+			"%s -O2 -w -shared -fPIC -o '%s' '%s' >/dev/null 2>&1",
+			cc, so_path, c_path);
+		if (system(command.str) != 0)
+		{
+			failure = "the C compiler failed on";
+		}
+		gs_cleanup(&command);
+		remove(c_path);
+	}
+	gs_cleanup(&gs);
+	void* handle = failure != NULL ? NULL :
+		dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+	if (failure == NULL && handle == NULL)
+	{
+		failure = "cannot load the compiled code of";
+	}
+	remove(so_path);
+	free(c_path);
+	free(so_path);
+	if (handle == NULL)
+	{
+		fprintf(stderr, "Tiered execution error: %s the hot programs "
+			"(CC is \"%s\"), everything is interpreted from now on\n",
+			failure, cc);
+		return -1;
+	}
+	jit->handle_len++;
+	DARRAY_RESIZE_IF_NEEDED(jit->handle_len, jit->handle_cap,
+		jit->handle_array, void*);
+	jit->handle_array[jit->handle_len-1] = handle;
+	for (unsigned int i = 0; i < prog_count; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof name, "jit_prog_%u", prog_index_array[i]);
+		jit_fn_t fn;
+		/* The POSIX way around object to function pointer conversion. */
+		*(void**)&fn = dlsym(handle, name);
+		if (fn != NULL)
+		{
+			atomic_store_explicit(&jit->fn_array[prog_index_array[i]], fn,
+				memory_order_release);
+		}
+	}
+	return 0;
+}
+
+static void* jit_thread(void* data)
+{
+	jit_t* jit = data;
+	unsigned int* batch_array =
+		xmalloc(jit->full_prog->len * sizeof(unsigned int));
+	pthread_mutex_lock(&jit->mutex);
+	while (1)
+	{
+		while (jit->queue_len == 0 && !jit->is_stopping)
+		{
+			pthread_cond_wait(&jit->cond, &jit->mutex);
+		}
+		if (jit->is_stopping)
+		{
+			break;
+		}
+		/* All the queued programs, in one run of the C compiler. */
+		unsigned int batch_len = jit->queue_len;
+		memcpy(batch_array, jit->queue_array,
+			batch_len * sizeof(unsigned int));
+		jit->queue_len = 0;
+		pthread_mutex_unlock(&jit->mutex);
+		int has_failed = jit_compile(jit, batch_array, batch_len) != 0;
+		pthread_mutex_lock(&jit->mutex);
+		for (unsigned int i = 0; i < batch_len; i++)
+		{
+			jit->state_array[batch_array[i]] = JIT_STATE_DONE;
+		}
+		if (has_failed)
+		{
+			jit->is_broken = 1;
+		}
+	}
+	pthread_mutex_unlock(&jit->mutex);
+	free(batch_array);
+	return NULL;
+}
+
+jit_t* jit_create(const full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	jit_t* jit = xcalloc(1, sizeof(jit_t));
+	jit->full_prog = full_prog;
+	unsigned int len = full_prog->len;
+	jit->count_array = xcalloc(len, sizeof(unsigned int));
+	jit->fn_array = xmalloc(len * sizeof(_Atomic(jit_fn_t)));
+	for (unsigned int i = 0; i < len; i++)
+	{
+		atomic_init(&jit->fn_array[i], NULL);
+	}
+	jit->state_array = xcalloc(len, sizeof(jit_state_t));
+	jit->queue_array = xmalloc(len * sizeof(unsigned int));
+	pthread_mutex_init(&jit->mutex, NULL);
+	pthread_cond_init(&jit->cond, NULL);
+	const char* tmp_dir = getenv("TMPDIR");
+	if (tmp_dir == NULL || tmp_dir[0] == '\0')
+	{
+		tmp_dir = "/tmp";
+	}
+	unsigned int path_len = strlen(tmp_dir) + 16;
+	jit->dir_path = xmalloc(path_len);
+	snprintf(jit->dir_path, path_len, "%s/helv_XXXXXX", tmp_dir);
+	int has_dir = mkdtemp(jit->dir_path) != NULL;
+	if (!has_dir || pthread_create(&jit->thread, NULL, jit_thread, jit) != 0)
+	{
+		/* Then everything is interpreted. */
+		if (has_dir)
+		{
+			rmdir(jit->dir_path);
+		}
+		free(jit->dir_path);
+		jit->dir_path = NULL;
+		jit->is_broken = 1;
+	}
+	return jit;
+}
+
+void jit_destroy(jit_t* jit)
+{
+	if (jit == NULL)
+	{
+		return;
+	}
+	if (jit->dir_path != NULL)
+	{
+		pthread_mutex_lock(&jit->mutex);
+		jit->is_stopping = 1;
+		pthread_cond_signal(&jit->cond);
+		pthread_mutex_unlock(&jit->mutex);
+		pthread_join(jit->thread, NULL);
+		rmdir(jit->dir_path);
+		free(jit->dir_path);
+	}
+	for (unsigned int i = 0; i < jit->handle_len; i++)
+	{
+		dlclose(jit->handle_array[i]);
+	}
+	free(jit->handle_array);
+	pthread_mutex_destroy(&jit->mutex);
+	pthread_cond_destroy(&jit->cond);
+	free(jit->count_array);
+	free(jit->fn_array);
+	free(jit->state_array);
+	free(jit->queue_array);
+	free(jit);
+}
+
+jit_fn_t jit_enter(jit_t* jit, unsigned int prog_index)
+{
+	ASSERT(jit != NULL, "The pointer is NULL\n");
+	ASSERT(prog_index < jit->full_prog->len,
+		"The program index is out of bounds\n");
+	if (++jit->count_array[prog_index] == JIT_HOT_COUNT)
+	{
+		pthread_mutex_lock(&jit->mutex);
+		if (!jit->is_broken &&
+			jit->state_array[prog_index] == JIT_STATE_COLD)
+		{
+			jit->state_array[prog_index] = JIT_STATE_QUEUED;
+			jit->queue_array[jit->queue_len++] = prog_index;
+			pthread_cond_signal(&jit->cond);
+		}
+		pthread_mutex_unlock(&jit->mutex);
+	}
+	return atomic_load_explicit(&jit->fn_array[prog_index],
+		memory_order_acquire);
+}
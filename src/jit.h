@@ -0,0 +1,68 @@
+
+#ifndef HELV_JIT_HEADER
+#define HELV_JIT_HEADER
+
+#include "prog.h"
+#include <stdint.h>
+
+/* Tiered execution, the programs are interpreted until they are found hot,
+ * then they are compiled to native code in the background and executed as
+ * such from then on.
+ *
+ * Every execution of a program counts (so every loop iteration counts for
+ * the program looped over, which makes back edges count), and the programs
+ * that reach JIT_HOT_COUNT executions are queued. A compiler thread takes
+ * all the queued programs at once, emits their C code (see emit_c_jit_prog),
+ * builds it with the C compiler (CC, or cc) into a shared object that it
+ * loads, and publishes the functions that the interpreter then calls instead
+ * of interpreting the programs. Programs that are never hot cost nothing more
+ * than their counter. If the C compiler fails, it is said once on stderr and
+ * nothing is compiled anymore (the programs are still interpreted).
+ *
+ * A compiled program behaves like the interpreted one, with the same errors,
+ * and the programs it executes go through execute_prog (so the limits and
+ * the counters still apply to them). Only programs made of the instructions
+ * that do not touch the tasks, coroutines, input or snapshots are compiled,
+ * and the stack height they reach is not seen by the statistics. */
+
+#define JIT_HOT_COUNT 4096
+
+/* State of a running compiled program, its fields are also declared in the
+ * emitted C code (see JIT_CTX_FIELDS), that uses the callbacks for what the
+ * interpreter does. */
+#define JIT_CTX_FIELDS \
+	uint8_t* st; \
+	unsigned int len; \
+	unsigned int cap; \
+	void* vm; \
+	const void* full_prog; \
+	int (*execute)(struct jit_ctx_t* ctx, unsigned int prog_index); \
+	void (*reserve)(struct jit_ctx_t* ctx, unsigned int cell_count); \
+	void (*out)(struct jit_ctx_t* ctx, uint8_t byte);
+struct jit_ctx_t
+{
+	JIT_CTX_FIELDS
+};
+typedef struct jit_ctx_t jit_ctx_t;
+
+/* A compiled program, returns an execution status (see exec_status_t). */
+typedef int (*jit_fn_t)(jit_ctx_t* ctx);
+
+/* Compiler of the hot programs of a full program, shared by all the
+ * executions of the full program in the execution context that has it, the
+ * coroutines of which are tiered as they run in it (but the contexts of the
+ * tasks are not tiered). */
+typedef struct jit_t jit_t;
+
+/* Starts the compiler thread, the full program must outlive the jit and
+ * its bytecode must not change anymore (lazy parsing is fine). */
+jit_t* jit_create(const full_prog_t* full_prog);
+
+/* Waits for the compilation in progress (if any) and unloads the code. */
+void jit_destroy(jit_t* jit);
+
+/* Counts an execution of the given program, and returns its compiled
+ * version, or NULL if it is not compiled (yet). */
+jit_fn_t jit_enter(jit_t* jit, unsigned int prog_index);
+
+#endif /* HELV_JIT_HEADER */
@@ -0,0 +1,782 @@
+
+#include "lanes.h"
+#include "utils.h"
+#include "prog.h"
+#include "interpreter.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h> /* max_align_t */
+#include <string.h> /* memcpy */
+#include <limits.h> /* UINT_MAX */
+#include <ctype.h> /* isspace, isdigit */
+#include <assert.h> /* static_assert */
+
+/* Cells of all the lanes at one height, the element l being the cell of the
+ * lane l (a GNU C vector). It is only aligned as the allocations are, so
+ * that it can live in a growable array. */
+typedef uint8_t lane_vec_t
+	ATTRIBUTE(vector_size (LANE_COUNT), aligned (_Alignof (max_align_t)));
+
+/* Set of lanes, the bit l being the lane l. */
+typedef uint32_t lane_mask_t;
+
+static_assert(LANE_COUNT == 32, "The lane masks are of 32 bits");
+
+/* Lanes executed in lockstep, that all start at the same height. */
+struct lanes_t
+{
+	const full_prog_t* full_prog;
+	unsigned int len; /* Height of the lanes that are in lockstep. */
+	unsigned int cap;
+	lane_vec_t* st;
+	lane_mask_t diverged_mask; /* To execute again with the interpreter. */
+	unsigned int depth; /* Program executions nested in one another. */
+	unsigned int max_depth;
+	/* Limits of the lanes in lockstep, as in vm_t. Once they are reached,
+	 * every program execution makes its lanes diverge. */
+	unsigned int fuel;
+	double deadline_ms;
+	unsigned int clock_countdown;
+	int is_over_limits;
+	lane_result_t* result_array[LANE_COUNT];
+};
+typedef struct lanes_t lanes_t;
+
+/* Nesting depth of the program executions beyond which the lanes diverge,
+ * a nested lockstep execution takes a few KiB of native stack. */
+#define LANES_MAX_DEPTH 500
+
+/* Bit of each lane in the byte of the masks that holds it. */
+static const lane_vec_t lane_bit_vec = {
+	1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+	1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+};
+
+/* Sets of lanes that reached the end of something at different heights
+ * (at most one set per height, so there are at most LANE_COUNT of them). */
+struct lane_ends_t
+{
+	unsigned int count;
+	lane_mask_t mask_array[LANE_COUNT];
+	unsigned int len_array[LANE_COUNT];
+};
+typedef struct lane_ends_t lane_ends_t;
+
+/* Vectors are passed around by pointer (or built by macros), as passing
+ * them by value depends on the instruction set the compiler targets. */
+
+/* The vector whose elements are all the given cell. */
+#define LANE_VEC_SPLAT(value_) ((lane_vec_t){0} + (uint8_t)(value_))
+
+/* Sets the elements to 0xff in the lanes of the mask, and to 0 elsewhere. */
+static void lane_vec_from_mask(lane_vec_t* v, lane_mask_t mask)
+{
+	/* Each lane tests its bit in the byte of the mask that holds it. */
+	uint8_t b0 = mask, b1 = mask >> 8, b2 = mask >> 16, b3 = mask >> 24;
+	lane_vec_t bytes = {
+		b0, b0, b0, b0, b0, b0, b0, b0, b1, b1, b1, b1, b1, b1, b1, b1,
+		b2, b2, b2, b2, b2, b2, b2, b2, b3, b3, b3, b3, b3, b3, b3, b3,
+	};
+	*v = (lane_vec_t)((bytes & lane_bit_vec) != 0);
+}
+
+/* Returns the set of the lanes whose elements are not zero. */
+static lane_mask_t lane_vec_nonzero(const lane_vec_t* v)
+{
+	/* Each lane keeps its bit, and the 8 bytes of each quarter, that have
+	 * no bit in common, are summed in the top byte by a multiplication. */
+	lane_vec_t bits = (lane_vec_t)(*v != 0) & lane_bit_vec;
+	uint64_t quarter_array[4];
+	memcpy(quarter_array, &bits, sizeof bits);
+	lane_mask_t mask = 0;
+	for (unsigned int q = 0; q < 4; q++)
+	{
+		mask |= (lane_mask_t)
+			((quarter_array[q] * 0x0101010101010101u) >> 56) << (q * 8);
+	}
+	return mask;
+}
+
+static void lane_out_write(void* data, const uint8_t* bytes, unsigned int len)
+{
+	lane_result_t* result = data;
+	result->out_len += len;
+	DARRAY_RESIZE_IF_NEEDED(result->out_len, result->out_cap,
+		result->out_array, uint8_t);
+	memcpy(&result->out_array[result->out_len - len], bytes, len);
+}
+
+/* Ends the lanes of the mask (in lockstep) with the given status. */
+static void lanes_finish(lanes_t* lanes, lane_mask_t mask,
+	exec_status_t status)
+{
+	for (unsigned int l = 0; l < LANE_COUNT; l++)
+	{
+		if (!(mask >> l & 1))
+		{
+			continue;
+		}
+		lane_result_t* result = lanes->result_array[l];
+		result->status = status;
+		result->is_lockstep = 1;
+		result->st = (st_t){
+			.len = lanes->len,
+			.cap = lanes->len,
+			.peak_len = lanes->len,
+			.array = lanes->len == 0 ? NULL : xmalloc(lanes->len),
+		};
+	}
+	/* Height by height, to read the stack of vectors in order. */
+	for (unsigned int k = 0; k < lanes->len; k++)
+	{
+		for (unsigned int l = 0; l < LANE_COUNT; l++)
+		{
+			if (mask >> l & 1)
+			{
+				lanes->result_array[l]->st.array[k] = lanes->st[k][l];
+			}
+		}
+	}
+}
+
+static void lane_ends_add(lane_ends_t* ends, lane_mask_t mask,
+	unsigned int len)
+{
+	if (mask == 0)
+	{
+		return;
+	}
+	for (unsigned int j = 0; j < ends->count; j++)
+	{
+		if (ends->len_array[j] == len)
+		{
+			ends->mask_array[j] |= mask;
+			return;
+		}
+	}
+	ASSERT(ends->count < LANE_COUNT, "There are more ends than lanes\n");
+	ends->mask_array[ends->count] = mask;
+	ends->len_array[ends->count] = len;
+	ends->count++;
+}
+
+/* Keeps in lockstep the biggest set of lanes that ended at the same height,
+ * the others diverge. Returns the kept set, and sets the height to theirs. */
+static lane_mask_t lane_ends_reconverge(lanes_t* lanes,
+	const lane_ends_t* ends)
+{
+	if (ends->count == 0)
+	{
+		return 0;
+	}
+	unsigned int best = 0;
+	for (unsigned int j = 1; j < ends->count; j++)
+	{
+		if (__builtin_popcount(ends->mask_array[j]) >
+			__builtin_popcount(ends->mask_array[best]))
+		{
+			best = j;
+		}
+	}
+	for (unsigned int j = 0; j < ends->count; j++)
+	{
+		if (j != best)
+		{
+			lanes->diverged_mask |= ends->mask_array[j];
+		}
+	}
+	lanes->len = ends->len_array[best];
+	return ends->mask_array[best];
+}
+
+static lane_mask_t lanes_exec_code(lanes_t* lanes,
+	const uint8_t* code, unsigned int len, lane_mask_t mask);
+
+/* Counts a program execution against the limits of the lanes in lockstep,
+ * and returns non-zero if they are reached. */
+static int lanes_are_over_limits(lanes_t* lanes)
+{
+	if (lanes->fuel != 0 && --lanes->fuel == 0)
+	{
+		lanes->is_over_limits = 1;
+	}
+	if (lanes->clock_countdown != 0 && --lanes->clock_countdown == 0)
+	{
+		if (vm_time_ms() >= lanes->deadline_ms)
+		{
+			lanes->is_over_limits = 1;
+		}
+		lanes->clock_countdown = VM_CLOCK_PERIOD;
+	}
+	return lanes->is_over_limits;
+}
+
+static lane_mask_t lanes_exec_prog(lanes_t* lanes, unsigned int prog_index,
+	lane_mask_t mask)
+{
+	/* A lockstep execution takes a few times more native stack than an
+	 * interpreted one, so deep recursions are left to the interpreter. */
+	if (lanes->depth >= lanes->max_depth || lanes_are_over_limits(lanes))
+	{
+		lanes->diverged_mask |= mask;
+		return 0;
+	}
+	const prog_t* prog = full_prog_get_prog(lanes->full_prog, prog_index);
+	lanes->depth++;
+	mask = lanes_exec_code(lanes, prog->array, prog->len, mask);
+	lanes->depth--;
+	return mask;
+}
+
+/* Executes for each lane of the mask the program whose index is its element
+ * in the given vector, the lanes that execute the same program being masked
+ * together, then reconverges them. Returns the lanes still in lockstep. */
+static lane_mask_t lanes_call(lanes_t* lanes, const lane_vec_t* target,
+	lane_mask_t mask)
+{
+	unsigned int start_len = lanes->len;
+	lane_ends_t ends = {0};
+	lane_mask_t left = mask;
+	while (left != 0)
+	{
+		uint8_t prog_index = (*target)[__builtin_ctz(left)];
+		lane_vec_t other = *target ^ LANE_VEC_SPLAT(prog_index);
+		lane_mask_t sub_mask = left & ~lane_vec_nonzero(&other);
+		left &= ~sub_mask;
+		if (prog_index >= lanes->full_prog->len)
+		{
+			lanes->diverged_mask |= sub_mask;
+			continue;
+		}
+		lanes->len = start_len;
+		sub_mask = lanes_exec_prog(lanes, prog_index, sub_mask);
+		lane_ends_add(&ends, sub_mask, lanes->len);
+	}
+	return lane_ends_reconverge(lanes, &ends);
+}
+
+static lane_mask_t lanes_exec_code(lanes_t* lanes,
+	const uint8_t* code, unsigned int len, lane_mask_t mask)
+{
+	lane_vec_t vmask;
+	lane_vec_from_mask(&vmask, mask);
+	#define ST(index_) (lanes->st[index_])
+	/* Writes are masked, the other lanes keep their cells. */
+	#define WRITE(index_, value_) \
+		do \
+		{ \
+			lane_vec_t value__ = (value_); \
+			ST(index_) = (value__ & vmask) | (ST(index_) & ~vmask); \
+		} while (0)
+	#define PUSH(value_) \
+		do \
+		{ \
+			lane_vec_t value___ = (value_); \
+			lanes->len++; \
+			DARRAY_RESIZE_IF_NEEDED(lanes->len, lanes->cap, lanes->st, \
+				lane_vec_t); \
+			WRITE(lanes->len-1, value___); \
+		} while (0)
+	/* The lanes that cannot go on in lockstep leave the mask. */
+	#define DIVERGE(lane_mask_) \
+		do \
+		{ \
+			lane_mask_t diverging_ = (lane_mask_); \
+			if (diverging_ != 0) \
+			{ \
+				lanes->diverged_mask |= diverging_; \
+				mask &= ~diverging_; \
+				if (mask == 0) \
+				{ \
+					return 0; \
+				} \
+				lane_vec_from_mask(&vmask, mask); \
+			} \
+		} while (0)
+	/* The height is the same for all the lanes of the mask. */
+	#define NEED(how_many_) \
+		do \
+		{ \
+			if (lanes->len < (how_many_)) \
+			{ \
+				DIVERGE(mask); \
+			} \
+		} while (0)
+	/* After a call or a loop, that may have changed the mask. */
+	#define UPDATE_MASK(new_mask_) \
+		do \
+		{ \
+			mask = (new_mask_); \
+			if (mask == 0) \
+			{ \
+				return 0; \
+			} \
+			lane_vec_from_mask(&vmask, mask); \
+		} while (0)
+	unsigned int i = 0;
+	while (i < len)
+	{
+		switch (code[i++])
+		{
+			case INSTR_ID_NOP:
+			break;
+			case INSTR_ID_PUSH_IMM:
+				PUSH(LANE_VEC_SPLAT(code[i++]));
+			break;
+			case INSTR_ID_PUSH_BYTES:
+				{
+					unsigned int n = code[i++];
+					for (unsigned int j = 0; j < n; j++)
+					{
+						PUSH(LANE_VEC_SPLAT(code[i++]));
+					}
+				}
+			break;
+			case INSTR_ID_KILL:
+				NEED(1);
+				lanes->len--;
+			break;
+			case INSTR_ID_DUPLICATE:
+				NEED(1);
+				PUSH(ST(lanes->len-1));
+			break;
+			case INSTR_ID_SWAP:
+				NEED(2);
+				{
+					lane_vec_t a = ST(lanes->len-1);
+					lane_vec_t b = ST(lanes->len-2);
+					WRITE(lanes->len-1, b);
+					WRITE(lanes->len-2, a);
+				}
+			break;
+			case INSTR_ID_GET:
+				NEED(1);
+				{
+					lane_vec_t index = ST(lanes->len-1);
+					if (lanes->len-1 <= 255)
+					{
+						lane_vec_t is_bad = (lane_vec_t)
+							(index >= LANE_VEC_SPLAT(lanes->len-1));
+						DIVERGE(mask & lane_vec_nonzero(&is_bad));
+					}
+					uint8_t first = index[__builtin_ctz(mask)];
+					lane_vec_t other = index ^ LANE_VEC_SPLAT(first);
+					lane_vec_t value = {0};
+					if ((mask & lane_vec_nonzero(&other)) == 0)
+					{
+						/* The same index in all the lanes. */
+						value = ST(first);
+					}
+					else
+					{
+						/* Gathered lane by lane. */
+						for (unsigned int l = 0; l < LANE_COUNT; l++)
+						{
+							if (mask >> l & 1)
+							{
+								value[l] = ST(index[l])[l];
+							}
+						}
+					}
+					WRITE(lanes->len-1, value);
+				}
+			break;
+			case INSTR_ID_SET:
+				NEED(2);
+				{
+					lane_vec_t index = ST(lanes->len-1);
+					lane_vec_t value = ST(lanes->len-2);
+					lanes->len -= 2;
+					if (lanes->len <= 255)
+					{
+						lane_vec_t is_bad = (lane_vec_t)
+							(index >= LANE_VEC_SPLAT(lanes->len));
+						DIVERGE(mask & lane_vec_nonzero(&is_bad));
+					}
+					uint8_t first = index[__builtin_ctz(mask)];
+					lane_vec_t other = index ^ LANE_VEC_SPLAT(first);
+					if ((mask & lane_vec_nonzero(&other)) == 0)
+					{
+						/* The same index in all the lanes. */
+						WRITE(first, value);
+					}
+					else
+					{
+						/* Scattered lane by lane. */
+						for (unsigned int l = 0; l < LANE_COUNT; l++)
+						{
+							if (mask >> l & 1)
+							{
+								ST(index[l])[l] = value[l];
+							}
+						}
+					}
+				}
+			break;
+			case INSTR_ID_HEIGHT:
+				PUSH(LANE_VEC_SPLAT(lanes->len));
+			break;
+			case INSTR_ID_ADD:
+			case INSTR_ID_SUBTRACT:
+			case INSTR_ID_MULTIPLY:
+			case INSTR_ID_DIVIDE:
+			case INSTR_ID_MODULUS:
+				NEED(2);
+				{
+					lane_vec_t a = ST(lanes->len-1);
+					lane_vec_t b = ST(lanes->len-2);
+					lane_vec_t result;
+					switch (code[i-1])
+					{
+						case INSTR_ID_ADD:
+							result = a + b;
+						break;
+						case INSTR_ID_SUBTRACT:
+							result = a - b;
+						break;
+						case INSTR_ID_MULTIPLY:
+							result = a * b;
+						break;
+						default:
+							DIVERGE(mask & ~lane_vec_nonzero(&b));
+							/* The other lanes must not trap either. */
+							b |= (lane_vec_t)(b == 0) & 1;
+							result = code[i-1] == INSTR_ID_DIVIDE ?
+								a / b : a % b;
+						break;
+					}
+					lanes->len--;
+					WRITE(lanes->len-1, result);
+				}
+			break;
+			case INSTR_ID_EXECUTE:
+				NEED(1);
+				{
+					lane_vec_t target = ST(--lanes->len);
+					UPDATE_MASK(lanes_call(lanes, &target, mask));
+				}
+			break;
+			case INSTR_ID_IFELSE:
+				NEED(3);
+				{
+					lane_vec_t condition = ST(--lanes->len);
+					lane_vec_t if_target = ST(--lanes->len);
+					lane_vec_t else_target = ST(--lanes->len);
+					lane_vec_t is_true = (lane_vec_t)(condition != 0);
+					lane_vec_t target =
+						(if_target & is_true) | (else_target & ~is_true);
+					UPDATE_MASK(lanes_call(lanes, &target, mask));
+				}
+			break;
+			case INSTR_ID_DOWHILE:
+			case INSTR_ID_IDIOM_LOOP:
+				{
+					/* Idioms are only shortcuts for their loops. */
+					lane_vec_t target;
+					if (code[i-1] == INSTR_ID_IDIOM_LOOP)
+					{
+						target = LANE_VEC_SPLAT(code[i+1]);
+						i += 2;
+					}
+					else
+					{
+						NEED(1);
+						target = ST(--lanes->len);
+					}
+					lane_ends_t ends = {0};
+					lane_mask_t active_mask = mask;
+					while (active_mask != 0)
+					{
+						active_mask = lanes_call(lanes, &target, active_mask);
+						if (active_mask != 0 && lanes->len < 1)
+						{
+							lanes->diverged_mask |= active_mask;
+							active_mask = 0;
+						}
+						if (active_mask == 0)
+						{
+							break;
+						}
+						lane_vec_t condition = ST(--lanes->len);
+						lane_mask_t ended_mask =
+							active_mask & ~lane_vec_nonzero(&condition);
+						lane_ends_add(&ends, ended_mask, lanes->len);
+						active_mask &= ~ended_mask;
+					}
+					UPDATE_MASK(lane_ends_reconverge(lanes, &ends));
+				}
+			break;
+			case INSTR_ID_REPEAT:
+				NEED(2);
+				{
+					lane_vec_t count = ST(--lanes->len);
+					lane_vec_t target = ST(--lanes->len);
+					lane_ends_t ends = {0};
+					lane_mask_t active_mask = mask & lane_vec_nonzero(&count);
+					lane_ends_add(&ends, mask & ~active_mask, lanes->len);
+					for (unsigned int j = 1; active_mask != 0; j++)
+					{
+						active_mask = lanes_call(lanes, &target, active_mask);
+						lane_vec_t left = count - (uint8_t)j;
+						lane_mask_t ended_mask =
+							active_mask & ~lane_vec_nonzero(&left);
+						lane_ends_add(&ends, ended_mask, lanes->len);
+						active_mask &= ~ended_mask;
+					}
+					UPDATE_MASK(lane_ends_reconverge(lanes, &ends));
+				}
+			break;
+			case INSTR_ID_PRINT_CHAR:
+				NEED(1);
+				{
+					/* Each lane has its own output. */
+					lane_vec_t byte = ST(--lanes->len);
+					for (unsigned int l = 0; l < LANE_COUNT; l++)
+					{
+						if (mask >> l & 1)
+						{
+							lane_out_write(lanes->result_array[l],
+								&byte[l], 1);
+						}
+					}
+				}
+			break;
+			case INSTR_ID_READ_BYTE:
+				PUSH(LANE_VEC_SPLAT(0));
+			break;
+			case INSTR_ID_END_OF_INPUT:
+				PUSH(LANE_VEC_SPLAT(1));
+			break;
+			case INSTR_ID_HALT:
+				lanes_finish(lanes, mask, EXEC_STATUS_HALT);
+				return 0;
+			break;
+			case INSTR_ID_LOOKUP:
+				NEED(code[i]);
+				{
+					const uint8_t* table =
+						lanes->full_prog->memo_array[code[i+1]].table;
+					lane_vec_t x = ST(--lanes->len);
+					lane_vec_t y = {0};
+					if (code[i] == 2)
+					{
+						y = ST(--lanes->len);
+					}
+					/* Gathered lane by lane, there are no byte gathers. */
+					lane_vec_t result = {0};
+					for (unsigned int l = 0; l < LANE_COUNT; l++)
+					{
+						result[l] = table[(unsigned int)y[l] << 8 | x[l]];
+					}
+					PUSH(result);
+					i += 2;
+				}
+			break;
+			default:
+				/* Left to the interpreter. */
+				DIVERGE(mask);
+			break;
+		}
+	}
+	#undef UPDATE_MASK
+	#undef NEED
+	#undef DIVERGE
+	#undef PUSH
+	#undef WRITE
+	#undef ST
+	return mask;
+}
+
+/* Executes the given lanes with the interpreter, from the beginning. */
+static void execute_lane_alone(const full_prog_t* full_prog,
+	const st_t* initial_st, const lane_limits_t* limits,
+	lane_result_t* result)
+{
+	result->out_len = 0;
+	result->is_lockstep = 0;
+	vm_t vm = {
+		.out_write = lane_out_write,
+		.out_data = result,
+		.max_steps = limits->max_steps,
+		.timeout_ms = limits->timeout_ms,
+		.max_depth = limits->max_depth,
+	};
+	vm.st.len = initial_st->len;
+	DARRAY_RESIZE_IF_NEEDED(vm.st.len, vm.st.cap, vm.st.array, uint8_t);
+	ST_UPDATE_PEAK(&vm.st);
+	if (initial_st->len > 0)
+	{
+		memcpy(vm.st.array, initial_st->array, initial_st->len);
+	}
+	result->status = execute_full_prog(full_prog, &vm);
+	result->st = vm.st;
+	vm.st = (st_t){0};
+	vm_cleanup(&vm);
+}
+
+/* Lane to execute, for sorting by initial height. */
+struct lane_order_t
+{
+	unsigned int len;
+	unsigned int index;
+};
+typedef struct lane_order_t lane_order_t;
+
+static int lane_order_compare(const void* a, const void* b)
+{
+	const lane_order_t* x = a;
+	const lane_order_t* y = b;
+	if (x->len != y->len)
+	{
+		return x->len < y->len ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+void execute_lanes(const full_prog_t* full_prog, const st_t* initial_st_array,
+	unsigned int lane_total, const lane_limits_t* limits,
+	lane_result_t* result_array)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT(full_prog->lazy_array == NULL,
+		"Lanes execute fully parsed programs\n");
+	ASSERT(initial_st_array != NULL || lane_total == 0,
+		"The pointer is NULL\n");
+	ASSERT(result_array != NULL || lane_total == 0, "The pointer is NULL\n");
+	ASSERT(limits != NULL, "The pointer is NULL\n");
+	/* Only the lanes of the same initial height can start in lockstep. */
+	lane_order_t* order_array = xmalloc(lane_total * sizeof(lane_order_t));
+	for (unsigned int j = 0; j < lane_total; j++)
+	{
+		order_array[j] = (lane_order_t){initial_st_array[j].len, j};
+		result_array[j] = (lane_result_t){0};
+	}
+	qsort(order_array, lane_total, sizeof(lane_order_t), lane_order_compare);
+	lanes_t lanes = {.full_prog = full_prog, .max_depth = LANES_MAX_DEPTH};
+	if (limits->max_depth != 0 && limits->max_depth < LANES_MAX_DEPTH)
+	{
+		lanes.max_depth = limits->max_depth;
+	}
+	unsigned int j = 0;
+	while (j < lane_total)
+	{
+		/* The next group. */
+		unsigned int start_len = order_array[j].len;
+		unsigned int lane_count = 0;
+		unsigned int index_array[LANE_COUNT];
+		while (j < lane_total && lane_count < LANE_COUNT &&
+			order_array[j].len == start_len)
+		{
+			index_array[lane_count] = order_array[j].index;
+			lanes.result_array[lane_count] =
+				&result_array[order_array[j].index];
+			lane_count++;
+			j++;
+		}
+		lanes.len = start_len;
+		DARRAY_RESIZE_IF_NEEDED(lanes.len, lanes.cap, lanes.st, lane_vec_t);
+		for (unsigned int k = 0; k < start_len; k++)
+		{
+			lane_vec_t cells = {0};
+			for (unsigned int l = 0; l < lane_count; l++)
+			{
+				cells[l] = initial_st_array[index_array[l]].array[k];
+			}
+			lanes.st[k] = cells;
+		}
+		lanes.diverged_mask = 0;
+		/* The fuel runs out at the execution after the last allowed one. */
+		lanes.fuel = limits->max_steps == 0 ? 0 :
+			limits->max_steps == UINT_MAX ? UINT_MAX : limits->max_steps + 1;
+		lanes.clock_countdown = 0;
+		if (limits->timeout_ms != 0)
+		{
+			lanes.deadline_ms = vm_time_ms() + limits->timeout_ms;
+			lanes.clock_countdown = VM_CLOCK_PERIOD;
+		}
+		lanes.is_over_limits = 0;
+		lane_mask_t mask = lane_count == LANE_COUNT ?
+			~(lane_mask_t)0 : ((lane_mask_t)1 << lane_count) - 1;
+		mask = lanes_exec_prog(&lanes, 0, mask);
+		lanes_finish(&lanes, mask, EXEC_STATUS_OK);
+		for (unsigned int l = 0; l < lane_count; l++)
+		{
+			if (lanes.diverged_mask >> l & 1)
+			{
+				execute_lane_alone(full_prog,
+					&initial_st_array[index_array[l]], limits,
+					lanes.result_array[l]);
+			}
+		}
+	}
+	free(lanes.st);
+	free(order_array);
+}
+
+void lane_result_cleanup(lane_result_t* result)
+{
+	ASSERT(result != NULL, "The pointer is NULL\n");
+	st_cleanup(&result->st);
+	free(result->out_array);
+}
+
+st_t* read_lanes_file(const char* file_path, unsigned int* lane_total)
+{
+	ASSERT(file_path != NULL, "The pointer is NULL\n");
+	ASSERT(lane_total != NULL, "The pointer is NULL\n");
+	char* src = read_file(file_path);
+	if (src == NULL)
+	{
+		return NULL;
+	}
+	unsigned int len = 0;
+	unsigned int cap = 0;
+	st_t* st_array = NULL;
+	unsigned int line = 1;
+	const char* c = src;
+	while (*c != '\0')
+	{
+		len++;
+		DARRAY_RESIZE_IF_NEEDED(len, cap, st_array, st_t);
+		st_t* st = &st_array[len-1];
+		*st = (st_t){0};
+		while (*c != '\0' && *c != '\n')
+		{
+			if (isspace((unsigned char)*c))
+			{
+				c++;
+				continue;
+			}
+			unsigned int value = 0;
+			unsigned int digit_count = 0;
+			while (isdigit((unsigned char)*c) && digit_count < 4)
+			{
+				value = value * 10 + (*c++ - '0');
+				digit_count++;
+			}
+			if (digit_count == 0 || value > 255 ||
+				(*c != '\0' && !isspace((unsigned char)*c)))
+			{
+				fprintf(stderr, "File error: line %u of \"%s\" is not made "
+					"of cells (0 to 255)\n", line, file_path);
+				for (unsigned int j = 0; j < len; j++)
+				{
+					st_cleanup(&st_array[j]);
+				}
+				free(st_array);
+				free(src);
+				return NULL;
+			}
+			st_push(st, value);
+		}
+		if (*c == '\n')
+		{
+			c++;
+			line++;
+		}
+	}
+	free(src);
+	*lane_total = len;
+	return st_array;
+}
@@ -0,0 +1,67 @@
+
+#ifndef HELV_LANES_HEADER
+#define HELV_LANES_HEADER
+
+#include "prog.h"
+#include "interpreter.h"
+#include <stdint.h>
+
+/* Lockstep execution of the main program over many initial stacks, for
+ * parameter sweeps and test vectors.
+ *
+ * Up to LANE_COUNT executions (lanes) that start at the same height run
+ * together on one stack of vectors, in which the cell of each lane is an
+ * element (a structure of arrays), so the arithmetic is done for all the
+ * lanes at once with vector instructions. The lanes that take different
+ * paths (at an if else, a loop or an execution of different programs) are
+ * masked, and the ones that end up at the height of the most lanes go on in
+ * lockstep. The others, and those that get an error or meet an instruction
+ * that is not handled in lockstep (tasks, coroutines, snapshots, printing
+ * strings), are executed again by the interpreter from their initial stack,
+ * which gives the same results as the execution is deterministic.
+ *
+ * Lanes have nothing to read, and the output of each lane is captured.
+ * The limits apply to each lane as if it was executed alone. In lockstep
+ * they are checked for all the lanes together (the steps of the lanes in
+ * lockstep are counted once for all of them, which is no less than the
+ * steps of any of them), and beyond them the lanes are executed again by
+ * the interpreter, that checks the limits of each lane exactly. */
+
+#define LANE_COUNT 32
+
+/* Limits of each lane (see vm_t), zero meaning no limit. */
+struct lane_limits_t
+{
+	unsigned int max_steps;
+	unsigned int timeout_ms;
+	unsigned int max_depth;
+};
+typedef struct lane_limits_t lane_limits_t;
+
+/* Outcome of the execution of one lane. */
+struct lane_result_t
+{
+	exec_status_t status;
+	st_t st; /* The final stack. */
+	unsigned int out_len;
+	unsigned int out_cap;
+	uint8_t* out_array; /* What the lane printed. */
+	int is_lockstep; /* Was it done in lockstep (else by the interpreter)? */
+};
+typedef struct lane_result_t lane_result_t;
+
+/* Executes the main program once for each of the given initial stacks,
+ * and writes the outcomes in the given array (of the same length), which
+ * must be freed by lane_result_cleanup. */
+void execute_lanes(const full_prog_t* full_prog, const st_t* initial_st_array,
+	unsigned int lane_total, const lane_limits_t* limits,
+	lane_result_t* result_array);
+
+void lane_result_cleanup(lane_result_t* result);
+
+/* Reads initial stacks from the given file, one per line, each being cells
+ * in decimal separated by spaces (bottom first). Returns an allocated array
+ * of *lane_total stacks, or prints an error and returns NULL. */
+st_t* read_lanes_file(const char* file_path, unsigned int* lane_total);
+
+#endif /* HELV_LANES_HEADER */
@@ -5,18 +5,70 @@
 #include "interpreter.h"
 #include "emit_c.h"
 #include "parser.h"
+#include "input.h"
+#include "batch.h"
+#include "optim.h"
+#include "preproc.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "jit.h"
+#include "lanes.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> /* strcmp */
+#include <ctype.h> /* isdigit */
+#include <errno.h>
+#include <limits.h> /* UINT_MAX */
+
+/* Parses a whole decimal number that fits in an unsigned int,
+ * returns 0 on success and -1 otherwise (leaving *count unchanged). */
+static int parse_count(const char* str, unsigned int* count)
+{
+	if (!isdigit((unsigned char)str[0]))
+	{
+		return -1;
+	}
+	errno = 0;
+	char* end;
+	unsigned long value = strtoul(str, &end, 10);
+	if (errno != 0 || *end != '\0' || value > UINT_MAX)
+	{
+		return -1;
+	}
+	*count = value;
+	return 0;
+}
 
 int main(int argc, const char** argv)
 {
 	const char* src = NULL;
 	const char* dst = NULL;
+	const char* input_file_path = NULL;
+	const char* src_file_path = NULL;
 	int src_is_allocated = 0;
 	int help = 0;
 	int version = 0;
 	int execute = 0;
+	int optimize = 0;
+	int debug_info = 0;
+	int instrument = 0;
+	int single_function = 0;
+	unsigned int max_steps = 0;
+	unsigned int timeout_ms = 0;
+	unsigned int max_depth = 0;
+	int dump_stack = 0;
+	const char* snapshot_path = NULL;
+	const char* restore_path = NULL;
+	int tiered = 0;
+	const char* lanes_path = NULL;
+	int stats_wanted = 0;
+	int stats_json = 0;
+	stats_t stats = {0};
+	int batch = 0;
+	unsigned int thread_count = 1;
+	const char** file_paths = xmalloc(argc * sizeof(const char*));
+	unsigned int file_count = 0;
+	int has_arg_error = 0; /* Some errors make running anything wrong. */
 
 	for (unsigned int i = 1; i < (unsigned int)argc; i++)
 	{
@@ -42,7 +94,7 @@ int main(int argc, const char** argv)
 					fprintf(stderr, "Command line argument error: "
 						"The code option requiers a following argument\n");
 				}
-				else if (src != NULL)
+				else if (src != NULL || file_count > 0)
 				{
 					fprintf(stderr, "Command line argument error: "
 						"The code option cannot sets the source code "
@@ -73,6 +125,196 @@ int main(int argc, const char** argv)
 					dst = argv[++i];
 				}
 			}
+			else if (IS(argv[i], "-i") || IS(argv[i], "--input"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The input option requiers a following argument\n");
+				}
+				else
+				{
+					input_file_path = argv[++i];
+				}
+			}
+			else if (IS(argv[i], "-O") || IS(argv[i], "--optimize"))
+			{
+				optimize = 1;
+			}
+			else if (IS(argv[i], "-g") || IS(argv[i], "--lines"))
+			{
+				debug_info = 1;
+			}
+			else if (IS(argv[i], "-s") || IS(argv[i], "--single"))
+			{
+				single_function = 1;
+			}
+			else if (IS(argv[i], "--instrument"))
+			{
+				instrument = 1;
+			}
+			else if (IS(argv[i], "--max-steps"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The max steps option requiers a following argument\n");
+					has_arg_error = 1;
+				}
+				else if (parse_count(argv[++i], &max_steps) != 0)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The max steps option expects a number, not %s\n",
+						argv[i]);
+					has_arg_error = 1;
+				}
+			}
+			else if (IS(argv[i], "--timeout"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The timeout option requiers a following argument\n");
+					has_arg_error = 1;
+				}
+				else if (parse_count(argv[++i], &timeout_ms) != 0)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The timeout option expects a number, not %s\n",
+						argv[i]);
+					has_arg_error = 1;
+				}
+			}
+			else if (IS(argv[i], "--max-depth"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The max depth option requiers a following argument\n");
+					has_arg_error = 1;
+				}
+				else if (parse_count(argv[++i], &max_depth) != 0)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The max depth option expects a number, not %s\n",
+						argv[i]);
+					has_arg_error = 1;
+				}
+			}
+			else if (IS(argv[i], "--snapshot"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The snapshot option requiers a following argument\n");
+				}
+				else
+				{
+					snapshot_path = argv[++i];
+				}
+			}
+			else if (IS(argv[i], "--restore"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The restore option requiers a following argument\n");
+				}
+				else
+				{
+					restore_path = argv[++i];
+				}
+			}
+			else if (IS(argv[i], "--stats"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The stats option requiers a following argument\n");
+					has_arg_error = 1;
+				}
+				else if (IS(argv[i+1], "text") || IS(argv[i+1], "json"))
+				{
+					stats_wanted = 1;
+					stats_json = IS(argv[++i], "json");
+					alloc_stats_enable();
+				}
+				else
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The stats option expects text or json, not %s\n",
+						argv[++i]);
+					has_arg_error = 1;
+				}
+			}
+			else if (IS(argv[i], "--check-level"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The check level option requiers a following argument\n");
+				}
+				else if (argv[i+1][0] < '0' || argv[i+1][0] > '3' ||
+					argv[i+1][1] != '\0')
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The check level option expects 0 to 3, not %s\n",
+						argv[++i]);
+				}
+				else
+				{
+					/* Before any other thread is started. */
+					#ifdef ENABLE_ASSERT
+						check_level = argv[++i][0] - '0';
+					#else
+						i++;
+						fprintf(stderr, "Command line argument error: "
+							"The check level option is ignored in release "
+							"builds, that have no assertions\n");
+					#endif
+				}
+			}
+			else if (IS(argv[i], "--lanes"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The lanes option requiers a following argument\n");
+				}
+				else
+				{
+					lanes_path = argv[++i];
+				}
+			}
+			else if (IS(argv[i], "--tiered"))
+			{
+				tiered = 1;
+			}
+			else if (IS(argv[i], "--dump-stack"))
+			{
+				dump_stack = 1;
+			}
+			else if (IS(argv[i], "--batch"))
+			{
+				batch = 1;
+			}
+			else if (IS(argv[i], "-j") || IS(argv[i], "--jobs"))
+			{
+				if (i == (unsigned int)argc-1)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The jobs option requiers a following argument\n");
+					has_arg_error = 1;
+				}
+				else if (parse_count(argv[++i], &thread_count) != 0 ||
+					thread_count == 0)
+				{
+					fprintf(stderr, "Command line argument error: "
+						"The jobs option expects a positive number, not %s\n",
+						argv[i]);
+					has_arg_error = 1;
+				}
+			}
 			else
 			{
 				fprintf(stderr, "Command line argument error: "
@@ -82,20 +324,101 @@ int main(int argc, const char** argv)
 		}
 		else /* Source code file name */
 		{
-			if (src != NULL)
-			{
-				fprintf(stderr, "Command line argument error: "
-					"The file \"%s\" cannot be the source code "
-					"as it is already given by previous arguments\n",
-					argv[i]);
-			}
-			else
-			{
-				src = read_file(argv[i]);
-				src_is_allocated = 1;
-			}
+			file_paths[file_count++] = argv[i];
+		}
+	}
+
+	if (has_arg_error)
+	{
+		free(file_paths);
+		return 1;
+	}
+	if (batch)
+	{
+		#define REJECT_IN_BATCH(condition_, option_name_, why_) \
+			do \
+			{ \
+				if (condition_) \
+				{ \
+					fprintf(stderr, "Command line argument error: " \
+						"The " option_name_ " option cannot be used " \
+						"in batch mode" why_ "\n"); \
+					has_arg_error = 1; \
+				} \
+			} while (0)
+		REJECT_IN_BATCH(src != NULL, "code", "");
+		REJECT_IN_BATCH(stats_wanted, "stats", ", that has its own summary");
+		REJECT_IN_BATCH(input_file_path != NULL, "input",
+			", where programs have nothing to read");
+		REJECT_IN_BATCH(tiered, "tiered", "");
+		REJECT_IN_BATCH(snapshot_path != NULL, "snapshot", "");
+		REJECT_IN_BATCH(restore_path != NULL, "restore", "");
+		REJECT_IN_BATCH(lanes_path != NULL, "lanes", "");
+		#undef REJECT_IN_BATCH
+		if (has_arg_error)
+		{
+			free(file_paths);
+			return 1;
 		}
+		batch_opt_t opt = {
+			.execute = execute,
+			.optimize = optimize,
+			.debug_info = debug_info,
+			.instrument = instrument,
+			.single_function = single_function,
+			.dump_stack = dump_stack,
+			.dst_dir = dst,
+			.max_steps = max_steps,
+			.timeout_ms = timeout_ms,
+			.max_depth = max_depth,
+		};
+		unsigned int failed_count = batch_run(file_paths, file_count,
+			thread_count, &opt);
+		free(file_paths);
+		preproc_cache_cleanup();
+		return failed_count == 0 ? 0 : 1;
 	}
+	if (lanes_path != NULL)
+	{
+		/* Lanes are an execution mode of their own. */
+		if (!execute)
+		{
+			fprintf(stderr, "Command line argument error: "
+				"The lanes option can only be used with the execute option\n");
+			has_arg_error = 1;
+		}
+		if (tiered || snapshot_path != NULL || restore_path != NULL)
+		{
+			fprintf(stderr, "Command line argument error: "
+				"The lanes option cannot be used with the tiered, snapshot "
+				"or restore options\n");
+			has_arg_error = 1;
+		}
+		if (has_arg_error)
+		{
+			free(file_paths);
+			return 1;
+		}
+	}
+	stats_phase_start(&stats);
+	for (unsigned int i = 0; i < file_count; i++)
+	{
+		if (src != NULL)
+		{
+			fprintf(stderr, "Command line argument error: "
+				"The file \"%s\" cannot be the source code "
+				"as it is already given by previous arguments\n",
+				file_paths[i]);
+		}
+		else
+		{
+			src = read_file(file_paths[i]);
+			src_file_path = file_paths[i];
+			src_is_allocated = 1;
+		}
+	}
+	free(file_paths);
+	stats_phase_end(&stats, STATS_PHASE_READ);
 
 	#ifdef DEBUG
 		#define YN(condition_) ((condition_) ? "yes" : "no")
@@ -145,13 +468,70 @@ int main(int argc, const char** argv)
 		printf(
 			"Usage:\n"
 			"  %s [options] file\n"
+			"  %s --batch [options] files...\n"
 			"Options:\n"
+			"     --batch    Processes all the given files, with -o naming the\n"
+			"                directory of the C files if not executing\n"
+			"     --check-level\n"
+			"                Sets the level of the assertions of debug builds\n"
+			"                to the next argument, 0 (none), 1 (constant time\n"
+			"                checks, the default), 2 (checks as costly as the\n"
+			"                checked calls) or 3 (whole structures on each\n"
+			"                call), see src/utils.h\n"
 			"  -c --code     Sets the program source to the next argument\n"
+			"     --dump-stack\n"
+			"                Prints the stack on stderr when the execution\n"
+			"                stops on an error or a limit\n"
 			"  -e --execute  Executes the program instead of compiling it\n"
+			"  -g --lines    Emits #line directives that refer the C code to\n"
+			"                the Helv source file, for debuggers and profilers\n"
 			"  -h --help     Displays this help message\n"
+			"     --instrument\n"
+			"                Adds counters of calls, loop iterations and cycles\n"
+			"                to the C code, reported in JSON at exit and on\n"
+			"                SIGUSR1 (see src/emit_c.h)\n"
+			"  -i --input    Reads the input of an executed program from the file\n"
+			"                named by the next argument instead of stdin\n"
+			"  -j --jobs     Sets the number of batch mode worker threads\n"
+			"                to the next argument\n"
+			"     --lanes    Executes the program once for each line of the\n"
+			"                file named by the next argument, that is an\n"
+			"                initial stack (cells in decimal), many at once\n"
+			"                in lockstep (see src/lanes.h)\n"
+			"     --max-steps\n"
+			"                Stops the execution (with an error) after the\n"
+			"                number of program executions given by the next\n"
+			"                argument, each loop iteration being one\n"
+			"     --max-depth\n"
+			"                Stops the execution (with an error) beyond the\n"
+			"                number of nested program executions given by the\n"
+			"                next argument instead of %u (a deeper recursion\n"
+			"                may need a bigger stack, see ulimit -s)\n"
 			"  -o --out      Sets the output file name to the next argument\n"
+			"  -O --optimize Optimizes the program, and when compiling also\n"
+			"                executes at compile time what does not depend\n"
+			"                on input or output\n"
+			"     --timeout  Stops the execution (with an error) after the\n"
+			"                number of milliseconds given by the next argument\n"
+			"     --restore  Continues the execution from the snapshot file\n"
+			"                named by the next argument, taken from the same\n"
+			"                program with the same options\n"
+			"  -s --single   Emits the whole program in one C function, with\n"
+			"                computed gotos, so deep recursion does not\n"
+			"                overflow the C stack (see src/emit_c.h)\n"
+			"     --snapshot Makes the snapshot instruction save the state of\n"
+			"                the execution to the file named by the next\n"
+			"                argument (see src/snapshot.h)\n"
+			"     --tiered   Compiles the hot programs of an executed program\n"
+			"                to native code with the C compiler while it runs\n"
+			"                (see src/jit.h)\n"
+			"     --stats    Prints on stderr the time spent in each phase,\n"
+			"                the allocations, the peak stack height and the\n"
+			"                sizes of the programs, as text or json according\n"
+			"                to the next argument\n"
 			"  -v --version  Displays the implementation version\n",
-			argc == 0 ? "helv" : argv[0]);
+			argc == 0 ? "helv" : argv[0], argc == 0 ? "helv" : argv[0],
+			VM_DEFAULT_MAX_DEPTH);
 	}
 
 	if (src == NULL)
@@ -159,24 +539,199 @@ int main(int argc, const char** argv)
 		return 0;
 	}
 
-	full_prog_t full_prog = {0};
-	parse_full_prog(src, &full_prog);
+	stats_phase_start(&stats);
+	char* expanded_src = preproc_src(src, src_file_path);
 	if (src_is_allocated)
 	{
 		free((char*)src);
 	}
+	preproc_cache_cleanup();
+	stats_phase_end(&stats, STATS_PHASE_READ);
+	if (expanded_src == NULL)
+	{
+		return 1;
+	}
+	stats_phase_start(&stats);
+	full_prog_t full_prog = {0};
+	if (execute && !optimize && snapshot_path == NULL &&
+		restore_path == NULL && lanes_path == NULL)
+	{
+		/* Only what is executed gets parsed. */
+		parse_full_prog_lazy(expanded_src, &full_prog);
+	}
+	else
+	{
+		parse_full_prog(expanded_src, &full_prog);
+		free(expanded_src);
+	}
+	stats_phase_end(&stats, STATS_PHASE_PARSE);
 
+	int exit_status = 0;
 	if (execute)
 	{
-		st_t st = {0};
-		execute_full_prog(&full_prog, &st);
-		st_cleanup(&st);
+		in_t in;
+		if (input_file_path == NULL)
+		{
+			in_init_fd(&in, 0);
+		}
+		else if (in_init_file(&in, input_file_path) != 0)
+		{
+			full_prog_cleanup(&full_prog);
+			return 1;
+		}
+		if (optimize)
+		{
+			stats_phase_start(&stats);
+			optim_full_prog(&full_prog, NULL);
+			stats_phase_end(&stats, STATS_PHASE_OPTIMIZE);
+		}
+		if (lanes_path != NULL)
+		{
+			unsigned int lane_total;
+			st_t* initial_st_array = read_lanes_file(lanes_path, &lane_total);
+			if (initial_st_array == NULL)
+			{
+				in_cleanup(&in);
+				full_prog_cleanup(&full_prog);
+				return 1;
+			}
+			lane_result_t* result_array =
+				xmalloc(lane_total * sizeof(lane_result_t));
+			stats_phase_start(&stats);
+			lane_limits_t limits = {
+				.max_steps = max_steps,
+				.timeout_ms = timeout_ms,
+				.max_depth = max_depth,
+			};
+			execute_lanes(&full_prog, initial_st_array, lane_total, &limits,
+				result_array);
+			stats_phase_end(&stats, STATS_PHASE_EXECUTE);
+			for (unsigned int l = 0; l < lane_total; l++)
+			{
+				lane_result_t* result = &result_array[l];
+				if (result->out_len != 0)
+				{
+					fwrite(result->out_array, 1, result->out_len, stdout);
+				}
+				if (exec_status_is_error(result->status))
+				{
+					fflush(stdout);
+					fprintf(stderr, "Lane %u: Execution error: %s\n",
+						l + 1, exec_status_name(result->status));
+					if (dump_stack)
+					{
+						fprintf(stderr, "Stack (height %u, bottom first):",
+							result->st.len);
+						for (unsigned int i = 0; i < result->st.len; i++)
+						{
+							fprintf(stderr, " %u",
+								(unsigned int)result->st.array[i]);
+						}
+						fprintf(stderr, "\n");
+					}
+					exit_status = 1;
+				}
+				if (result->st.peak_len > stats.peak_st_len)
+				{
+					stats.peak_st_len = result->st.peak_len;
+				}
+				lane_result_cleanup(result);
+				free(initial_st_array[l].array);
+			}
+			free(result_array);
+			free(initial_st_array);
+		}
+		else
+		{
+			vm_t vm = {
+				.in = &in,
+				.max_steps = max_steps,
+				.timeout_ms = timeout_ms,
+				.max_depth = max_depth,
+				.snapshot_path = snapshot_path,
+			};
+			if (tiered && (snapshot_path != NULL || restore_path != NULL))
+			{
+				fprintf(stderr, "Command line argument error: "
+					"The tiered option cannot be used with snapshots, "
+					"as native code cannot be suspended\n");
+			}
+			else if (tiered)
+			{
+				vm.jit = jit_create(&full_prog);
+			}
+			exec_status_t status;
+			stats_phase_start(&stats);
+			if (restore_path == NULL)
+			{
+				status = execute_full_prog(&full_prog, &vm);
+			}
+			else if (snapshot_restore(restore_path, &full_prog, &vm) == 0)
+			{
+				status = execute_restored(&full_prog, &vm);
+			}
+			else
+			{
+				vm_cleanup(&vm);
+				in_cleanup(&in);
+				full_prog_cleanup(&full_prog);
+				return 1;
+			}
+			stats_phase_end(&stats, STATS_PHASE_EXECUTE);
+			stats.peak_st_len = vm.st.peak_len;
+			stats.st_cap = vm.st.cap;
+			if (exec_status_is_error(status))
+			{
+				fflush(stdout);
+				fprintf(stderr, "Execution error: %s\n",
+					exec_status_name(status));
+				if (dump_stack)
+				{
+					fprintf(stderr, "Stack (height %u, bottom first):",
+						vm.st.len);
+					for (unsigned int i = 0; i < vm.st.len; i++)
+					{
+						fprintf(stderr, " %u", (unsigned int)vm.st.array[i]);
+					}
+					fprintf(stderr, "\n");
+				}
+				exit_status = 1;
+			}
+			jit_destroy(vm.jit);
+			vm_cleanup(&vm);
+		}
+		in_cleanup(&in);
 	}
 	else
 	{
 		gs_t gs;
 		gs_init(&gs);
-		emit_c_full_prog(&gs, &full_prog);
+		emit_c_opt_t opt = {0};
+		st_t initial_st = {0};
+		if (debug_info)
+		{
+			opt.src_file_path = src_file_path;
+		}
+		opt.instrument = instrument;
+		opt.single_function = single_function;
+		opt.max_steps = max_steps;
+		opt.timeout_ms = timeout_ms;
+		opt.max_depth = max_depth;
+		opt.dump_stack = dump_stack;
+		if (optimize)
+		{
+			stats_phase_start(&stats);
+			opt.entry_offset = optim_full_prog(&full_prog, &initial_st);
+			opt.initial_st = initial_st.array;
+			opt.initial_st_len = initial_st.len;
+			stats_phase_end(&stats, STATS_PHASE_OPTIMIZE);
+		}
+		stats_phase_start(&stats);
+		emit_c_full_prog(&gs, &full_prog, &opt);
+		stats_phase_end(&stats, STATS_PHASE_EMIT);
+		st_cleanup(&initial_st);
+		stats.c_code_len = gs.len - 1;
+		stats_phase_start(&stats);
 		if (dst != NULL)
 		{
 			FILE* dst_file = fopen(dst, "w");
@@ -187,10 +742,18 @@ int main(int argc, const char** argv)
 		{
 			fputs(gs.str, stdout);
 		}
+		stats_phase_end(&stats, STATS_PHASE_WRITE);
 		gs_cleanup(&gs);
 	}
 
+	stats.prog_count = full_prog.len;
+	stats.code_len = full_prog.code_len;
 	full_prog_cleanup(&full_prog);
+	if (stats_wanted)
+	{
+		fflush(stdout);
+		stats_print(&stats, stderr, stats_json);
+	}
 
-	return 0;
+	return exit_status;
 }
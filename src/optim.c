@@ -0,0 +1,775 @@
+
+#include "optim.h"
+#include "utils.h"
+#include "prog.h"
+#include "interpreter.h"
+#include "emit_c.h"
+#include <stdint.h>
+#include <string.h> /* memcmp */
+
+/* Maximum number of program executions done at compile time, the depth
+ * limit of the execution context (see vm_t) also stops the evaluation of
+ * runaway recursions. */
+#define PARTIAL_EVAL_FUEL (1u << 20)
+
+unsigned int optim_partial_eval(const full_prog_t* full_prog, st_t* st)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_ST_PTR(st);
+	ASSERT(st->len == 0, "The stack is not empty\n");
+	ASSERT(full_prog->len >= 1,
+		"The full program does not contain even one program\n");
+	const prog_t* main_prog = &full_prog->array[0];
+
+	/* The main program is executed instruction by instruction until an
+	 * instruction fails (being impure counts as failing). As the failing
+	 * instruction may have modified the stack before failing, everything
+	 * before it is executed again (this is deterministic) on a fresh stack,
+	 * which is cheaper than saving the stack before each instruction. */
+	unsigned int end = 0;
+	for (int is_second_pass = 0; is_second_pass <= 1; is_second_pass++)
+	{
+		vm_t vm = {.is_pure = 1, .fuel = PARTIAL_EVAL_FUEL};
+		unsigned int i = 0;
+		while (i < main_prog->len && (!is_second_pass || i < end))
+		{
+			unsigned int size = instr_size(&main_prog->array[i]);
+			exec_status_t status = execute_code(full_prog,
+				&main_prog->array[i], size, &vm);
+			if (status != EXEC_STATUS_OK || vm.st.len > EMIT_C_ST_SIZE)
+			{
+				ASSERT(!is_second_pass,
+					"The second pass did not replay the first one\n");
+				break;
+			}
+			i += size;
+		}
+		if (is_second_pass)
+		{
+			*st = vm.st;
+		}
+		else
+		{
+			end = i;
+			vm_cleanup(&vm);
+		}
+	}
+	return end;
+}
+
+/* Abstract stack cell, used by the static analysis of the values that end up
+ * executed as program indices. A known value remembers its site, which is the
+ * push immediate instruction that pushed it. */
+struct abs_cell_t
+{
+	int is_known;
+	uint8_t value;
+	unsigned int site_prog_index;
+	unsigned int site_offset;
+};
+typedef struct abs_cell_t abs_cell_t;
+
+/* Abstract stack, only the top of the real stack is tracked,
+ * what is under it is unknown. */
+struct abs_st_t
+{
+	unsigned int len;
+	unsigned int cap;
+	abs_cell_t* array;
+};
+typedef struct abs_st_t abs_st_t;
+
+/* How the values pushed by a site are used. A value escapes when the
+ * analysis loses track of it while it may still be used. */
+#define SITE_EXECUTED 1
+#define SITE_USED_AS_DATA 2
+#define SITE_ESCAPED 4
+
+struct dead_analysis_t
+{
+	const full_prog_t* full_prog;
+	uint8_t** site_flags_array; /* Per program, NULL if unreached. */
+	unsigned int* worklist;
+	unsigned int worklist_len;
+	int has_given_up;
+	abs_st_t st;
+};
+typedef struct dead_analysis_t dead_analysis_t;
+
+static abs_cell_t abs_pop(abs_st_t* st)
+{
+	if (st->len == 0)
+	{
+		return (abs_cell_t){0};
+	}
+	return st->array[--st->len];
+}
+
+static void abs_push(abs_st_t* st, abs_cell_t cell)
+{
+	st->len++;
+	DARRAY_RESIZE_IF_NEEDED(st->len, st->cap, st->array, abs_cell_t);
+	st->array[st->len-1] = cell;
+}
+
+static void dead_analysis_reach(dead_analysis_t* da, unsigned int prog_index)
+{
+	if (prog_index >= da->full_prog->len)
+	{
+		/* Such an execution is an error, better not to touch anything. */
+		da->has_given_up = 1;
+		return;
+	}
+	if (da->site_flags_array[prog_index] == NULL)
+	{
+		unsigned int len = da->full_prog->array[prog_index].len;
+		da->site_flags_array[prog_index] = xcalloc(len + 1, 1);
+		da->worklist[da->worklist_len++] = prog_index;
+	}
+}
+
+static void dead_analysis_use(dead_analysis_t* da, abs_cell_t cell,
+	uint8_t use)
+{
+	if (!cell.is_known)
+	{
+		if (use == SITE_EXECUTED)
+		{
+			da->has_given_up = 1;
+		}
+		return;
+	}
+	da->site_flags_array[cell.site_prog_index][cell.site_offset] |= use;
+	if (use == SITE_EXECUTED)
+	{
+		dead_analysis_reach(da, cell.value);
+	}
+}
+
+/* Marks all the tracked cells as escaped, and stops tracking them
+ * if forget is non-zero. */
+static void dead_analysis_escape(dead_analysis_t* da, int forget)
+{
+	for (unsigned int i = 0; i < da->st.len; i++)
+	{
+		dead_analysis_use(da, da->st.array[i], SITE_ESCAPED);
+	}
+	if (forget)
+	{
+		da->st.len = 0;
+	}
+}
+
+static void dead_analysis_prog(dead_analysis_t* da, unsigned int prog_index)
+{
+	const prog_t* prog = &da->full_prog->array[prog_index];
+	abs_st_t* st = &da->st;
+	st->len = 0;
+	static const abs_cell_t unknown = {0};
+	#define DATA(cell_) dead_analysis_use(da, (cell_), SITE_USED_AS_DATA)
+	#define EXECUTED(cell_) dead_analysis_use(da, (cell_), SITE_EXECUTED)
+	for (unsigned int i = 0; i < prog->len && !da->has_given_up;
+		i += instr_size(&prog->array[i]))
+	{
+		switch (prog->array[i])
+		{
+			case INSTR_ID_NOP:
+			break;
+			case INSTR_ID_PUSH_IMM:
+				abs_push(st, (abs_cell_t){
+					.is_known = 1, .value = prog->array[i+1],
+					.site_prog_index = prog_index, .site_offset = i});
+			break;
+			case INSTR_ID_KILL:
+				abs_pop(st);
+			break;
+			case INSTR_ID_DUPLICATE:
+				{
+					abs_cell_t a = abs_pop(st);
+					abs_push(st, a);
+					abs_push(st, a);
+				}
+			break;
+			case INSTR_ID_SWAP:
+				{
+					abs_cell_t a = abs_pop(st);
+					abs_cell_t b = abs_pop(st);
+					abs_push(st, a);
+					abs_push(st, b);
+				}
+			break;
+			case INSTR_ID_GET:
+				DATA(abs_pop(st));
+				/* Any cell may have been read. */
+				dead_analysis_escape(da, 0);
+				abs_push(st, unknown);
+			break;
+			case INSTR_ID_SET:
+				DATA(abs_pop(st));
+				DATA(abs_pop(st));
+				/* Any cell may have been overwritten. */
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_PUSH_BYTES:
+				/* These sites are not tracked, as they cannot be renumbered
+				 * (programs are not expected to be executed from strings). */
+				for (unsigned int j = 0; j < prog->array[i+1]; j++)
+				{
+					abs_push(st, unknown);
+				}
+			break;
+			case INSTR_ID_HEIGHT:
+			case INSTR_ID_READ_BYTE:
+			case INSTR_ID_END_OF_INPUT:
+				abs_push(st, unknown);
+			break;
+			case INSTR_ID_ADD:
+			case INSTR_ID_SUBTRACT:
+			case INSTR_ID_MULTIPLY:
+			case INSTR_ID_DIVIDE:
+			case INSTR_ID_MODULUS:
+				DATA(abs_pop(st));
+				DATA(abs_pop(st));
+				abs_push(st, unknown);
+			break;
+			case INSTR_ID_PRINT_CHAR:
+				DATA(abs_pop(st));
+			break;
+			case INSTR_ID_PRINT_STRING:
+				DATA(abs_pop(st));
+				/* Any cell may have been printed. */
+				dead_analysis_escape(da, 0);
+			break;
+			case INSTR_ID_PRINT_REVERSE:
+				/* Pops an unknown number of cells. */
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_EXECUTE:
+			case INSTR_ID_DOWHILE:
+				EXECUTED(abs_pop(st));
+				/* The executed program may do anything to the stack. */
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_IFELSE:
+				DATA(abs_pop(st));
+				EXECUTED(abs_pop(st));
+				EXECUTED(abs_pop(st));
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_REPEAT:
+				DATA(abs_pop(st));
+				EXECUTED(abs_pop(st));
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_SPAWN:
+				EXECUTED(abs_pop(st));
+				DATA(abs_pop(st));
+				/* The given cells may be used by the spawned program. */
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_CREATE:
+				EXECUTED(abs_pop(st));
+				abs_push(st, unknown);
+			break;
+			case INSTR_ID_RESUME:
+				DATA(abs_pop(st));
+				DATA(abs_pop(st));
+				/* The given cells may be used by the coroutine,
+				 * and an unknown number of cells are pushed. */
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_YIELD:
+			case INSTR_ID_JOIN:
+				DATA(abs_pop(st));
+				/* Pushes an unknown number of cells. */
+				dead_analysis_escape(da, 1);
+			break;
+			case INSTR_ID_HALT:
+				st->len = 0;
+			break;
+			case INSTR_ID_SNAPSHOT:
+				/* The whole stack is saved. */
+				dead_analysis_escape(da, 0);
+			break;
+			default:
+				/* An instruction this analysis does not know about. */
+				da->has_given_up = 1;
+			break;
+		}
+	}
+	#undef EXECUTED
+	#undef DATA
+	/* What is left may be used by whatever executed this program. */
+	dead_analysis_escape(da, 1);
+}
+
+unsigned int optim_remove_dead_progs(full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT(full_prog->alias_array == NULL,
+		"Dead programs must be removed before programs are merged\n");
+	ASSERT(full_prog->len >= 1,
+		"The full program does not contain even one program\n");
+	if (full_prog->len > 256)
+	{
+		/* Indices would not fit in the bytes that push them. */
+		return 0;
+	}
+	dead_analysis_t da = {
+		.full_prog = full_prog,
+		.site_flags_array = xcalloc(full_prog->len, sizeof(uint8_t*)),
+		.worklist = xmalloc(full_prog->len * sizeof(unsigned int)),
+	};
+	dead_analysis_reach(&da, 0);
+	for (unsigned int w = 0; w < da.worklist_len && !da.has_given_up; w++)
+	{
+		dead_analysis_prog(&da, da.worklist[w]);
+	}
+
+	/* A site whose values are both executed and used otherwise cannot have
+	 * its value changed. */
+	for (unsigned int k = 0; k < full_prog->len && !da.has_given_up; k++)
+	{
+		uint8_t* site_flags = da.site_flags_array[k];
+		for (unsigned int i = 0;
+			site_flags != NULL && i < full_prog->array[k].len; i++)
+		{
+			if ((site_flags[i] & SITE_EXECUTED) &&
+				(site_flags[i] & ~SITE_EXECUTED))
+			{
+				da.has_given_up = 1;
+				break;
+			}
+		}
+	}
+
+	unsigned int removed_count = 0;
+	if (!da.has_given_up && da.worklist_len < full_prog->len)
+	{
+		unsigned int* new_index_array =
+			xmalloc(full_prog->len * sizeof(unsigned int));
+		unsigned int new_len = 0;
+		for (unsigned int k = 0; k < full_prog->len; k++)
+		{
+			new_index_array[k] = new_len;
+			if (da.site_flags_array[k] != NULL)
+			{
+				new_len++;
+			}
+		}
+		for (unsigned int k = 0; k < full_prog->len; k++)
+		{
+			prog_t* prog = &full_prog->array[k];
+			uint8_t* site_flags = da.site_flags_array[k];
+			if (site_flags == NULL)
+			{
+				removed_count++;
+				continue;
+			}
+			for (unsigned int i = 0; i < prog->len; i++)
+			{
+				if (site_flags[i] & SITE_EXECUTED)
+				{
+					ASSERT(prog->array[i] == INSTR_ID_PUSH_IMM,
+						"A site is not a push immediate instruction\n");
+					prog->array[i+1] = new_index_array[prog->array[i+1]];
+				}
+			}
+			full_prog->array[new_index_array[k]] = *prog;
+		}
+		full_prog->len = new_len;
+		/* The source map follows the programs, in the same order. */
+		src_map_t* src_map = &full_prog->src_map;
+		unsigned int src_map_len = 0;
+		for (unsigned int e = 0; e < src_map->len; e++)
+		{
+			src_pos_t pos = src_map->array[e];
+			if (da.site_flags_array[pos.prog_index] != NULL)
+			{
+				pos.prog_index = new_index_array[pos.prog_index];
+				src_map->array[src_map_len++] = pos;
+			}
+		}
+		src_map->len = src_map_len;
+		free(new_index_array);
+		full_prog_compact_code(full_prog);
+	}
+
+	for (unsigned int k = 0; k < full_prog->len + removed_count; k++)
+	{
+		free(da.site_flags_array[k]);
+	}
+	free(da.site_flags_array);
+	free(da.worklist);
+	free(da.st.array);
+	return removed_count;
+}
+
+/* FNV-1a hash of the given bytes. */
+static uint32_t hash_bytes(const uint8_t* bytes, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
+	for (unsigned int i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+unsigned int optim_merge_identical_progs(full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	if (full_prog->alias_array != NULL)
+	{
+		return 0;
+	}
+	/* Open addressing hash table of program indices, with a power of two
+	 * size that keeps it at most half full. */
+	unsigned int table_size = 1;
+	while (table_size < full_prog->len * 2)
+	{
+		table_size *= 2;
+	}
+	unsigned int* table = xmalloc(table_size * sizeof(unsigned int));
+	for (unsigned int i = 0; i < table_size; i++)
+	{
+		table[i] = full_prog->len; /* Empty slot. */
+	}
+	unsigned int* alias_array = xmalloc(full_prog->len * sizeof(unsigned int));
+	unsigned int merged_count = 0;
+	for (unsigned int k = 0; k < full_prog->len; k++)
+	{
+		prog_t* prog = &full_prog->array[k];
+		unsigned int slot = hash_bytes(prog->array, prog->len) &
+			(table_size-1);
+		alias_array[k] = k;
+		while (table[slot] != full_prog->len)
+		{
+			const prog_t* other = &full_prog->array[table[slot]];
+			if (other->len == prog->len &&
+				memcmp(other->array, prog->array, prog->len) == 0)
+			{
+				alias_array[k] = table[slot];
+				break;
+			}
+			slot = (slot + 1) & (table_size-1);
+		}
+		if (alias_array[k] == k)
+		{
+			table[slot] = k;
+		}
+		else
+		{
+			merged_count++;
+		}
+	}
+	free(table);
+	if (merged_count == 0)
+	{
+		free(alias_array);
+	}
+	else
+	{
+		/* Only now, as the bytecode of aliases is used for comparisons. */
+		for (unsigned int k = 0; k < full_prog->len; k++)
+		{
+			if (alias_array[k] != k)
+			{
+				full_prog->array[k] = (prog_t){0};
+			}
+		}
+		full_prog->alias_array = alias_array;
+		full_prog_compact_code(full_prog);
+	}
+	return merged_count;
+}
+
+/* Bytecode pattern, where ANY matches any byte (that is then captured). */
+#define ANY -1
+
+/* Returns non-zero if the bytecode of the program of the given index is
+ * exactly the given pattern, the bytes that match ANY are written in order
+ * to the given array. */
+static int prog_matches(const full_prog_t* full_prog, unsigned int prog_index,
+	const int* pattern, unsigned int pattern_len, uint8_t* captured)
+{
+	if (prog_index >= full_prog->len)
+	{
+		return 0;
+	}
+	const prog_t* prog = full_prog_get_prog(full_prog, prog_index);
+	if (prog->len != pattern_len)
+	{
+		return 0;
+	}
+	for (unsigned int i = 0; i < pattern_len; i++)
+	{
+		if (pattern[i] == ANY)
+		{
+			*captured++ = prog->array[i];
+		}
+		else if (pattern[i] != prog->array[i])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Returns the idiom that the loop over the program of the given index is,
+ * or NUMBER_OF_IDIOM_IDS if it is none of them. The patterns are those of
+ * examples/test.hv, they have to match exactly. */
+static idiom_id_t recognize_idiom(const full_prog_t* full_prog,
+	unsigned int prog_index)
+{
+	#define MATCH(prog_index_, captured_, ...) \
+		prog_matches(full_prog, (prog_index_), (const int[]){__VA_ARGS__}, \
+			sizeof (const int[]){__VA_ARGS__} / sizeof(int), (captured_))
+	uint8_t sub[2];
+	/* [[0] [kil 1] 3 hei sub ife] */
+	if (MATCH(prog_index, sub,
+			INSTR_ID_PUSH_IMM, ANY, INSTR_ID_PUSH_IMM, ANY,
+			INSTR_ID_PUSH_IMM, 3, INSTR_ID_HEIGHT, INSTR_ID_SUBTRACT,
+			INSTR_ID_IFELSE) &&
+		MATCH(sub[0], NULL, INSTR_ID_PUSH_IMM, 0) &&
+		MATCH(sub[1], NULL, INSTR_ID_KILL, INSTR_ID_PUSH_IMM, 1))
+	{
+		return IDIOM_ID_EMPTY_STACK;
+	}
+	/* [dup [kil 0] swp [pri 1] swp ife] or [dup [0] swp [pri 1] swp ife] */
+	if (MATCH(prog_index, sub,
+			INSTR_ID_DUPLICATE, INSTR_ID_PUSH_IMM, ANY, INSTR_ID_SWAP,
+			INSTR_ID_PUSH_IMM, ANY, INSTR_ID_SWAP, INSTR_ID_IFELSE) &&
+		MATCH(sub[1], NULL, INSTR_ID_PRINT_CHAR, INSTR_ID_PUSH_IMM, 1))
+	{
+		if (MATCH(sub[0], NULL, INSTR_ID_KILL, INSTR_ID_PUSH_IMM, 0))
+		{
+			return IDIOM_ID_PRINT_REVERSE;
+		}
+		else if (MATCH(sub[0], NULL, INSTR_ID_PUSH_IMM, 0))
+		{
+			return IDIOM_ID_PRINT_REVERSE_KEEP_ZERO;
+		}
+	}
+	/* [dup get pri 1 add dup hei sub 2 swp sub] */
+	if (MATCH(prog_index, NULL,
+			INSTR_ID_DUPLICATE, INSTR_ID_GET, INSTR_ID_PRINT_CHAR,
+			INSTR_ID_PUSH_IMM, 1, INSTR_ID_ADD, INSTR_ID_DUPLICATE,
+			INSTR_ID_HEIGHT, INSTR_ID_SUBTRACT, INSTR_ID_PUSH_IMM, 2,
+			INSTR_ID_SWAP, INSTR_ID_SUBTRACT))
+	{
+		return IDIOM_ID_PRINT_FORWARD;
+	}
+	/* [dup get 10 swp mod '0' add swp dup dup get 10 swp div swp set dup get] */
+	if (MATCH(prog_index, NULL,
+			INSTR_ID_DUPLICATE, INSTR_ID_GET, INSTR_ID_PUSH_IMM, 10,
+			INSTR_ID_SWAP, INSTR_ID_MODULUS, INSTR_ID_PUSH_IMM, '0',
+			INSTR_ID_ADD, INSTR_ID_SWAP, INSTR_ID_DUPLICATE,
+			INSTR_ID_DUPLICATE, INSTR_ID_GET, INSTR_ID_PUSH_IMM, 10,
+			INSTR_ID_SWAP, INSTR_ID_DIVIDE, INSTR_ID_SWAP, INSTR_ID_SET,
+			INSTR_ID_DUPLICATE, INSTR_ID_GET))
+	{
+		return IDIOM_ID_DIGITS;
+	}
+	#undef MATCH
+	return NUMBER_OF_IDIOM_IDS;
+}
+
+#undef ANY
+
+unsigned int optim_recognize_idioms(full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	unsigned int replaced_count = 0;
+	for (unsigned int k = 0; k < full_prog->len; k++)
+	{
+		prog_t* prog = &full_prog->array[k];
+		unsigned int i = 0;
+		while (i < prog->len)
+		{
+			unsigned int size = instr_size(&prog->array[i]);
+			if (prog->array[i] == INSTR_ID_PUSH_IMM && i+2 < prog->len &&
+				prog->array[i+2] == INSTR_ID_DOWHILE)
+			{
+				idiom_id_t idiom_id = recognize_idiom(full_prog,
+					prog->array[i+1]);
+				if (idiom_id != NUMBER_OF_IDIOM_IDS)
+				{
+					/* Same size, the program index stays where it was. */
+					prog->array[i+2] = prog->array[i+1];
+					prog->array[i+1] = idiom_id;
+					prog->array[i] = INSTR_ID_IDIOM_LOOP;
+					replaced_count++;
+					size = 3;
+				}
+			}
+			i += size;
+		}
+	}
+	return replaced_count;
+}
+
+/* A program that pops two cells is only worth a table of 64 KiB if it is at
+ * least that long (in bytes of bytecode), shorter ones are cheap enough. */
+#define MEMO_MIN_LEN_2 12
+
+/* Returns the number of cells that the given program pops if it only moves
+ * and computes cells to end up with one cell in their place (1 or 2),
+ * and 0 otherwise. Programs with branches are not handled. */
+static unsigned int memo_pop_count(const prog_t* prog)
+{
+	int height = 0; /* Relative to the height at the start. */
+	int lowest = 0;
+	for (unsigned int i = 0; i < prog->len; i += instr_size(&prog->array[i]))
+	{
+		int pop_count;
+		int push_count;
+		switch (prog->array[i])
+		{
+			case INSTR_ID_NOP:
+				pop_count = 0; push_count = 0;
+			break;
+			case INSTR_ID_PUSH_IMM:
+				pop_count = 0; push_count = 1;
+			break;
+			case INSTR_ID_PUSH_BYTES:
+				pop_count = 0; push_count = prog->array[i+1];
+			break;
+			case INSTR_ID_KILL:
+				pop_count = 1; push_count = 0;
+			break;
+			case INSTR_ID_DUPLICATE:
+				pop_count = 1; push_count = 2;
+			break;
+			case INSTR_ID_SWAP:
+				pop_count = 2; push_count = 2;
+			break;
+			case INSTR_ID_ADD:
+			case INSTR_ID_SUBTRACT:
+			case INSTR_ID_MULTIPLY:
+			case INSTR_ID_DIVIDE:
+			case INSTR_ID_MODULUS:
+				pop_count = 2; push_count = 1;
+			break;
+			default:
+				/* Indices into the stack are absolute, and the rest executes
+				 * other programs or is impure. */
+				return 0;
+			break;
+		}
+		height -= pop_count;
+		if (height < lowest)
+		{
+			lowest = height;
+		}
+		height += push_count;
+	}
+	unsigned int pop_count = -lowest;
+	if ((pop_count != 1 && pop_count != 2) || height - lowest != 1 ||
+		(pop_count == 2 && prog->len < MEMO_MIN_LEN_2))
+	{
+		return 0;
+	}
+	return pop_count;
+}
+
+/* Returns the allocated table of the results of the given program for every
+ * possible value of the pop_count cells it pops, or NULL if it fails on some
+ * of them (like by dividing by zero). */
+static uint8_t* memo_tabulate(const full_prog_t* full_prog,
+	unsigned int prog_index, unsigned int pop_count)
+{
+	unsigned int table_len = 1u << (8 * pop_count);
+	uint8_t* table = xmalloc(table_len);
+	vm_t vm = {.is_pure = 1};
+	for (unsigned int x = 0; x < table_len; x++)
+	{
+		vm.st.len = 0;
+		if (pop_count == 2)
+		{
+			st_push(&vm.st, x >> 8);
+		}
+		st_push(&vm.st, x & 0xff);
+		exec_status_t status = execute_prog(full_prog, prog_index, &vm);
+		if (status != EXEC_STATUS_OK || vm.st.len != 1)
+		{
+			free(table);
+			table = NULL;
+			break;
+		}
+		table[x] = vm.st.array[0];
+	}
+	vm_cleanup(&vm);
+	return table;
+}
+
+unsigned int optim_memoize_pure_progs(full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	#define ALIAS(i_) \
+		(full_prog->alias_array == NULL ? (i_) : full_prog->alias_array[i_])
+	/* Whether each program has been looked at yet. */
+	uint8_t* is_seen_array = xcalloc(full_prog->len, 1);
+	unsigned int replaced_count = 0;
+	for (unsigned int k = 0; k < full_prog->len; k++)
+	{
+		prog_t* prog = &full_prog->array[k];
+		unsigned int i = 0;
+		while (i < prog->len)
+		{
+			unsigned int size = instr_size(&prog->array[i]);
+			if (prog->array[i] == INSTR_ID_PUSH_IMM && i+2 < prog->len &&
+				prog->array[i+2] == INSTR_ID_EXECUTE &&
+				prog->array[i+1] < full_prog->len)
+			{
+				unsigned int target = ALIAS(prog->array[i+1]);
+				if (!is_seen_array[target])
+				{
+					is_seen_array[target] = 1;
+					unsigned int pop_count =
+						memo_pop_count(&full_prog->array[target]);
+					uint8_t* table = pop_count == 0 ? NULL :
+						memo_tabulate(full_prog, target, pop_count);
+					if (table != NULL)
+					{
+						if (full_prog->memo_array == NULL)
+						{
+							full_prog->memo_array =
+								xcalloc(full_prog->len, sizeof(memo_t));
+						}
+						full_prog->memo_array[target] = (memo_t){
+							.pop_count = pop_count,
+							.table = table,
+						};
+					}
+				}
+				if (full_prog->memo_array != NULL &&
+					full_prog->memo_array[target].table != NULL)
+				{
+					/* Same size, the program index stays where it was. */
+					prog->array[i+2] = target;
+					prog->array[i+1] =
+						full_prog->memo_array[target].pop_count;
+					prog->array[i] = INSTR_ID_LOOKUP;
+					replaced_count++;
+					size = 3;
+				}
+			}
+			i += size;
+		}
+	}
+	free(is_seen_array);
+	#undef ALIAS
+	return replaced_count;
+}
+
+unsigned int optim_full_prog(full_prog_t* full_prog, st_t* st)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	optim_remove_dead_progs(full_prog);
+	optim_merge_identical_progs(full_prog);
+	optim_recognize_idioms(full_prog);
+	optim_memoize_pure_progs(full_prog);
+	return st == NULL ? 0 : optim_partial_eval(full_prog, st);
+}
@@ -0,0 +1,51 @@
+
+#ifndef HELV_OPTIM_HEADER
+#define HELV_OPTIM_HEADER
+
+#include "prog.h"
+#include "interpreter.h"
+
+/* Executes at compile time the longest prefix of the main program (the
+ * program of index 0) that does not depend on input, output or halting,
+ * that terminates in a reasonable amount of time, and that leaves a stack
+ * that fits in the one of the emitted C (see EMIT_C_ST_SIZE).
+ * The resulting stack is written to the given empty stack, and the returned
+ * value is the offset in the main program where the rest of the execution
+ * has to start from for it to be equivalent to a whole execution.
+ * The full program is not modified as its main program may be executed again
+ * by itself (like with 0;x). */
+unsigned int optim_partial_eval(const full_prog_t* full_prog, st_t* st);
+
+/* Removes the programs that can never be executed, and renumbers the others
+ * (the instructions that push their indices are updated accordingly).
+ * This is only done when every program index that is executed is known
+ * statically and is not used as data elsewhere, otherwise nothing is done.
+ * Returns the number of removed programs. */
+unsigned int optim_remove_dead_progs(full_prog_t* full_prog);
+
+/* Makes the programs that have the same bytecode share it, they keep their
+ * indices (see alias_array in full_prog_t).
+ * Returns the number of programs that became aliases of other programs. */
+unsigned int optim_merge_identical_progs(full_prog_t* full_prog);
+
+/* Replaces the do while loops over programs that match known idioms (see
+ * idiom_id_t) by idiom loop instructions, that are executed natively.
+ * Must be done after the removal of dead programs.
+ * Returns the number of replaced loops. */
+unsigned int optim_recognize_idioms(full_prog_t* full_prog);
+
+/* Replaces the executions of known programs that are pure functions of one
+ * or two cells to one cell (made of pushes, stack moves and arithmetic only)
+ * by lookup instructions, the results of these programs for all their
+ * possible arguments being computed here (see memo_array in full_prog_t).
+ * Must be done last, as the programs are not renumbered afterwards.
+ * Returns the number of replaced executions. */
+unsigned int optim_memoize_pure_progs(full_prog_t* full_prog);
+
+/* Applies all the optimizations above, in an order that makes sense.
+ * The stack and the returned offset are those of optim_partial_eval, or if
+ * the stack is NULL there is no partial evaluation (for the interpreter,
+ * that executes the main program from its start) and 0 is returned. */
+unsigned int optim_full_prog(full_prog_t* full_prog, st_t* st);
+
+#endif /* HELV_OPTIM_HEADER */
@@ -1,8 +1,16 @@
 
 #include "utils.h"
 #include "prog.h"
-#include "prog.h"
-#include <string.h> /* strlen */
+#include "parser.h"
+#include <stdlib.h>
+#include <string.h> /* strlen, strchr, strcspn, memcpy */
+#include <stdatomic.h>
+#include <sched.h> /* sched_yield */
+
+/* States of the programs of a lazily parsed full program. */
+#define LAZY_NOT_PARSED 0
+#define LAZY_BEING_PARSED 1
+#define LAZY_PARSED 2
 
 static int c_is_digit(char c)
 {
@@ -27,7 +35,8 @@ static unsigned int parse_number_literal(const char* src, unsigned int* index)
 {
 	ASSERT(src != NULL, "The pointer is NULL\n");
 	ASSERT(index != NULL, "The pointer is NULL\n");
-	ASSERT(*index <= strlen(src), "The source index is out of bounds\n");
+	ASSERT_AT(CHECK_LEVEL_FULL, *index <= strlen(src),
+		"The source index is out of bounds\n");
 	char c;
 	unsigned int value = 0;
 	while (c_is_digit(c = src[*index]))
@@ -47,7 +56,8 @@ static void parse_semicolon_word(const char* src, unsigned int* index,
 {
 	ASSERT(src != NULL, "The pointer is NULL\n");
 	ASSERT(index != NULL, "The pointer is NULL\n");
-	ASSERT(*index <= strlen(src), "The source index is out of bounds\n");
+	ASSERT_AT(CHECK_LEVEL_FULL, *index <= strlen(src),
+		"The source index is out of bounds\n");
 	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
 	ASSERT(prog_index < full_prog->len,
 		"The program index is out of bounds\n");
@@ -97,6 +107,15 @@ static void parse_semicolon_word(const char* src, unsigned int* index,
 		else if (PCGSI('r', INSTR_ID_REPEAT));
 		else if (PCGSI('h', INSTR_ID_HALT));
 		else if (PCGSI('p', INSTR_ID_PRINT_CHAR));
+		else if (PCGSI('o', INSTR_ID_PRINT_STRING));
+		else if (PCGSI('v', INSTR_ID_PRINT_REVERSE));
+		else if (PCGSI('a', INSTR_ID_SPAWN));
+		else if (PCGSI('j', INSTR_ID_JOIN));
+		else if (PCGSI('b', INSTR_ID_CREATE));
+		else if (PCGSI('u', INSTR_ID_RESUME));
+		else if (PCGSI('y', INSTR_ID_YIELD));
+		else if (PCGSI('c', INSTR_ID_READ_BYTE));
+		else if (PCGSI('f', INSTR_ID_END_OF_INPUT));
 		else if (c_is_semicolon_instr(c))
 		{
 			ASSERT(0, "TODO: The semicolon instruction "
@@ -120,7 +139,8 @@ static int parse_word_match(const char* restrict src, unsigned int* index,
 {
 	ASSERT(src != NULL, "The pointer is NULL\n");
 	ASSERT(index != NULL, "The pointer is NULL\n");
-	ASSERT(*index <= strlen(src), "The source index is out of bounds\n");
+	ASSERT_AT(CHECK_LEVEL_FULL, *index <= strlen(src),
+		"The source index is out of bounds\n");
 	ASSERT(word != NULL, "The pointer is NULL\n");
 	unsigned int i;
 	for (i = 0; word[i] != '\0'; i++)
@@ -141,18 +161,255 @@ static int parse_word_match(const char* restrict src, unsigned int* index,
 	}
 }
 
-void parse_full_prog(const char* src, full_prog_t* full_prog)
+/* Advances the line counting of the source up to the given index. */
+static void count_lines(const char* src, unsigned int index,
+	unsigned int* counted_index, unsigned int* line, unsigned int* line_start)
 {
-	ASSERT(src != NULL, "The pointer is NULL\n");
-	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	for (; *counted_index < index; (*counted_index)++)
+	{
+		if (src[*counted_index] == '\n')
+		{
+			(*line)++;
+			*line_start = *counted_index + 1;
+		}
+	}
+}
+
+/* Adds an entry to the source map, unless the instruction is on the line of
+ * the previous entry. */
+static void src_map_add(src_map_t* src_map, unsigned int prog_index,
+	unsigned int offset, unsigned int line, unsigned int column)
+{
+	if (src_map->len > 0 &&
+		src_map->array[src_map->len-1].prog_index == prog_index &&
+		src_map->array[src_map->len-1].line == line)
+	{
+		return;
+	}
+	src_map->len++;
+	DARRAY_RESIZE_IF_NEEDED(src_map->len, src_map->cap, src_map->array,
+		src_pos_t);
+	src_map->array[src_map->len-1] = (src_pos_t){
+		.prog_index = prog_index,
+		.offset = offset,
+		.line = line,
+		.column = column,
+	};
+}
+
+static int src_pos_compare(const void* a, const void* b)
+{
+	const src_pos_t* pos_a = a;
+	const src_pos_t* pos_b = b;
+	if (pos_a->prog_index != pos_b->prog_index)
+	{
+		return pos_a->prog_index < pos_b->prog_index ? -1 : 1;
+	}
+	return pos_a->offset < pos_b->offset ? -1 : pos_a->offset > pos_b->offset;
+}
+
+/* Returns an upper bound of the number of programs in the given source. */
+static unsigned int prescan_prog_count(const char* src)
+{
+	unsigned int prog_count = 1;
+	while ((src = strchr(src, '[')) != NULL)
+	{
+		prog_count++;
+		src++;
+	}
+	return prog_count;
+}
+
+/* Computes an upper bound of the size of the bytecode of each program.
+ * Every syntax element produces at most two bytes of bytecode per character,
+ * so two bytes per character of the program's own source (the source of its
+ * sub programs excluded) is enough. Only [ ] blocks, strings and comments
+ * have to be recognized for that.
+ * The arrays must be big enough for prescan_prog_count programs.
+ * Returns the number of programs. */
+static unsigned int prescan_slot_sizes(const char* src,
+	unsigned int* slot_size_array, unsigned int* open_prog_array)
+{
+	unsigned int prog_count = 1;
+	unsigned int open_count = 1;
+	open_prog_array[0] = 0;
+	slot_size_array[0] = 0;
+	for (unsigned int index = 0; src[index] != '\0'; index++)
+	{
+		char c = src[index];
+		slot_size_array[open_prog_array[open_count-1]] += 2;
+		if (c == '\'' || c == '#')
+		{
+			/* The content of strings and comments is not parsed. */
+			unsigned int end = index+1;
+			while (src[end] != c && src[end] != '\0')
+			{
+				end++;
+			}
+			slot_size_array[open_prog_array[open_count-1]] += 2*(end - index);
+			index = src[end] == '\0' ? end-1 : end;
+		}
+		else if (c == '[')
+		{
+			slot_size_array[prog_count] = 0;
+			open_prog_array[open_count++] = prog_count++;
+		}
+		else if (c == ']' && open_count > 1)
+		{
+			open_count--;
+		}
+	}
+	return prog_count;
+}
+
+/* Finds the source of every program for lazy parsing, and computes upper
+ * bounds of the sizes of their bytecode (two bytes per character of their own
+ * source, as in prescan_slot_sizes). Only [ ] blocks, strings, comments and
+ * ;; have to be recognized, so the scan jumps from one of these characters
+ * to the next, and the sizes follow from where the blocks start and end.
+ * The arrays must be big enough for prescan_prog_count programs.
+ * Returns the number of programs. */
+static unsigned int prescan_lazy_progs(const char* src,
+	lazy_prog_t* lazy_array, unsigned int* slot_size_array,
+	unsigned int* open_prog_array)
+{
+	#define SPECIAL_CHARS "[]'#;"
+	unsigned int len = strlen(src);
+	unsigned int prog_count = 1;
+	unsigned int open_count = 1;
+	unsigned int previous = 0;
 	int short_mode_level = -1;
-	unsigned int index = 0;
-	unsigned int prog_index = full_prog_alloc_index(full_prog);
-	unsigned int previous = prog_index;
+	open_prog_array[0] = 0;
+	lazy_array[0] = (lazy_prog_t){.short_mode_level = -1};
+	slot_size_array[0] = 0;
+	/* The sub programs are counted in the programs they are in, except for
+	 * the push of their index (the size of the source of their [). */
+	#define CLOSE_PROG(end_) \
+		do \
+		{ \
+			unsigned int closed_ = open_prog_array[--open_count]; \
+			lazy_prog_t* lazy_ = &lazy_array[closed_]; \
+			lazy_->src_end = (end_); \
+			lazy_->next = prog_count; \
+			slot_size_array[closed_] += 2 * (lazy_->src_end - lazy_->src_start); \
+			if (open_count > 0) \
+			{ \
+				slot_size_array[open_prog_array[open_count-1]] -= \
+					2 * (lazy_->src_end - lazy_->src_start); \
+			} \
+			previous = closed_; \
+		} while (0)
+	unsigned int index = strcspn(src, SPECIAL_CHARS);
+	while (src[index] != '\0')
+	{
+		char c = src[index];
+		if (c == '\'' || c == '#')
+		{
+			const char* end = strchr(&src[index+1], c);
+			index = end == NULL ? len : (unsigned int)(end - src) + 1;
+		}
+		else if (c == ';')
+		{
+			index++;
+			if (src[index] == ';')
+			{
+				/* Same as the parsing, an error leaves the level as is. */
+				index++;
+				if (short_mode_level == 0)
+				{
+					short_mode_level = -1;
+				}
+				else if (short_mode_level == -1)
+				{
+					short_mode_level = 0;
+				}
+			}
+		}
+		else if (c == '[')
+		{
+			index++;
+			if (short_mode_level >= 0)
+			{
+				short_mode_level++;
+			}
+			lazy_array[prog_count] = (lazy_prog_t){
+				.src_start = index,
+				.previous = previous,
+				.short_mode_level = short_mode_level,
+			};
+			slot_size_array[prog_count] = 0;
+			open_prog_array[open_count++] = prog_count++;
+		}
+		else if (c == ']' && open_count > 1)
+		{
+			index++;
+			CLOSE_PROG(index);
+			if (short_mode_level >= 1)
+			{
+				short_mode_level--;
+			}
+		}
+		else
+		{
+			index++;
+		}
+		index += strcspn(&src[index], SPECIAL_CHARS);
+	}
+	while (open_count > 0)
+	{
+		CLOSE_PROG(len);
+	}
+	#undef CLOSE_PROG
+	#undef SPECIAL_CHARS
+	return prog_count;
+}
+
+/* State of the parsing of the source of a program, with its sub programs or
+ * without them if they are parsed lazily. */
+struct ps_t
+{
+	const char* src;
+	full_prog_t* full_prog;
+	unsigned int index;
+	unsigned int prog_index;
+	unsigned int previous; /* Referred to by the previous word. */
+	unsigned int next; /* Index of the next [ ] block. */
+	int short_mode_level;
+	int is_lazy; /* Stops at the ] of the program, skips sub programs. */
+	int maps_src; /* Fills the source map of the full program. */
+};
+typedef struct ps_t ps_t;
+
+/* Parses the given source, from the given parsing state. */
+static void parse_src(const ps_t* ps)
+{
+	const char* src = ps->src;
+	full_prog_t* full_prog = ps->full_prog;
+	int short_mode_level = ps->short_mode_level;
+	unsigned int index = ps->index;
+	unsigned int prog_index = ps->prog_index;
+	unsigned int previous = ps->previous;
+	unsigned int next = ps->next;
+	/* Programs that contain the one being parsed, innermost last (the lazy
+	 * parsing does not enter sub programs). */
+	unsigned int* open_prog_array = ps->is_lazy ? NULL :
+		xmalloc(full_prog->cap * sizeof(unsigned int));
+	unsigned int open_count = 0;
+	/* Source position of the current syntax element. */
+	unsigned int counted_index = 0;
+	unsigned int line = 1;
+	unsigned int line_start = 0;
 	char c;
 	while ((c = src[index]) != '\0')
 	{
 		#define PROG full_prog->array[prog_index]
+		if (ps->maps_src)
+		{
+			count_lines(src, index, &counted_index, &line, &line_start);
+		}
+		unsigned int instr_prog_index = prog_index;
+		unsigned int instr_offset = PROG.len;
+		unsigned int instr_column = index - line_start + 1;
 		uint8_t* gsi_instr;
 		#define GENERATE_SIMPLE_INSTR(instr_id_) \
 			( \
@@ -227,6 +484,17 @@ void parse_full_prog(const char* src, full_prog_t* full_prog)
 			else if (PWGSI(PWM2("rep", "repeat"),    INSTR_ID_REPEAT));
 			else if (PWGSI(PWM2("hlt", "halt"),      INSTR_ID_HALT));
 			else if (PWGSI(PWM2("pri", "print"),     INSTR_ID_PRINT_CHAR));
+			else if (PWGSI(PWM2("prs", "printstring"), INSTR_ID_PRINT_STRING));
+			else if (PWGSI(PWM2("prr", "printreverse"),
+				INSTR_ID_PRINT_REVERSE));
+			else if (PWGSI(PWM2("spw", "spawn"),     INSTR_ID_SPAWN));
+			else if (PWGSI(PWM2("joi", "join"),      INSTR_ID_JOIN));
+			else if (PWGSI(PWM2("cre", "create"),    INSTR_ID_CREATE));
+			else if (PWGSI(PWM2("res", "resume"),    INSTR_ID_RESUME));
+			else if (PWGSI(PWM2("yie", "yield"),     INSTR_ID_YIELD));
+			else if (PWGSI(PWM2("red", "read"),      INSTR_ID_READ_BYTE));
+			else if (PWGSI(PWM2("eof", "endoffile"), INSTR_ID_END_OF_INPUT));
+			else if (PWGSI(PWM2("snp", "snapshot"),  INSTR_ID_SNAPSHOT));
 			else if (PWM2("cur", "current"))
 			{
 				uint8_t* instr = prog_alloc(&PROG, 2);
@@ -243,7 +511,7 @@ void parse_full_prog(const char* src, full_prog_t* full_prog)
 			{
 				uint8_t* instr = prog_alloc(&PROG, 2);
 				instr[0] = INSTR_ID_PUSH_IMM;
-				instr[1] = full_prog->len;
+				instr[1] = next;
 			}
 			else
 			{
@@ -256,13 +524,33 @@ void parse_full_prog(const char* src, full_prog_t* full_prog)
 		}
 		else if (c == '\'')
 		{
+			/* The characters of a string are pushed in chunks of at most 255
+			 * by push bytes instructions, a lone character is pushed by a push
+			 * immediate instruction (as it is smaller). */
 			index++;
-			while (src[index] != '\'' && src[index] != '\0')
+			unsigned int end = index;
+			while (src[end] != '\'' && src[end] != '\0')
 			{
-				uint8_t* instr = prog_alloc(&PROG, 2);
-				instr[0] = INSTR_ID_PUSH_IMM;
-				instr[1] = src[index];
-				index++;
+				end++;
+			}
+			while (index < end)
+			{
+				unsigned int chunk_len = end - index <= 255 ?
+					end - index : 255;
+				if (chunk_len == 1)
+				{
+					uint8_t* instr = prog_alloc(&PROG, 2);
+					instr[0] = INSTR_ID_PUSH_IMM;
+					instr[1] = src[index];
+				}
+				else
+				{
+					uint8_t* instr = prog_alloc(&PROG, 2 + chunk_len);
+					instr[0] = INSTR_ID_PUSH_BYTES;
+					instr[1] = chunk_len;
+					memcpy(&instr[2], &src[index], chunk_len);
+				}
+				index += chunk_len;
 			}
 			if (src[index] == '\0')
 			{
@@ -275,27 +563,48 @@ void parse_full_prog(const char* src, full_prog_t* full_prog)
 				index++;
 			}
 		}
+		else if (c == '[' && ps->is_lazy)
+		{
+			/* The sub program is skipped, it is parsed when executed. */
+			unsigned int sub_prog_index = next;
+			const lazy_prog_t* lazy = &full_prog->lazy_array[sub_prog_index];
+			uint8_t* instr = prog_alloc(&PROG, 2);
+			instr[0] = INSTR_ID_PUSH_IMM;
+			instr[1] = sub_prog_index;
+			index = lazy->src_end;
+			next = lazy->next;
+			previous = sub_prog_index;
+		}
 		else if (c == '[')
 		{
 			index++;
 			unsigned int sub_prog_index = full_prog_alloc_index(full_prog);
+			next = sub_prog_index + 1;
 			uint8_t* instr = prog_alloc(&PROG, 2);
 			instr[0] = INSTR_ID_PUSH_IMM;
 			instr[1] = sub_prog_index;
+			open_prog_array[open_count++] = prog_index;
 			prog_index = sub_prog_index;
 			if (short_mode_level >= 0)
 			{
 				short_mode_level++;
 			}
 		}
+		else if (c == ']' && prog_index == 0)
+		{
+			index++;
+			ASSERT(0, "TODO: Error to say that this ] closes nothing\n");
+		}
+		else if (c == ']' && ps->is_lazy && prog_index == ps->prog_index)
+		{
+			/* The end of the lazily parsed program. */
+			break;
+		}
 		else if (c == ']')
 		{
 			PROG.is_finished = 1;
 			previous = prog_index;
-			while (PROG.is_finished)
-			{
-				prog_index--;
-			}
+			prog_index = open_prog_array[--open_count];
 			index++;
 			if (short_mode_level >= 1)
 			{
@@ -314,6 +623,7 @@ void parse_full_prog(const char* src, full_prog_t* full_prog)
 		else if (c == '#')
 		{
 			index++;
+			unsigned int line_marker_index = index;
 			while (src[index] != '#' && src[index] != '\0')
 			{
 				index++;
@@ -327,12 +637,129 @@ void parse_full_prog(const char* src, full_prog_t* full_prog)
 			{
 				index++;
 			}
+			if (parse_word_match(src, &line_marker_index, "@line") &&
+				src[line_marker_index] == ' ' &&
+				c_is_digit(src[line_marker_index+1]))
+			{
+				/* Line marker left by the preprocessor, the source that
+				 * follows it is at the given line of the original source. */
+				line_marker_index++;
+				line = parse_number_literal(src, &line_marker_index);
+				counted_index = index;
+				line_start = index;
+			}
 		}
 		else
 		{
+			index++;
 			ASSERT(0, "TODO: Error to say %c (%d) is unexpected\n", c, (int)c);
 		}
+		if (ps->maps_src &&
+			full_prog->array[instr_prog_index].len > instr_offset)
+		{
+			src_map_add(&full_prog->src_map, instr_prog_index, instr_offset,
+				line, instr_column);
+		}
 		#undef GENERATE_SIMPLE_INSTR
 		#undef PROG
 	}
+	free(open_prog_array);
+}
+
+void parse_full_prog(const char* src, full_prog_t* full_prog)
+{
+	ASSERT(src != NULL, "The pointer is NULL\n");
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT(full_prog->len == 0 && full_prog->code == NULL,
+		"The full program must be empty\n");
+	/* The program table and the bytecode arena are allocated once,
+	 * after a quick scan that gives an upper bound of their sizes. */
+	unsigned int max_prog_count = prescan_prog_count(src);
+	unsigned int* slot_size_array =
+		xmalloc(2 * max_prog_count * sizeof(unsigned int));
+	unsigned int prog_count = prescan_slot_sizes(src,
+		slot_size_array, &slot_size_array[max_prog_count]);
+	full_prog_init(full_prog, prog_count, slot_size_array);
+	free(slot_size_array);
+
+	unsigned int prog_index = full_prog_alloc_index(full_prog);
+	parse_src(&(ps_t){
+		.src = src,
+		.full_prog = full_prog,
+		.prog_index = prog_index,
+		.previous = prog_index,
+		.next = prog_index + 1,
+		.short_mode_level = -1,
+		.maps_src = 1,
+	});
+	ASSERT(full_prog->len == full_prog->cap,
+		"The prescan and the parsing disagree on the number of programs\n");
+	/* Sub programs interrupt the entries of the programs they are in. */
+	qsort(full_prog->src_map.array, full_prog->src_map.len, sizeof(src_pos_t),
+		src_pos_compare);
+	full_prog_compact_code(full_prog);
+}
+
+void parse_full_prog_lazy(char* src, full_prog_t* full_prog)
+{
+	ASSERT(src != NULL, "The pointer is NULL\n");
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT(full_prog->len == 0 && full_prog->code == NULL,
+		"The full program must be empty\n");
+	unsigned int max_prog_count = prescan_prog_count(src);
+	lazy_prog_t* lazy_array = xmalloc(max_prog_count * sizeof(lazy_prog_t));
+	unsigned int* slot_size_array =
+		xmalloc(2 * max_prog_count * sizeof(unsigned int));
+	unsigned int prog_count = prescan_lazy_progs(src, lazy_array,
+		slot_size_array, &slot_size_array[max_prog_count]);
+	full_prog_init(full_prog, prog_count, slot_size_array);
+	free(slot_size_array);
+	for (unsigned int i = 0; i < prog_count; i++)
+	{
+		atomic_init(&lazy_array[i].state, LAZY_NOT_PARSED);
+	}
+	full_prog->len = prog_count;
+	full_prog->lazy_src = src;
+	full_prog->lazy_array = lazy_array;
+	parse_lazy_prog(full_prog, 0);
+}
+
+void parse_lazy_prog(const full_prog_t* full_prog, unsigned int prog_index)
+{
+	ASSERT(prog_index < full_prog->len,
+		"The program index is out of bounds\n");
+	lazy_prog_t* lazy = &full_prog->lazy_array[prog_index];
+	if (atomic_load_explicit(&lazy->state, memory_order_acquire) ==
+		LAZY_PARSED)
+	{
+		return;
+	}
+	int state = LAZY_NOT_PARSED;
+	if (atomic_compare_exchange_strong(&lazy->state, &state,
+		LAZY_BEING_PARSED))
+	{
+		/* Only the bytecode of this program is written, which no other
+		 * thread reads before it is parsed. */
+		parse_src(&(ps_t){
+			.src = full_prog->lazy_src,
+			.full_prog = (full_prog_t*)full_prog,
+			.index = lazy->src_start,
+			.prog_index = prog_index,
+			.previous = lazy->previous,
+			.next = prog_index + 1,
+			.short_mode_level = lazy->short_mode_level,
+			.is_lazy = 1,
+		});
+		atomic_store_explicit(&lazy->state, LAZY_PARSED,
+			memory_order_release);
+	}
+	else
+	{
+		/* Being parsed by another thread, which does not take long. */
+		while (atomic_load_explicit(&lazy->state, memory_order_acquire) !=
+			LAZY_PARSED)
+		{
+			sched_yield();
+		}
+	}
 }
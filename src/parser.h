@@ -7,4 +7,16 @@
 /* Parse a full Helv program. */
 void parse_full_prog(const char* src, full_prog_t* full_prog);
 
+/* Parses only the main program of the given source (whose ownership is
+ * taken), after a quick scan that finds the source of every [ ] block. The
+ * other programs are parsed when first executed (see parse_lazy_prog), so the
+ * blocks that a run never executes cost almost nothing.
+ * The source positions are not known, and the full program can only be
+ * executed (it must not be optimized, emitted nor hashed). */
+void parse_full_prog_lazy(char* src, full_prog_t* full_prog);
+
+/* Parses the program of the given index if it is not parsed yet, any number
+ * of threads can do it concurrently. */
+void parse_lazy_prog(const full_prog_t* full_prog, unsigned int prog_index);
+
 #endif /* HELV_PARSER_HEADER */
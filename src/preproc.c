@@ -0,0 +1,705 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "preproc.h"
+#include "utils.h"
+#include "gs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h> /* strlen, strchr, strrchr, strcmp, strncmp, memcpy */
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Maximum nesting of macro expansions and includes,
+ * it is reached by recursive macros and circular includes. */
+#define PREPROC_MAX_DEPTH 64
+
+struct macro_t
+{
+	char* name;
+	unsigned int param_count;
+	char** param_array;
+	char* body; /* Not expanded yet. */
+};
+typedef struct macro_t macro_t;
+
+struct macro_table_t
+{
+	unsigned int len;
+	unsigned int cap;
+	macro_t* array;
+};
+typedef struct macro_table_t macro_table_t;
+
+struct preproc_t
+{
+	macro_table_t macros;
+	char* dir_path; /* Empty or ending by a slash. */
+	unsigned int depth;
+	int has_failed;
+};
+typedef struct preproc_t preproc_t;
+
+/* Expanded included file, with the macros it defines. */
+struct include_t
+{
+	char* path;
+	struct timespec mtime;
+	char* text;
+	macro_table_t macros;
+};
+typedef struct include_t include_t;
+
+/* Shared by all the threads (of the batch mode), the entries are only used
+ * with the mutex held, and the expansions are done without it. */
+static struct
+{
+	unsigned int len;
+	unsigned int cap;
+	include_t* array;
+	pthread_mutex_t mutex;
+} g_include_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static char* str_dup_len(const char* str, unsigned int len)
+{
+	char* dup = xmalloc(len + 1);
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+	return dup;
+}
+
+static int c_is_name_start(char c)
+{
+	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+}
+
+static int c_is_name(char c)
+{
+	return c_is_name_start(c) || ('0' <= c && c <= '9');
+}
+
+static int c_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+static void gs_append_len(gs_t* gs, const char* str, unsigned int len)
+{
+	if (len > 0)
+	{
+		gs_append_f(gs, "%.*s", (int)len, str);
+	}
+}
+
+/* Returns the index just after the string or comment that starts at the
+ * given index, they are never expanded. */
+static unsigned int skip_literal(const char* text, unsigned int i)
+{
+	char end_char = text[i++];
+	while (text[i] != end_char && text[i] != '\0')
+	{
+		i++;
+	}
+	return text[i] == '\0' ? i : i+1;
+}
+
+/* Returns the directory part of the given path (with its trailing slash),
+ * in an allocated buffer. */
+static char* dir_path_of(const char* file_path)
+{
+	if (file_path == NULL)
+	{
+		return str_dup_len("", 0);
+	}
+	const char* last_slash = strrchr(file_path, '/');
+	return str_dup_len(file_path,
+		last_slash == NULL ? 0 : (unsigned int)(last_slash - file_path) + 1);
+}
+
+static void macro_cleanup(macro_t* macro)
+{
+	free(macro->name);
+	for (unsigned int i = 0; i < macro->param_count; i++)
+	{
+		free(macro->param_array[i]);
+	}
+	free(macro->param_array);
+	free(macro->body);
+}
+
+static macro_t macro_copy(const macro_t* macro)
+{
+	macro_t copy = {
+		.name = str_dup_len(macro->name, strlen(macro->name)),
+		.param_count = macro->param_count,
+		.body = str_dup_len(macro->body, strlen(macro->body)),
+	};
+	if (macro->param_count > 0)
+	{
+		copy.param_array = xmalloc(macro->param_count * sizeof(char*));
+	}
+	for (unsigned int i = 0; i < macro->param_count; i++)
+	{
+		copy.param_array[i] = str_dup_len(macro->param_array[i],
+			strlen(macro->param_array[i]));
+	}
+	return copy;
+}
+
+static void macro_table_cleanup(macro_table_t* table)
+{
+	for (unsigned int i = 0; i < table->len; i++)
+	{
+		macro_cleanup(&table->array[i]);
+	}
+	free(table->array);
+}
+
+/* Returns the index of the macro of the given name, or the table length. */
+static unsigned int macro_table_find(const macro_table_t* table,
+	const char* name, unsigned int name_len)
+{
+	unsigned int i;
+	for (i = 0; i < table->len; i++)
+	{
+		if (strncmp(table->array[i].name, name, name_len) == 0 &&
+			table->array[i].name[name_len] == '\0')
+		{
+			break;
+		}
+	}
+	return i;
+}
+
+/* The table takes ownership of the macro, that replaces any previous macro
+ * of the same name. */
+static void macro_table_set(macro_table_t* table, macro_t macro)
+{
+	unsigned int i = macro_table_find(table, macro.name, strlen(macro.name));
+	if (i < table->len)
+	{
+		macro_cleanup(&table->array[i]);
+	}
+	else
+	{
+		table->len++;
+		DARRAY_RESIZE_IF_NEEDED(table->len, table->cap, table->array, macro_t);
+	}
+	table->array[i] = macro;
+}
+
+static void preproc_error(preproc_t* pp, const char* format, ...)
+	ATTRIBUTE(format (printf, 2, 3));
+
+static void preproc_error(preproc_t* pp, const char* format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	fprintf(stderr, "Preprocessor error: ");
+	vfprintf(stderr, format, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	pp->has_failed = 1;
+}
+
+static void preproc_text(preproc_t* pp, const char* text, gs_t* out);
+
+/* Parses a macro definition (after @define),
+ * returns the index just after its @end. */
+static unsigned int preproc_define(preproc_t* pp, const char* text,
+	unsigned int i)
+{
+	while (c_is_space(text[i]))
+	{
+		i++;
+	}
+	unsigned int name_start = i;
+	while (c_is_name(text[i]))
+	{
+		i++;
+	}
+	if (i == name_start || !c_is_name_start(text[name_start]))
+	{
+		preproc_error(pp, "Expected a macro name after @define");
+		return i;
+	}
+	macro_t macro = {.name = str_dup_len(&text[name_start], i - name_start)};
+	if (text[i] == '(')
+	{
+		i++;
+		while (1)
+		{
+			while (c_is_space(text[i]) || text[i] == ',')
+			{
+				i++;
+			}
+			if (text[i] == ')')
+			{
+				i++;
+				break;
+			}
+			unsigned int param_start = i;
+			while (c_is_name(text[i]))
+			{
+				i++;
+			}
+			if (i == param_start || !c_is_name_start(text[param_start]))
+			{
+				preproc_error(pp, "Bad parameter list of the macro @%s",
+					macro.name);
+				macro_cleanup(&macro);
+				return i;
+			}
+			macro.param_array = xrealloc(macro.param_array,
+				(macro.param_count + 1) * sizeof(char*));
+			macro.param_array[macro.param_count++] =
+				str_dup_len(&text[param_start], i - param_start);
+		}
+	}
+	unsigned int body_start = i;
+	while (!(text[i] == '@' && strncmp(&text[i+1], "end", 3) == 0 &&
+		!c_is_name(text[i+4])))
+	{
+		if (text[i] == '\0')
+		{
+			preproc_error(pp, "The macro @%s has no @end", macro.name);
+			macro_cleanup(&macro);
+			return i;
+		}
+		i = text[i] == '\'' || text[i] == '#' ? skip_literal(text, i) : i+1;
+	}
+	macro.body = str_dup_len(&text[body_start], i - body_start);
+	macro_table_set(&pp->macros, macro);
+	return i + 4;
+}
+
+/* Expands the given included file, that is looked for in the cache first. */
+static void preproc_include_file(preproc_t* pp, const char* path, gs_t* out)
+{
+	struct stat s;
+	if (stat(path, &s) != 0)
+	{
+		preproc_error(pp, "Cannot include \"%s\"", path);
+		return;
+	}
+	int is_cached = 0;
+	pthread_mutex_lock(&g_include_cache.mutex);
+	for (unsigned int i = 0; i < g_include_cache.len; i++)
+	{
+		include_t* include = &g_include_cache.array[i];
+		if (strcmp(include->path, path) == 0 &&
+			include->mtime.tv_sec == s.st_mtim.tv_sec &&
+			include->mtime.tv_nsec == s.st_mtim.tv_nsec)
+		{
+			gs_append_len(out, include->text, strlen(include->text));
+			for (unsigned int j = 0; j < include->macros.len; j++)
+			{
+				macro_table_set(&pp->macros,
+					macro_copy(&include->macros.array[j]));
+			}
+			is_cached = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_include_cache.mutex);
+	if (is_cached)
+	{
+		return;
+	}
+
+	if (pp->depth >= PREPROC_MAX_DEPTH)
+	{
+		preproc_error(pp, "Includes are nested too deep "
+			"(is \"%s\" including itself?)", path);
+		return;
+	}
+	char* src = read_file(path);
+	if (src == NULL)
+	{
+		pp->has_failed = 1;
+		return;
+	}
+	preproc_t include_pp = {
+		.dir_path = dir_path_of(path),
+		.depth = pp->depth + 1,
+	};
+	gs_t include_out;
+	gs_init(&include_out);
+	preproc_text(&include_pp, src, &include_out);
+	free(src);
+	free(include_pp.dir_path);
+	if (include_pp.has_failed)
+	{
+		pp->has_failed = 1;
+		gs_cleanup(&include_out);
+		macro_table_cleanup(&include_pp.macros);
+		return;
+	}
+	gs_append_len(out, include_out.str, include_out.len-1);
+	for (unsigned int j = 0; j < include_pp.macros.len; j++)
+	{
+		macro_table_set(&pp->macros, macro_copy(&include_pp.macros.array[j]));
+	}
+
+	/* The cache takes ownership of the expansion. */
+	include_t new_include = {
+		.path = str_dup_len(path, strlen(path)),
+		.mtime = s.st_mtim,
+		.text = include_out.str,
+		.macros = include_pp.macros,
+	};
+	pthread_mutex_lock(&g_include_cache.mutex);
+	unsigned int i;
+	for (i = 0; i < g_include_cache.len; i++)
+	{
+		if (strcmp(g_include_cache.array[i].path, path) == 0)
+		{
+			break;
+		}
+	}
+	if (i < g_include_cache.len)
+	{
+		include_t* old_include = &g_include_cache.array[i];
+		free(old_include->path);
+		free(old_include->text);
+		macro_table_cleanup(&old_include->macros);
+	}
+	else
+	{
+		g_include_cache.len++;
+		DARRAY_RESIZE_IF_NEEDED(g_include_cache.len, g_include_cache.cap,
+			g_include_cache.array, include_t);
+	}
+	g_include_cache.array[i] = new_include;
+	pthread_mutex_unlock(&g_include_cache.mutex);
+}
+
+/* Parses an include (after @include), returns the index just after it. */
+static unsigned int preproc_include(preproc_t* pp, const char* text,
+	unsigned int i, gs_t* out)
+{
+	while (c_is_space(text[i]))
+	{
+		i++;
+	}
+	if (text[i] != '"')
+	{
+		preproc_error(pp, "Expected a double-quoted path after @include");
+		return i;
+	}
+	unsigned int path_start = ++i;
+	while (text[i] != '"' && text[i] != '\n' && text[i] != '\0')
+	{
+		i++;
+	}
+	if (text[i] != '"')
+	{
+		preproc_error(pp, "Non-closed path after @include");
+		return i;
+	}
+	unsigned int path_len = i - path_start;
+	unsigned int dir_len = text[path_start] == '/' ? 0 : strlen(pp->dir_path);
+	char* path = xmalloc(dir_len + path_len + 1);
+	memcpy(path, pp->dir_path, dir_len);
+	memcpy(&path[dir_len], &text[path_start], path_len);
+	path[dir_len + path_len] = '\0';
+	preproc_include_file(pp, path, out);
+	free(path);
+	return i+1;
+}
+
+/* Parses a macro use (the name is already parsed), and expands it.
+ * Returns the index just after it. */
+static unsigned int preproc_expand(preproc_t* pp, const char* text,
+	unsigned int name_start, unsigned int name_len, unsigned int i,
+	gs_t* out)
+{
+	unsigned int macro_index = macro_table_find(&pp->macros,
+		&text[name_start], name_len);
+	if (macro_index == pp->macros.len)
+	{
+		preproc_error(pp, "Unknown macro @%.*s",
+			(int)name_len, &text[name_start]);
+		return i;
+	}
+	if (pp->depth >= PREPROC_MAX_DEPTH)
+	{
+		preproc_error(pp, "Macro expansions are nested too deep "
+			"(is @%.*s recursive?)", (int)name_len, &text[name_start]);
+		return i;
+	}
+	pp->depth++;
+
+	/* The arguments are expanded before being substituted. */
+	unsigned int arg_count = 0;
+	char** arg_array = NULL;
+	if (pp->macros.array[macro_index].param_count > 0)
+	{
+		if (text[i] != '(')
+		{
+			preproc_error(pp, "The macro @%.*s expects arguments",
+				(int)name_len, &text[name_start]);
+		}
+		while (!pp->has_failed && (text[i] == '(' || text[i] == ','))
+		{
+			unsigned int arg_start = ++i;
+			unsigned int paren_depth = 0;
+			while (paren_depth > 0 || (text[i] != ',' && text[i] != ')'))
+			{
+				if (text[i] == '\0')
+				{
+					preproc_error(pp, "Non-closed arguments of the macro "
+						"@%.*s", (int)name_len, &text[name_start]);
+					break;
+				}
+				else if (text[i] == '\'' || text[i] == '#')
+				{
+					i = skip_literal(text, i);
+					continue;
+				}
+				paren_depth += text[i] == '(';
+				paren_depth -= text[i] == ')';
+				i++;
+			}
+			if (pp->has_failed)
+			{
+				break;
+			}
+			char* arg = str_dup_len(&text[arg_start], i - arg_start);
+			gs_t arg_out;
+			gs_init(&arg_out);
+			preproc_text(pp, arg, &arg_out);
+			free(arg);
+			arg_array = xrealloc(arg_array, (arg_count + 1) * sizeof(char*));
+			arg_array[arg_count++] = arg_out.str;
+			if (text[i] == ')')
+			{
+				i++;
+				break;
+			}
+		}
+	}
+	/* Fetched only now as the arguments may have defined macros. */
+	const macro_t* macro = &pp->macros.array[macro_index];
+	if (!pp->has_failed && arg_count != macro->param_count)
+	{
+		preproc_error(pp, "The macro @%s expects %u arguments, not %u",
+			macro->name, macro->param_count, arg_count);
+	}
+
+	if (!pp->has_failed)
+	{
+		gs_t body;
+		gs_init(&body);
+		const char* src = macro->body;
+		unsigned int j = 0;
+		while (src[j] != '\0')
+		{
+			unsigned int start = j;
+			while (src[j] != '\0' &&
+				src[j] != '$' && src[j] != '\'' && src[j] != '#')
+			{
+				j++;
+			}
+			gs_append_len(&body, &src[start], j - start);
+			if (src[j] == '\'' || src[j] == '#')
+			{
+				unsigned int end = skip_literal(src, j);
+				gs_append_len(&body, &src[j], end - j);
+				j = end;
+			}
+			else if (src[j] == '$')
+			{
+				unsigned int param_start = ++j;
+				while (c_is_name(src[j]))
+				{
+					j++;
+				}
+				unsigned int k;
+				for (k = 0; k < macro->param_count; k++)
+				{
+					if (strncmp(macro->param_array[k], &src[param_start],
+							j - param_start) == 0 &&
+						macro->param_array[k][j - param_start] == '\0')
+					{
+						break;
+					}
+				}
+				if (k < macro->param_count)
+				{
+					gs_append_f(&body, "%s", arg_array[k]);
+				}
+				else
+				{
+					preproc_error(pp, "The macro @%s has no parameter $%.*s",
+						macro->name, (int)(j - param_start), &src[param_start]);
+					break;
+				}
+			}
+		}
+		if (!pp->has_failed)
+		{
+			preproc_text(pp, body.str, out);
+		}
+		gs_cleanup(&body);
+	}
+
+	for (unsigned int k = 0; k < arg_count; k++)
+	{
+		free(arg_array[k]);
+	}
+	free(arg_array);
+	pp->depth--;
+	return i;
+}
+
+/* Turns the newlines of the given growable string from the given index on
+ * into spaces, except those in strings. Returns the number of those left. */
+static unsigned int flatten_lines(gs_t* gs, unsigned int start)
+{
+	unsigned int newline_count = 0;
+	unsigned int j = start;
+	while (j < gs->len-1)
+	{
+		if (gs->str[j] == '\'' || gs->str[j] == '#')
+		{
+			char end_char = gs->str[j++];
+			while (j < gs->len-1 && gs->str[j] != end_char)
+			{
+				if (gs->str[j] == '\n' && end_char == '\'')
+				{
+					newline_count++;
+				}
+				else if (gs->str[j] == '\n')
+				{
+					gs->str[j] = ' ';
+				}
+				j++;
+			}
+		}
+		else if (gs->str[j] == '\n')
+		{
+			gs->str[j] = ' ';
+		}
+		j++;
+	}
+	return newline_count;
+}
+
+/* Appends the expansion of the given text to the given growable string.
+ * At the top level, expansions are kept on the line of their directive, and
+ * the source that follows a directive that changes the number of lines is
+ * preceded by a line marker comment (see the header). */
+static void preproc_text(preproc_t* pp, const char* text, gs_t* out)
+{
+	unsigned int line = 1;
+	unsigned int counted_index = 0;
+	#define COUNT_LINES_UP_TO(index_) \
+		for (; counted_index < (index_); counted_index++) \
+		{ \
+			line += text[counted_index] == '\n'; \
+		}
+	unsigned int i = 0;
+	while (text[i] != '\0' && !pp->has_failed)
+	{
+		unsigned int start = i;
+		while (text[i] != '\0' &&
+			text[i] != '@' && text[i] != '\'' && text[i] != '#')
+		{
+			i++;
+		}
+		gs_append_len(out, &text[start], i - start);
+		if (text[i] == '\'' || text[i] == '#')
+		{
+			unsigned int end = skip_literal(text, i);
+			gs_append_len(out, &text[i], end - i);
+			i = end;
+		}
+		else if (text[i] == '@')
+		{
+			COUNT_LINES_UP_TO(i);
+			unsigned int directive_line = line;
+			unsigned int out_start = out->len-1;
+			unsigned int name_start = ++i;
+			while (c_is_name(text[i]))
+			{
+				i++;
+			}
+			unsigned int name_len = i - name_start;
+			#define IS_NAME(word_) \
+				(name_len == strlen(word_) && \
+					strncmp(&text[name_start], (word_), name_len) == 0)
+			if (name_len == 0 || !c_is_name_start(text[name_start]))
+			{
+				preproc_error(pp, "Expected a name after @");
+			}
+			else if (IS_NAME("define"))
+			{
+				i = preproc_define(pp, text, i);
+			}
+			else if (IS_NAME("include"))
+			{
+				i = preproc_include(pp, text, i, out);
+			}
+			else if (IS_NAME("end"))
+			{
+				preproc_error(pp, "This @end closes no @define");
+			}
+			else
+			{
+				i = preproc_expand(pp, text, name_start, name_len, i, out);
+			}
+			#undef IS_NAME
+			if (pp->depth == 0 && !pp->has_failed)
+			{
+				unsigned int newline_count = flatten_lines(out, out_start);
+				COUNT_LINES_UP_TO(i);
+				if (line - directive_line != newline_count)
+				{
+					gs_append_f(out, "#@line %u#", line);
+				}
+			}
+		}
+	}
+	#undef COUNT_LINES_UP_TO
+}
+
+char* preproc_src(const char* src, const char* file_path)
+{
+	ASSERT(src != NULL, "The pointer is NULL\n");
+	if (strchr(src, '@') == NULL)
+	{
+		/* Nothing to expand. */
+		return str_dup_len(src, strlen(src));
+	}
+	preproc_t pp = {.dir_path = dir_path_of(file_path)};
+	gs_t out;
+	gs_init(&out);
+	preproc_text(&pp, src, &out);
+	macro_table_cleanup(&pp.macros);
+	free(pp.dir_path);
+	if (pp.has_failed)
+	{
+		gs_cleanup(&out);
+		return NULL;
+	}
+	return out.str;
+}
+
+void preproc_cache_cleanup(void)
+{
+	pthread_mutex_lock(&g_include_cache.mutex);
+	for (unsigned int i = 0; i < g_include_cache.len; i++)
+	{
+		include_t* include = &g_include_cache.array[i];
+		free(include->path);
+		free(include->text);
+		macro_table_cleanup(&include->macros);
+	}
+	free(g_include_cache.array);
+	g_include_cache.len = 0;
+	g_include_cache.cap = 0;
+	g_include_cache.array = NULL;
+	pthread_mutex_unlock(&g_include_cache.mutex);
+}
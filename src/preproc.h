@@ -0,0 +1,36 @@
+
+#ifndef HELV_PREPROC_HEADER
+#define HELV_PREPROC_HEADER
+
+/* Preprocessor, expands the following directives of a Helv source code
+ * (that are not in strings or comments) before it is parsed:
+ *
+ *   @define name body @end         Defines a macro.
+ *   @define name(a b) body @end    Defines a macro with parameters, that
+ *                                  are referred to by $a and $b in the body.
+ *   @name                          Expands to the body of the macro.
+ *   @name(x, y)                    Expands to the body of the macro with the
+ *                                  arguments substituted to the parameters.
+ *   @include "path"                Expands to the included file, and defines
+ *                                  the macros it defines. The path is relative
+ *                                  to the directory of the including file.
+ *
+ * Macro bodies are expanded at each use, so they may use macros defined
+ * later. An included file is expanded on its own (it does not see the macros
+ * defined by the including file), so that its expansion can be cached, with
+ * the modification time of the file as part of the key.
+ *
+ * The expanded source keeps the lines of the original source: an expansion
+ * is put on the line of its directive, and the source that follows is put
+ * back on its line by a "#@line N#" comment that the parser understands. */
+
+/* Returns the expanded source in an allocated buffer, or NULL after printing
+ * an error on stderr. The file path is that of the source (for includes),
+ * NULL if it is not from a file (includes are then relative to the working
+ * directory). */
+char* preproc_src(const char* src, const char* file_path);
+
+/* Frees the cache of the expanded included files. */
+void preproc_cache_cleanup(void);
+
+#endif /* HELV_PREPROC_HEADER */
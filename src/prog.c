@@ -3,37 +3,217 @@
 #include "utils.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h> /* memmove */
 
-void prog_cleanup(prog_t* prog)
+unsigned int instr_size(const uint8_t* instr)
 {
-	ASSERT_CHECK_PROG_PTR(prog);
-	free(prog->array);
+	ASSERT(instr != NULL, "The pointer is NULL\n");
+	ASSERT(instr[0] < NUMBER_OF_INSTRUCTION_IDS,
+		"Invalid instruction id %u\n", (unsigned int)instr[0]);
+	switch (instr[0])
+	{
+		case INSTR_ID_PUSH_IMM:
+			return 2;
+		case INSTR_ID_PUSH_BYTES:
+			return 2 + instr[1];
+		case INSTR_ID_IDIOM_LOOP:
+		case INSTR_ID_LOOKUP:
+			return 3;
+		default:
+			return 1;
+	}
 }
 
 uint8_t* prog_alloc(prog_t* prog, unsigned int len)
 {
 	ASSERT_CHECK_PROG_PTR(prog);
+	ASSERT(prog->len + len <= prog->cap,
+		"The slot of the program (%u bytes) is too small\n", prog->cap);
 	prog->len += len;
-	DARRAY_RESIZE_IF_NEEDED(prog->len, prog->cap, prog->array, uint8_t);
 	return &prog->array[prog->len - len];
 }
 
 void full_prog_cleanup(full_prog_t* full_prog)
 {
 	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
-	for (unsigned int i = 0; i < full_prog->len; i++)
+	free(full_prog->code);
+	free(full_prog->array);
+	free(full_prog->alias_array);
+	free(full_prog->src_map.array);
+	free(full_prog->lazy_src);
+	free(full_prog->lazy_array);
+	if (full_prog->memo_array != NULL)
 	{
-		prog_cleanup(&full_prog->array[i]);
+		for (unsigned int i = 0; i < full_prog->len; i++)
+		{
+			free(full_prog->memo_array[i].table);
+		}
+		free(full_prog->memo_array);
+	}
+}
+
+void full_prog_init(full_prog_t* full_prog, unsigned int prog_count,
+	const unsigned int* slot_size_array)
+{
+	ASSERT(full_prog != NULL, "The pointer is NULL\n");
+	ASSERT(slot_size_array != NULL, "The pointer is NULL\n");
+	*full_prog = (full_prog_t){0};
+	full_prog->array = xmalloc(prog_count * sizeof(prog_t));
+	full_prog->cap = prog_count;
+	for (unsigned int i = 0; i < prog_count; i++)
+	{
+		full_prog->code_len += slot_size_array[i];
+	}
+	full_prog->code = xmalloc(full_prog->code_len);
+	uint8_t* slot = full_prog->code;
+	for (unsigned int i = 0; i < prog_count; i++)
+	{
+		full_prog->array[i] = (prog_t){
+			.cap = slot_size_array[i],
+			.array = slot_size_array[i] == 0 ? NULL : slot,
+		};
+		slot += slot_size_array[i];
 	}
-	free(full_prog->array);
 }
 
 unsigned int full_prog_alloc_index(full_prog_t* full_prog)
 {
 	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
-	full_prog->len++;
-	DARRAY_RESIZE_IF_NEEDED(full_prog->len, full_prog->cap,
-		full_prog->array, prog_t);
-	full_prog->array[full_prog->len-1] = (prog_t){0};
-	return full_prog->len-1;
+	ASSERT(full_prog->len < full_prog->cap,
+		"There are no programs left to take\n");
+	return full_prog->len++;
+}
+
+void full_prog_compact_code(full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	unsigned int code_len = 0;
+	for (unsigned int i = 0; i < full_prog->len; i++)
+	{
+		prog_t* prog = &full_prog->array[i];
+		if (prog->len == 0)
+		{
+			*prog = (prog_t){.is_finished = prog->is_finished};
+			continue;
+		}
+		ASSERT(prog->array >= &full_prog->code[code_len],
+			"The programs are not in the order of their indices\n");
+		memmove(&full_prog->code[code_len], prog->array, prog->len);
+		prog->cap = prog->len;
+		code_len += prog->len;
+	}
+	if (code_len == 0)
+	{
+		free(full_prog->code);
+		full_prog->code = NULL;
+	}
+	else if (code_len < full_prog->code_len)
+	{
+		uint8_t* code = xrealloc(full_prog->code, code_len);
+		ASSERT(code != NULL, "Reallocation failed\n");
+		full_prog->code = code;
+	}
+	full_prog->code_len = code_len;
+	/* The arena may have moved, and the programs are now back to back. */
+	uint8_t* slot = full_prog->code;
+	for (unsigned int i = 0; i < full_prog->len; i++)
+	{
+		prog_t* prog = &full_prog->array[i];
+		if (prog->len != 0)
+		{
+			prog->array = slot;
+			slot += prog->len;
+		}
+	}
+}
+
+const prog_t* full_prog_get_prog(const full_prog_t* full_prog,
+	unsigned int prog_index)
+{
+	ASSERT(prog_index < full_prog->len,
+		"The program index is out of bounds\n");
+	if (full_prog->alias_array != NULL)
+	{
+		prog_index = full_prog->alias_array[prog_index];
+	}
+	return &full_prog->array[prog_index];
+}
+
+const src_pos_t* full_prog_find_src_pos(const full_prog_t* full_prog,
+	unsigned int prog_index, unsigned int offset)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	const src_map_t* src_map = &full_prog->src_map;
+	/* Binary search of the last entry not after the instruction. */
+	unsigned int low = 0;
+	unsigned int high = src_map->len;
+	while (low < high)
+	{
+		unsigned int middle = low + (high - low) / 2;
+		const src_pos_t* pos = &src_map->array[middle];
+		if (pos->prog_index < prog_index ||
+			(pos->prog_index == prog_index && pos->offset <= offset))
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if (low == 0 || src_map->array[low-1].prog_index != prog_index)
+	{
+		return NULL;
+	}
+	return &src_map->array[low-1];
+}
+
+int full_prog_uses_instr(const full_prog_t* full_prog, instr_id_t instr_id)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	for (unsigned int i = 0; i < full_prog->len; i++)
+	{
+		const prog_t* prog = &full_prog->array[i];
+		for (unsigned int j = 0; j < prog->len;
+			j += instr_size(&prog->array[j]))
+		{
+			if (prog->array[j] == instr_id)
+			{
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+uint64_t full_prog_hash(const full_prog_t* full_prog)
+{
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	/* FNV-1a, over the lengths and the contents. */
+	uint64_t hash = 14695981039346656037ull;
+	#define HASH_BYTE(byte_) \
+		hash = (hash ^ (uint8_t)(byte_)) * 1099511628211ull
+	#define HASH_UINT(x_) \
+		do \
+		{ \
+			for (unsigned int k_ = 0; k_ < 4; k_++) \
+			{ \
+				HASH_BYTE((x_) >> (k_ * 8)); \
+			} \
+		} while (0)
+	HASH_UINT(full_prog->len);
+	for (unsigned int i = 0; i < full_prog->len; i++)
+	{
+		const prog_t* prog = &full_prog->array[i];
+		HASH_UINT(prog->len);
+		for (unsigned int j = 0; j < prog->len; j++)
+		{
+			HASH_BYTE(prog->array[j]);
+		}
+		HASH_UINT(full_prog->alias_array == NULL ?
+			i : full_prog->alias_array[i]);
+	}
+	#undef HASH_UINT
+	#undef HASH_BYTE
+	return hash;
 }
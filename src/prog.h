@@ -5,12 +5,15 @@
 #include "utils.h"
 #include <stdint.h>
 #include <assert.h> /* static_assert */
+#include <stdatomic.h>
 
 /* Elementary macro instruction id, can and should fit in a byte. */
 enum instr_id_t
 {
 	INSTR_ID_NOP = 0,
 	INSTR_ID_PUSH_IMM, /* Immutable byte value follows. */
+	INSTR_ID_PUSH_BYTES, /* Length byte follows, then that many bytes to push
+		* in that order (the last one ends up on top). */
 	INSTR_ID_KILL,
 	INSTR_ID_DUPLICATE,
 	INSTR_ID_SWAP,
@@ -25,9 +28,31 @@ enum instr_id_t
 	INSTR_ID_EXECUTE,
 	INSTR_ID_IFELSE,
 	INSTR_ID_DOWHILE,
+	INSTR_ID_IDIOM_LOOP, /* Idiom id and program index follow, it is a do while
+		* loop over that program, done natively when possible. */
 	INSTR_ID_REPEAT,
 	INSTR_ID_PRINT_CHAR,
+	INSTR_ID_PRINT_STRING, /* Prints from the popped index up to a 0 or the
+		* top of the stack, nothing is popped from the printed cells. */
+	INSTR_ID_PRINT_REVERSE, /* Pops and prints until a 0 is popped,
+		* the 0 is not printed. */
+	INSTR_ID_SPAWN, /* Pops a program index and a number of cells to pop and
+		* give to the spawned task, then pushes the handle of the task. */
+	INSTR_ID_JOIN, /* Pops a handle, and pushes the stack of the task. */
+	INSTR_ID_CREATE, /* Pops a program index, and pushes the handle of a new
+		* coroutine that will execute it. */
+	INSTR_ID_RESUME, /* Pops a handle and a number of cells to pop and give to
+		* the coroutine, then pushes what it yields and 1, or its stack and 0
+		* if it ended. */
+	INSTR_ID_YIELD, /* Pops a number of cells to pop and give back to whoever
+		* resumed the coroutine, then pushes what is given by the next resume. */
+	INSTR_ID_READ_BYTE, /* Pushes 0 if there is nothing left to read. */
+	INSTR_ID_END_OF_INPUT,
 	INSTR_ID_HALT,
+	INSTR_ID_SNAPSHOT, /* Saves the execution state, see snapshot.h. */
+	INSTR_ID_LOOKUP, /* Number of popped cells and program index follow, it is
+		* an execution of that program, done by a table lookup (see memo_array
+		* in full_prog_t and optim_memoize_pure_progs). */
 	NUMBER_OF_INSTRUCTION_IDS
 };
 typedef enum instr_id_t instr_id_t;
@@ -35,12 +60,31 @@ typedef enum instr_id_t instr_id_t;
 static_assert(NUMBER_OF_INSTRUCTION_IDS <= 256,
 	"There are too much instruction ids for them to fit in a byte");
 
+/* Do while loops recognized by optim_recognize_idioms, each one has a native
+ * implementation equivalent to the loop (when its preconditions hold). */
+enum idiom_id_t
+{
+	IDIOM_ID_EMPTY_STACK = 0, /* Kills until the height is a multiple of 256. */
+	IDIOM_ID_PRINT_REVERSE, /* Same as the print reverse instruction. */
+	IDIOM_ID_PRINT_REVERSE_KEEP_ZERO, /* Same but the 0 stays on the stack. */
+	IDIOM_ID_PRINT_FORWARD, /* Prints from the index on top to under it,
+		* the index ends up pointing to itself. */
+	IDIOM_ID_DIGITS, /* Pushes under the index on top the decimal digits of the
+		* number it points to (least significant first), that ends up 0. */
+	NUMBER_OF_IDIOM_IDS
+};
+typedef enum idiom_id_t idiom_id_t;
+
+/* Returns the size in bytes of the pointed instruction,
+ * the instruction id byte and the bytes that follow it included. */
+unsigned int instr_size(const uint8_t* instr);
+
 /* A sequence of Helv instructions. */
 struct prog_t
 {
 	unsigned int len;
-	unsigned int cap;
-	uint8_t* array; /* Bytecode. */
+	unsigned int cap; /* Size of the slot reserved in the bytecode arena. */
+	uint8_t* array; /* Bytecode, in the arena of the full program. */
 	int is_finished; /* Is this program fully parsed yet? */
 };
 typedef struct prog_t prog_t;
@@ -53,18 +97,77 @@ typedef struct prog_t prog_t;
 			prog_ptr_->array); \
 	} while (0)
 
-void prog_cleanup(prog_t* prog);
-
-/* Extends the program by len uninitialized bytes,
+/* Extends the program by len uninitialized bytes (that must fit in its slot),
  * and returns a pointer to the newly added bytes that must all be used. */
 uint8_t* prog_alloc(prog_t* prog, unsigned int len);
 
-/* Full Helv program, as opposed to sub progras like those if [ ] blocks. */
+/* Source position of the instructions of a program from a bytecode offset
+ * on, up to the next entry of the same program. */
+struct src_pos_t
+{
+	unsigned int prog_index;
+	unsigned int offset;
+	unsigned int line; /* Starting from 1. */
+	unsigned int column; /* Starting from 1. */
+};
+typedef struct src_pos_t src_pos_t;
+
+/* Side table of the source positions of the bytecode, sorted by program
+ * index then offset, with entries only where the line changes. It is kept
+ * apart from the programs so that the execution never touches it. */
+struct src_map_t
+{
+	unsigned int len;
+	unsigned int cap;
+	src_pos_t* array;
+};
+typedef struct src_map_t src_map_t;
+
+/* Source of a program that may not be parsed yet, with the state of the
+ * parsing at its beginning, see parse_full_prog_lazy. */
+struct lazy_prog_t
+{
+	unsigned int src_start; /* Just after its [. */
+	unsigned int src_end; /* Just after its ], or the end of the source. */
+	unsigned int next; /* Index of the first program after its sub programs. */
+	unsigned int previous; /* Referred to by the previous word at its start. */
+	int short_mode_level;
+	atomic_int state; /* Not parsed, being parsed, or parsed. */
+};
+typedef struct lazy_prog_t lazy_prog_t;
+
+/* Results of a program that is a pure function of the cells it pops,
+ * see optim_memoize_pure_progs. */
+struct memo_t
+{
+	unsigned int pop_count; /* 1 or 2. */
+	uint8_t* table; /* Indexed by the popped cells, the top one being the low
+		* byte, NULL if the program is not memoized. */
+};
+typedef struct memo_t memo_t;
+
+/* Full Helv program, as opposed to sub progras like those if [ ] blocks.
+ * The bytecode of all the programs is stored in one arena, allocated once,
+ * in which the programs are laid out in the order of their indices. */
 struct full_prog_t
 {
 	unsigned int len;
 	unsigned int cap;
 	prog_t* array;
+	uint8_t* code; /* Bytecode arena. */
+	unsigned int code_len; /* Size of the arena. */
+	/* If not NULL, the program of index i is the program of index
+	 * alias_array[i], which has the same bytecode and is its own alias.
+	 * Only the programs that are their own aliases hold their bytecode. */
+	unsigned int* alias_array;
+	src_map_t src_map; /* Empty if the positions are unknown. */
+	/* If not NULL, the programs are parsed from this source when they are
+	 * first executed, see parse_full_prog_lazy. */
+	char* lazy_src;
+	lazy_prog_t* lazy_array;
+	/* If not NULL, the programs of index i whose memo_array[i].table is not
+	 * NULL are their own aliases and have been memoized. */
+	memo_t* memo_array;
 };
 typedef struct full_prog_t full_prog_t;
 
@@ -75,7 +178,9 @@ typedef struct full_prog_t full_prog_t;
 		ASSERT_CHECK_DARRAY(full_prog_ptr_->len, full_prog_ptr_->cap, \
 			full_prog_ptr_->array); \
 		CODE_FOR_ASSERT( \
-			for (unsigned int i = 0; i < full_prog_ptr_->len; i++) \
+			for (unsigned int i = 0; \
+				check_level >= CHECK_LEVEL_FULL && i < full_prog_ptr_->len; \
+				i++) \
 			{ \
 				prog_t* prog_ = &full_prog_ptr_->array[i]; \
 				ASSERT_CHECK_PROG_PTR(prog_); \
@@ -85,8 +190,36 @@ typedef struct full_prog_t full_prog_t;
 
 void full_prog_cleanup(full_prog_t* full_prog);
 
-/* Adds an empty program to the given full program,
+/* Allocates the program table and the bytecode arena, the given array
+ * contains the size of the slot to reserve for each of the prog_count
+ * programs, they are then taken by full_prog_alloc_index. */
+void full_prog_init(full_prog_t* full_prog, unsigned int prog_count,
+	const unsigned int* slot_size_array);
+
+/* Takes the next program of the given full program, which is empty,
  * and returns the new program's index. */
 unsigned int full_prog_alloc_index(full_prog_t* full_prog);
 
+/* Moves the bytecode of the programs so that there are no holes between them
+ * in the arena (the slots shrink to fit the programs), and shrinks the arena
+ * to fit. */
+void full_prog_compact_code(full_prog_t* full_prog);
+
+/* Returns the program of the given index, aliases are followed. */
+const prog_t* full_prog_get_prog(const full_prog_t* full_prog,
+	unsigned int prog_index);
+
+/* Returns the source position of the instruction at the given offset of the
+ * given program (aliases are not followed), or NULL if it is unknown. */
+const src_pos_t* full_prog_find_src_pos(const full_prog_t* full_prog,
+	unsigned int prog_index, unsigned int offset);
+
+/* Returns non-zero if the given instruction appears somewhere
+ * in the given full program. */
+int full_prog_uses_instr(const full_prog_t* full_prog, instr_id_t instr_id);
+
+/* Returns a hash of the bytecode and of the aliases of the given full
+ * program, which identifies it (the source positions are not hashed). */
+uint64_t full_prog_hash(const full_prog_t* full_prog);
+
 #endif /* HELV_PROG_HEADER */
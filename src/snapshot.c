@@ -0,0 +1,180 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "snapshot.h"
+#include "utils.h"
+#include "prog.h"
+#include "interpreter.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h> /* memcmp, memcpy, strlen */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* close */
+#include <sys/stat.h> /* fstat */
+#include <sys/mman.h> /* mmap */
+
+#define SNAPSHOT_MAGIC "HELVSNP1"
+
+/* Beginning of a snapshot file,
+ * followed by the frames and then by the cells of the stack. */
+struct snapshot_header_t
+{
+	char magic[8];
+	uint64_t prog_hash;
+	uint32_t st_len;
+	uint32_t frame_count;
+};
+typedef struct snapshot_header_t snapshot_header_t;
+
+int snapshot_write(const char* file_path, const full_prog_t* full_prog,
+	const vm_t* vm)
+{
+	ASSERT(file_path != NULL, "The pointer is NULL\n");
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	snapshot_header_t header = {
+		.prog_hash = full_prog_hash(full_prog),
+		.st_len = vm->st.len,
+		.frame_count = vm->frame_count,
+	};
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+	unsigned int path_len = strlen(file_path);
+	char* tmp_path = xmalloc(path_len + 5);
+	memcpy(tmp_path, file_path, path_len);
+	memcpy(&tmp_path[path_len], ".tmp", 5);
+	FILE* file = fopen(tmp_path, "wb");
+	int has_failed = file == NULL;
+	if (!has_failed)
+	{
+		has_failed =
+			fwrite(&header, sizeof header, 1, file) != 1 ||
+			(vm->frame_count > 0 && fwrite(vm->frame_array,
+				sizeof(exec_frame_t), vm->frame_count, file) !=
+				vm->frame_count) ||
+			(vm->st.len > 0 && fwrite(vm->st.array, 1, vm->st.len, file) !=
+				vm->st.len);
+		has_failed = fclose(file) != 0 || has_failed;
+		has_failed = has_failed || rename(tmp_path, file_path) != 0;
+	}
+	free(tmp_path);
+	if (has_failed)
+	{
+		fprintf(stderr, "Snapshot error: failed to write \"%s\"\n",
+			file_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns non-zero if the given frame can be executed in the given full
+ * program, its offset being at the start of an instruction. */
+static int frame_is_valid(const exec_frame_t* frame,
+	const full_prog_t* full_prog)
+{
+	if (frame->prog_index >= full_prog->len ||
+		(frame->loop_instr != INSTR_ID_NOP &&
+			frame->loop_instr != INSTR_ID_DOWHILE &&
+			frame->loop_instr != INSTR_ID_REPEAT))
+	{
+		return 0;
+	}
+	const prog_t* prog = &full_prog->array[frame->prog_index];
+	unsigned int offset = 0;
+	while (offset < frame->offset && offset < prog->len)
+	{
+		offset += instr_size(&prog->array[offset]);
+	}
+	return offset == frame->offset;
+}
+
+int snapshot_restore(const char* file_path, const full_prog_t* full_prog,
+	vm_t* vm)
+{
+	ASSERT(file_path != NULL, "The pointer is NULL\n");
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	int fd = open(file_path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "File error: failed to open \"%s\"\n", file_path);
+		return -1;
+	}
+	struct stat file_stat;
+	const uint8_t* data = NULL;
+	size_t len = 0;
+	if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+	{
+		len = file_stat.st_size;
+		void* mapped = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		data = mapped == MAP_FAILED ? NULL : mapped;
+	}
+	close(fd);
+	const char* error = NULL;
+	snapshot_header_t header;
+	if (data == NULL || len < sizeof header)
+	{
+		error = "is not a snapshot";
+	}
+	else
+	{
+		memcpy(&header, data, sizeof header);
+		if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) != 0)
+		{
+			error = "is not a snapshot";
+		}
+		else if (header.prog_hash != full_prog_hash(full_prog))
+		{
+			error = "was taken from another program";
+		}
+		else if (len != sizeof header +
+			(size_t)header.frame_count * sizeof(exec_frame_t) +
+			header.st_len)
+		{
+			error = "is cut or corrupted";
+		}
+	}
+	if (error == NULL)
+	{
+		const uint8_t* frames = &data[sizeof header];
+		vm->frame_count = 0;
+		for (unsigned int i = 0; i < header.frame_count; i++)
+		{
+			exec_frame_t frame;
+			memcpy(&frame, &frames[i * sizeof(exec_frame_t)], sizeof frame);
+			if (!frame_is_valid(&frame, full_prog))
+			{
+				error = "is cut or corrupted";
+				break;
+			}
+			vm->frame_count++;
+			DARRAY_RESIZE_IF_NEEDED(vm->frame_count, vm->frame_cap,
+				vm->frame_array, exec_frame_t);
+			vm->frame_array[vm->frame_count-1] = frame;
+		}
+	}
+	if (error == NULL)
+	{
+		const uint8_t* cells =
+			&data[sizeof header + header.frame_count * sizeof(exec_frame_t)];
+		vm->st.len = header.st_len;
+		DARRAY_RESIZE_IF_NEEDED(vm->st.len, vm->st.cap, vm->st.array,
+			uint8_t);
+		ST_UPDATE_PEAK(&vm->st);
+		if (header.st_len > 0)
+		{
+			memcpy(vm->st.array, cells, header.st_len);
+		}
+	}
+	if (data != NULL)
+	{
+		munmap((void*)data, len);
+	}
+	if (error != NULL)
+	{
+		vm->frame_count = 0;
+		fprintf(stderr, "Snapshot error: \"%s\" %s\n", file_path, error);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,35 @@
+
+#ifndef HELV_SNAPSHOT_HEADER
+#define HELV_SNAPSHOT_HEADER
+
+#include "prog.h"
+#include "interpreter.h"
+
+/* A snapshot is the state of an execution saved to a file by the snapshot
+ * instruction, for a later execution of the same full program to continue
+ * from there instead of doing again what came before (a warm start).
+ *
+ * When the snapshot instruction is executed, the executions return one after
+ * the other (each one adding its frame to the execution context, see vm_t)
+ * up to execute_full_prog, which writes the snapshot and then continues the
+ * execution from the frames. So taking a snapshot costs nothing to the
+ * executions that do not take one.
+ *
+ * The file holds a hash of the full program, the frames and the stack, in the
+ * byte order of the machine. Tasks and coroutines are not saved, so there
+ * must be none when a snapshot is taken. */
+
+/* Writes the snapshot of the given suspended execution to the given file
+ * (through a temporary file, so the file is either the old or the new one).
+ * Returns 0 on success, or prints an error and returns -1. */
+int snapshot_write(const char* file_path, const full_prog_t* full_prog,
+	const vm_t* vm);
+
+/* Maps the given snapshot file and sets the stack and the frames of the
+ * given execution context from it, for execute_restored to continue it.
+ * The snapshot must be of the given full program.
+ * Returns 0 on success, or prints an error and returns -1. */
+int snapshot_restore(const char* file_path, const full_prog_t* full_prog,
+	vm_t* vm);
+
+#endif /* HELV_SNAPSHOT_HEADER */
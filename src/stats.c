@@ -0,0 +1,85 @@
+
+#include "stats.h"
+#include "utils.h"
+#include "interpreter.h"
+#include <stdio.h>
+
+static const char* stats_phase_name(stats_phase_t phase)
+{
+	switch (phase)
+	{
+		case STATS_PHASE_READ:     return "read";
+		case STATS_PHASE_PARSE:    return "parse";
+		case STATS_PHASE_OPTIMIZE: return "optimize";
+		case STATS_PHASE_EXECUTE:  return "execute";
+		case STATS_PHASE_EMIT:     return "emit";
+		case STATS_PHASE_WRITE:    return "write";
+		default:
+			ASSERT(0, "Invalid phase %d\n", (int)phase);
+			return "unknown";
+	}
+}
+
+void stats_phase_start(stats_t* stats)
+{
+	ASSERT(stats != NULL, "The pointer is NULL\n");
+	stats->phase_start_ms = vm_time_ms();
+}
+
+void stats_phase_end(stats_t* stats, stats_phase_t phase)
+{
+	ASSERT(stats != NULL, "The pointer is NULL\n");
+	ASSERT(phase < NUMBER_OF_STATS_PHASES, "Invalid phase %d\n", (int)phase);
+	stats->phase_ms_array[phase] += vm_time_ms() - stats->phase_start_ms;
+}
+
+void stats_print(const stats_t* stats, FILE* file, int is_json)
+{
+	ASSERT(stats != NULL, "The pointer is NULL\n");
+	ASSERT(file != NULL, "The pointer is NULL\n");
+	unsigned long long alloc_count;
+	unsigned long long alloc_bytes;
+	alloc_stats_get(&alloc_count, &alloc_bytes);
+	double total_ms = 0.0;
+	for (unsigned int i = 0; i < NUMBER_OF_STATS_PHASES; i++)
+	{
+		total_ms += stats->phase_ms_array[i];
+	}
+	if (is_json)
+	{
+		fprintf(file, "{\"phases_ms\": {");
+		for (unsigned int i = 0; i < NUMBER_OF_STATS_PHASES; i++)
+		{
+			fprintf(file, "%s\"%s\": %.3f", i == 0 ? "" : ", ",
+				stats_phase_name(i), stats->phase_ms_array[i]);
+		}
+		fprintf(file, "}, \"total_ms\": %.3f, "
+			"\"alloc_count\": %llu, \"alloc_bytes\": %llu, "
+			"\"prog_count\": %u, \"code_len\": %u, "
+			"\"peak_stack_height\": %u, \"stack_cap\": %u, "
+			"\"c_code_len\": %u}\n",
+			total_ms, alloc_count, alloc_bytes,
+			stats->prog_count, stats->code_len,
+			stats->peak_st_len, stats->st_cap, stats->c_code_len);
+	}
+	else
+	{
+		fprintf(file, "Stats:\n");
+		for (unsigned int i = 0; i < NUMBER_OF_STATS_PHASES; i++)
+		{
+			fprintf(file, "  %-10s%10.3f ms\n",
+				stats_phase_name(i), stats->phase_ms_array[i]);
+		}
+		fprintf(file,
+			"  %-10s%10.3f ms\n"
+			"  Allocations:       %llu (%llu bytes requested)\n"
+			"  Programs:          %u (%u bytes of bytecode)\n"
+			"  Peak stack height: %u (capacity %u)\n"
+			"  C code:            %u bytes\n",
+			"total", total_ms,
+			alloc_count, alloc_bytes,
+			stats->prog_count, stats->code_len,
+			stats->peak_st_len, stats->st_cap,
+			stats->c_code_len);
+	}
+}
@@ -0,0 +1,45 @@
+
+#ifndef HELV_STATS_HEADER
+#define HELV_STATS_HEADER
+
+#include <stdio.h>
+
+/* Statistics of one run of the command line tool, reported by --stats.
+ * The phases are timed with a monotonic clock, the ones that were not done
+ * take no time. Executing a lazily parsed program also parses it, so that
+ * parsing is counted in the execution. */
+
+enum stats_phase_t
+{
+	STATS_PHASE_READ = 0, /* Reading and preprocessing the source. */
+	STATS_PHASE_PARSE,
+	STATS_PHASE_OPTIMIZE,
+	STATS_PHASE_EXECUTE,
+	STATS_PHASE_EMIT,
+	STATS_PHASE_WRITE, /* Writing the C code. */
+	NUMBER_OF_STATS_PHASES
+};
+typedef enum stats_phase_t stats_phase_t;
+
+struct stats_t
+{
+	double phase_ms_array[NUMBER_OF_STATS_PHASES];
+	double phase_start_ms; /* Of the phase being timed. */
+	unsigned int prog_count;
+	unsigned int code_len; /* Bytes of bytecode. */
+	unsigned int peak_st_len; /* Of the main execution (not of its tasks). */
+	unsigned int st_cap;
+	unsigned int c_code_len; /* Bytes of emitted C code. */
+};
+typedef struct stats_t stats_t;
+
+void stats_phase_start(stats_t* stats);
+
+/* Adds the time since the last stats_phase_start to the given phase. */
+void stats_phase_end(stats_t* stats, stats_phase_t phase);
+
+/* Writes the statistics, with the allocation counts (see alloc_stats_get,
+ * they must have been enabled), as text or as a JSON object. */
+void stats_print(const stats_t* stats, FILE* file, int is_json);
+
+#endif /* HELV_STATS_HEADER */
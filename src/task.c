@@ -0,0 +1,242 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "task.h"
+#include "utils.h"
+#include "prog.h"
+#include "interpreter.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h> /* memcpy */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h> /* sysconf */
+
+enum task_state_t
+{
+	TASK_STATE_QUEUED = 0,
+	TASK_STATE_RUNNING,
+	TASK_STATE_DONE,
+};
+typedef enum task_state_t task_state_t;
+
+struct task_t
+{
+	const full_prog_t* full_prog;
+	unsigned int prog_index;
+	vm_t vm;
+	exec_status_t status;
+	task_state_t state;
+	task_t* prev; /* In the queue, while queued. */
+	task_t* next;
+};
+
+struct pool_t
+{
+	pthread_mutex_t mutex; /* Protects the queue and the task states. */
+	pthread_cond_t cond; /* Signaled when a task is queued or done. */
+	task_t* queue_first;
+	task_t* queue_last;
+	pthread_mutex_t output_mutex;
+};
+
+struct steps_t
+{
+	atomic_uint count;
+};
+
+static pool_t the_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.output_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t the_pool_once = PTHREAD_ONCE_INIT;
+
+/* The mutex must be held. */
+static void pool_unqueue(pool_t* pool, task_t* task)
+{
+	if (task->prev == NULL)
+	{
+		pool->queue_first = task->next;
+	}
+	else
+	{
+		task->prev->next = task->next;
+	}
+	if (task->next == NULL)
+	{
+		pool->queue_last = task->prev;
+	}
+	else
+	{
+		task->next->prev = task->prev;
+	}
+	task->prev = NULL;
+	task->next = NULL;
+}
+
+/* Executes the given task, which has been taken by the calling thread.
+ * The mutex must not be held. */
+static void pool_run(pool_t* pool, task_t* task)
+{
+	task->status = execute_prog(task->full_prog, task->prog_index, &task->vm);
+	if (task->vm.shared_steps != NULL && task->vm.fuel > 1)
+	{
+		/* The fuel of the task is the rest of the steps it took. */
+		steps_give_back(task->vm.shared_steps, task->vm.fuel - 1);
+		task->vm.fuel = 1;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	task->state = TASK_STATE_DONE;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void* pool_worker(void* arg)
+{
+	pool_t* pool = arg;
+	pthread_mutex_lock(&pool->mutex);
+	while (1)
+	{
+		while (pool->queue_first == NULL)
+		{
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		task_t* task = pool->queue_first;
+		pool_unqueue(pool, task);
+		task->state = TASK_STATE_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+		pool_run(pool, task);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	return NULL;
+}
+
+static void pool_start_workers(void)
+{
+	long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 1; i < processor_count; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, pool_worker, &the_pool) != 0)
+		{
+			/* Fewer workers is fine, joining threads do the work anyway. */
+			break;
+		}
+		pthread_detach(thread);
+	}
+}
+
+pool_t* pool_get(void)
+{
+	pthread_once(&the_pool_once, pool_start_workers);
+	return &the_pool;
+}
+
+task_t* pool_spawn(pool_t* pool, const full_prog_t* full_prog,
+	unsigned int prog_index, vm_t* vm)
+{
+	ASSERT(pool != NULL, "The pointer is NULL\n");
+	ASSERT_CHECK_FULL_PROG_PTR(full_prog);
+	ASSERT_CHECK_VM_PTR(vm);
+	ASSERT(vm->pool == pool, "The context is not in the pool\n");
+	task_t* task = xmalloc(sizeof(task_t));
+	*task = (task_t){
+		.full_prog = full_prog,
+		.prog_index = prog_index,
+		.vm = *vm,
+		.state = TASK_STATE_QUEUED,
+	};
+	pthread_mutex_lock(&pool->mutex);
+	task->prev = pool->queue_last;
+	if (pool->queue_last == NULL)
+	{
+		pool->queue_first = task;
+	}
+	else
+	{
+		pool->queue_last->next = task;
+	}
+	pool->queue_last = task;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return task;
+}
+
+exec_status_t pool_join(pool_t* pool, task_t* task, st_t* st)
+{
+	ASSERT(pool != NULL, "The pointer is NULL\n");
+	ASSERT(task != NULL, "The pointer is NULL\n");
+	ASSERT_CHECK_ST_PTR(st);
+	pthread_mutex_lock(&pool->mutex);
+	if (task->state == TASK_STATE_QUEUED)
+	{
+		pool_unqueue(pool, task);
+		task->state = TASK_STATE_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+		pool_run(pool, task);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	while (task->state != TASK_STATE_DONE)
+	{
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	exec_status_t status = task->status;
+	st_t* task_st = &task->vm.st;
+	if (task_st->len > 0)
+	{
+		st->len += task_st->len;
+		DARRAY_RESIZE_IF_NEEDED(st->len, st->cap, st->array, uint8_t);
+		ST_UPDATE_PEAK(st);
+		memcpy(&st->array[st->len - task_st->len],
+			task_st->array, task_st->len);
+	}
+	/* This joins the tasks that the task did not join itself. */
+	vm_cleanup(&task->vm);
+	free(task);
+	return status;
+}
+
+void pool_lock_output(pool_t* pool)
+{
+	pthread_mutex_lock(&pool->output_mutex);
+}
+
+void pool_unlock_output(pool_t* pool)
+{
+	pthread_mutex_unlock(&pool->output_mutex);
+}
+
+steps_t* steps_create(unsigned int count)
+{
+	steps_t* steps = xmalloc(sizeof(steps_t));
+	atomic_init(&steps->count, count);
+	return steps;
+}
+
+void steps_destroy(steps_t* steps)
+{
+	free(steps);
+}
+
+unsigned int steps_take(steps_t* steps, unsigned int count)
+{
+	ASSERT(steps != NULL, "The pointer is NULL\n");
+	unsigned int left =
+		atomic_load_explicit(&steps->count, memory_order_relaxed);
+	unsigned int taken;
+	do
+	{
+		taken = left < count ? left : count;
+	}
+	while (taken > 0 && !atomic_compare_exchange_weak_explicit(&steps->count,
+		&left, left - taken, memory_order_relaxed, memory_order_relaxed));
+	return taken;
+}
+
+void steps_give_back(steps_t* steps, unsigned int count)
+{
+	ASSERT(steps != NULL, "The pointer is NULL\n");
+	atomic_fetch_add_explicit(&steps->count, count, memory_order_relaxed);
+}
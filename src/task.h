@@ -0,0 +1,54 @@
+
+#ifndef HELV_TASK_HEADER
+#define HELV_TASK_HEADER
+
+#include "prog.h"
+#include "interpreter.h"
+#include <stdint.h>
+
+/* Pool of worker threads that execute the programs started by the spawn
+ * instruction. There is one pool for the whole process, shared by all the
+ * contexts (such as the jobs of batch mode), so that there are never more
+ * workers than processors. Idle workers take the oldest queued task, and a
+ * thread that joins a task that no worker took yet executes it itself, so
+ * that joining never waits for a task that is not running (nested spawns
+ * cannot deadlock, even with no workers at all). */
+typedef struct pool_t pool_t;
+
+/* A program started by the spawn instruction, in its own execution context. */
+typedef struct task_t task_t;
+
+/* Steps shared by a context and all the tasks it spawned (and theirs), so
+ * that a step limit bounds all of them together rather than each one. */
+typedef struct steps_t steps_t;
+
+/* Returns the pool of the process, the first call starts one worker thread
+ * less than there are processors (the threads that join tasks count as
+ * workers), that run until the process exits. */
+pool_t* pool_get(void);
+
+/* Queues the execution of the given program in the given context, which is
+ * owned by the task from now on (its pool must be the given pool). */
+task_t* pool_spawn(pool_t* pool, const full_prog_t* full_prog,
+	unsigned int prog_index, vm_t* vm);
+
+/* Waits for the end of the given task (executing it if no worker took it yet),
+ * appends the cells of its stack to the given stack, and frees it.
+ * Returns the status of the execution of the task. */
+exec_status_t pool_join(pool_t* pool, task_t* task, st_t* st);
+
+/* Output of the contexts of a pool is serialized, as they share a sink. */
+void pool_lock_output(pool_t* pool);
+void pool_unlock_output(pool_t* pool);
+
+steps_t* steps_create(unsigned int count);
+void steps_destroy(steps_t* steps);
+
+/* Takes up to the given number of steps, and returns how many were taken
+ * (0 once there are no steps left). */
+unsigned int steps_take(steps_t* steps, unsigned int count);
+
+/* Gives back steps that were taken but not used. */
+void steps_give_back(steps_t* steps, unsigned int count);
+
+#endif /* HELV_TASK_HEADER */
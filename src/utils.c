@@ -2,6 +2,58 @@
 #include "utils.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdatomic.h>
+
+#ifdef ENABLE_ASSERT
+	int check_level = CHECK_LEVEL;
+#endif
+
+static int alloc_stats_is_enabled = 0; /* Only set before other threads. */
+static atomic_ullong alloc_count;
+static atomic_ullong alloc_bytes;
+
+#define ALLOC_COUNT(size_) \
+	do \
+	{ \
+		if (alloc_stats_is_enabled) \
+		{ \
+			atomic_fetch_add_explicit(&alloc_count, 1, \
+				memory_order_relaxed); \
+			atomic_fetch_add_explicit(&alloc_bytes, (size_), \
+				memory_order_relaxed); \
+		} \
+	} while (0)
+
+void* xmalloc(size_t size)
+{
+	ALLOC_COUNT(size);
+	return malloc(size);
+}
+
+void* xcalloc(size_t count, size_t size)
+{
+	ALLOC_COUNT(count * size);
+	return calloc(count, size);
+}
+
+void* xrealloc(void* ptr, size_t size)
+{
+	ALLOC_COUNT(size);
+	return realloc(ptr, size);
+}
+
+#undef ALLOC_COUNT
+
+void alloc_stats_enable(void)
+{
+	alloc_stats_is_enabled = 1;
+}
+
+void alloc_stats_get(unsigned long long* count, unsigned long long* bytes)
+{
+	*count = atomic_load_explicit(&alloc_count, memory_order_relaxed);
+	*bytes = atomic_load_explicit(&alloc_bytes, memory_order_relaxed);
+}
 
 unsigned int umax(unsigned int a, unsigned int b)
 {
@@ -11,33 +11,77 @@
 	#define ATTRIBUTE(...)
 #endif
 
-#define xmalloc malloc
-#define xcalloc calloc
-#define xrealloc realloc
+/* The same as the standard allocation functions, except that they count the
+ * allocations (see alloc_stats_get) once enabled, from any thread. */
+void* xmalloc(size_t size);
+void* xcalloc(size_t count, size_t size);
+void* xrealloc(void* ptr, size_t size);
 #define xfree free
 
+/* Makes the functions above count the allocations from now on, it must be
+ * called before any other thread is started. Counting costs two atomic
+ * additions per allocation, that are not done otherwise. */
+void alloc_stats_enable(void);
+
+/* Writes the number of allocations (reallocations included) done by the
+ * functions above since they were enabled, and the sum of their requested
+ * sizes. A reallocation counts its whole new size and frees are not
+ * subtracted, so the bytes measure the allocation traffic rather than the
+ * memory in use (which they exceed). */
+void alloc_stats_get(unsigned long long* count, unsigned long long* bytes);
+
 #ifdef DEBUG
 	#define ENABLE_ASSERT
 #endif
 
+/* Levels of the checks done by assertions, from the cheapest. A check is
+ * only done if the check level (see check_level) is at least its level. */
+#define CHECK_LEVEL_NONE 0
+/* Invariants checked in O(1), the plain ASSERT. */
+#define CHECK_LEVEL_CHEAP 1
+/* Checks as costly as the call they are in (such as the strlen of a growable
+ * string on each append), that can make a linear pass quadratic. */
+#define CHECK_LEVEL_CALL 2
+/* Validation of whole structures (such as every program of a full program)
+ * on each call, for targeted runs. */
+#define CHECK_LEVEL_FULL 3
+
+/* Default check level, can be chosen at build time (-DCHECK_LEVEL=3). It keeps
+ * the debug builds linear by default. */
+#ifndef CHECK_LEVEL
+	#define CHECK_LEVEL CHECK_LEVEL_CHEAP
+#endif
+
 #ifdef ENABLE_ASSERT
+	/* Check level of the run, CHECK_LEVEL unless set otherwise (before any
+	 * other thread is started, see the --check-level option). */
+	extern int check_level;
+
 	/* Not using the standard assert macro just so that we really control if
 	 * assertions are optimized out or not.
 	 * After the condition, printf-like arguments are requiered.
-	 * It is ok for assertions to be expensive, as long as they may catch a bug
-	 * early, they are debug-build-only anyway.
 	 * It is ok for assertions to be redundant, let's abuse assertions,
-	 * lets gooo, C memory safe language confirmed! */
+	 * lets gooo, C memory safe language confirmed!
+	 * Assertions that are not O(1) must go through ASSERT_AT with their level,
+	 * so that debug builds stay usable on big inputs. */
 	#define ASSERT(condition_, ...) \
+		ASSERT_IMPL(CHECK_LEVEL_CHEAP, condition_, #condition_, __VA_ARGS__)
+
+	/* Assertion done only at the given check level (or above). */
+	#define ASSERT_AT(level_, condition_, ...) \
+		ASSERT_IMPL(level_, condition_, #condition_, __VA_ARGS__)
+
+	/* The condition is stringified by the callers, before its expansion. */
+	#define ASSERT_IMPL(level_, condition_, condition_str_, ...) \
 		do \
 		{ \
-			if (!(condition_)) \
+			if (check_level >= (level_) && !(condition_)) \
 			{ \
 				fprintf(stderr, "Assertion failed: " \
 					"At line %d in function %s in file " __FILE__ "\n", \
 					__LINE__, __func__); \
 				fprintf(stderr, "The condition that is false is %s\n", \
-					#condition_); \
+					condition_str_); \
 				fprintf(stderr, __VA_ARGS__); \
 				exit(EXIT_FAILURE); \
 			} \
@@ -48,6 +92,7 @@
 	#define CODE_FOR_ASSERT(statement_) statement_
 #else
 	#define ASSERT(condition_, ...) do { } while (0)
+	#define ASSERT_AT(level_, condition_, ...) do { } while (0)
 	#define CODE_FOR_ASSERT(statement_)
 #endif
 